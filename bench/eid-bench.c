@@ -0,0 +1,657 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "eid.h"
+#include "mock.h"
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <security/pam_appl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char service[] = "eid-bench";
+
+enum {
+    PHASE_SETUP,
+    PHASE_CLIENT,
+    PHASE_SERVICE,
+    PHASE_FINISH,
+    PHASE_TOTAL,
+    PHASE_LAST
+};
+
+static const char *phase_names[PHASE_LAST] = {
+    /* from pam_start() to the eID client's tcTokenURL request */
+    "setup",
+    /* from the eID client's request to the first eService request */
+    "eid-client",
+    /* from the first eService request until the result was sent */
+    "eservice",
+    /* from the result until pam_end() returned */
+    "finish",
+    "total",
+};
+
+struct samples {
+    double *v;
+    size_t count;
+};
+
+static double ms_between(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
+
+static int is_set(const struct timespec *ts)
+{
+    return ts->tv_sec != 0 || ts->tv_nsec != 0;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(struct samples *s, double q)
+{
+    size_t i;
+
+    if (s->count == 0)
+        return 0;
+    i = (size_t) (q * s->count + 0.5);
+    if (i > 0)
+        i--;
+    if (i >= s->count)
+        i = s->count - 1;
+    return s->v[i];
+}
+
+static int conv(int num_msg, const struct pam_message **msg,
+        struct pam_response **resp, void *appdata_ptr)
+{
+    int i;
+
+    for (i = 0; i < num_msg; i++)
+        fprintf(stderr, "%s\n", msg[i]->msg);
+
+    return PAM_CONV_ERR;
+}
+
+static int write_file(const char *filename, int (*write_fn)(struct mock *, const char *),
+        struct mock *mock, uid_t uid, gid_t gid, mode_t mode)
+{
+    return write_fn(mock, filename)
+        && 0 == chown(filename, uid, gid)
+        && 0 == chmod(filename, mode);
+}
+
+/* returns 0 if the path doesn't fit into filename */
+static int join_path(char filename[PATH_MAX], const char *dir,
+        const char *name)
+{
+    int n = snprintf(filename, PATH_MAX, "%s/%s", dir, name);
+
+    return n >= 0 && n < PATH_MAX;
+}
+
+/* enrolls the mock's identity after identities - 1 others */
+static int setup_reference(const struct passwd *pw, struct mock *mock,
+        unsigned long identities)
+{
+    char filename[PATH_MAX];
+    struct auth_reference reference;
+    unsigned char md[AUTH_DIGEST_LENGTH];
+    EVP_MD_CTX *ctx;
+    FILE *file;
+    const void *body;
+    size_t length, hop;
+    int ok = 0;
+
+    ctx = auth_digest_new();
+    if (!ctx)
+        goto err;
+    if (mock->config.replay) {
+        /* the module digests the responses of every hop of the eService */
+        for (hop = 1; (body = mock_replay_body(mock, hop, &length)); hop++) {
+            if (1 != EVP_DigestUpdate(ctx, body, length))
+                goto err;
+        }
+    } else {
+        body = mock_result(&length);
+        if (1 != EVP_DigestUpdate(ctx, body, length))
+            goto err;
+    }
+    if (1 != auth_digest_final(ctx, md))
+        goto err;
+
+    memset(&reference, 0, sizeof reference);
+    while (reference.count + 1 < identities) {
+        md[0]++;
+        auth_reference_add(&reference, md, "other");
+    }
+    md[0] -= reference.count;
+    auth_reference_add(&reference, md, "mock");
+
+    if (0 != auth_mkdir(pw))
+        goto err;
+    file = auth_fopen(pw, "wb");
+    if (!file)
+        goto err;
+    ok = auth_write_reference(file, &reference);
+    if (0 != fclose(file))
+        ok = 0;
+    if (!ok)
+        goto err;
+    ok = 0;
+
+    if (!join_path(filename, pw->pw_dir, ".eid")
+            || 0 != chown(filename, pw->pw_uid, pw->pw_gid))
+        goto err;
+    if (!join_path(filename, pw->pw_dir, ".eid/authorized_eid")
+            || 0 != chown(filename, pw->pw_uid, pw->pw_gid))
+        goto err;
+    if (!join_path(filename, pw->pw_dir, ".eid/authorized_pubkey")
+            || !write_file(filename, mock_write_pubkey, mock,
+                pw->pw_uid, pw->pw_gid, 0644))
+        goto err;
+
+    ok = 1;
+
+err:
+    EVP_MD_CTX_free(ctx);
+
+    return ok;
+}
+
+struct run {
+    struct mock *mock;
+    const char *user;
+    const char *dir;
+    unsigned long iterations;
+    unsigned long next;
+    struct samples *samples;
+    unsigned long *results;
+    /* calls of pam_authenticate() after PAM_INCOMPLETE */
+    unsigned long resumed;
+    /* the mock's timestamps are only meaningful without concurrency */
+    int phases;
+    /* authenticate in a new process each time, like sudo */
+    int fork;
+    /* each authentication on its own terminal */
+    int ttys;
+    pthread_mutex_t lock;
+};
+
+static void record(struct samples *samples, int phase, double ms)
+{
+    samples[phase].v[samples[phase].count++] = ms;
+}
+
+static int authenticate(struct run *run, unsigned long n)
+{
+    struct pam_conv pam_conv = {conv, NULL};
+    pam_handle_t *pamh = NULL;
+    char tty[32];
+    int status;
+
+    status = pam_start_confdir(service, run->user, &pam_conv, run->dir, &pamh);
+    if (PAM_SUCCESS == status && run->ttys) {
+        snprintf(tty, sizeof tty, "/dev/pts/%lu", n);
+        status = pam_set_item(pamh, PAM_TTY, tty);
+    }
+    if (PAM_SUCCESS == status)
+        status = pam_authenticate(pamh, 0);
+    while (PAM_INCOMPLETE == status) {
+        /* with the module's nonblocking option, call again like an
+         * event loop would do */
+        struct timespec delay = {0, 1000000};
+        nanosleep(&delay, NULL);
+        pthread_mutex_lock(&run->lock);
+        run->resumed++;
+        pthread_mutex_unlock(&run->lock);
+        status = pam_authenticate(pamh, 0);
+    }
+    pam_end(pamh, status);
+
+    return status;
+}
+
+/* returns the status of the authentication in a child process */
+static int authenticate_forked(struct run *run, unsigned long n)
+{
+    pid_t pid = fork();
+    int status;
+
+    if (pid < 0)
+        return PAM_SYSTEM_ERR;
+    if (pid == 0)
+        _exit(authenticate(run, n));
+    if (pid != waitpid(pid, &status, 0) || !WIFEXITED(status))
+        return PAM_SYSTEM_ERR;
+
+    return WEXITSTATUS(status);
+}
+
+static void *run_loop(void *arg)
+{
+    struct run *run = arg;
+
+    while (1) {
+        struct mock_times times;
+        struct timespec start, end;
+        unsigned long n;
+        int status;
+
+        pthread_mutex_lock(&run->lock);
+        if (run->next >= run->iterations) {
+            pthread_mutex_unlock(&run->lock);
+            break;
+        }
+        n = run->next++;
+        pthread_mutex_unlock(&run->lock);
+
+        if (run->phases)
+            mock_reset_times(run->mock);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        status = run->fork ? authenticate_forked(run, n) : authenticate(run, n);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        pthread_mutex_lock(&run->lock);
+        if (status >= 0 && status <= PAM_INCOMPLETE)
+            run->results[status]++;
+        record(run->samples, PHASE_TOTAL, ms_between(&start, &end));
+        pthread_mutex_unlock(&run->lock);
+
+        if (!run->phases)
+            continue;
+
+        mock_get(run->mock, &times, NULL);
+        if (is_set(&times.client)) {
+            record(run->samples, PHASE_SETUP, ms_between(&start, &times.client));
+            if (is_set(&times.service_first))
+                record(run->samples, PHASE_CLIENT,
+                        ms_between(&times.client, &times.service_first));
+        }
+        if (is_set(&times.service_first) && is_set(&times.service_done))
+            record(run->samples, PHASE_SERVICE,
+                    ms_between(&times.service_first, &times.service_done));
+        if (is_set(&times.service_done))
+            record(run->samples, PHASE_FINISH,
+                    ms_between(&times.service_done, &end));
+    }
+
+    return NULL;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [options] MODULE\n"
+            "\n"
+            "Measures the latency of pam_authenticate() with the eid-pam MODULE\n"
+            "against a local stand-in for the eID client and the eService.\n"
+            "~/.eid of the user is temporarily replaced and restored afterwards.\n"
+            "\n"
+            "  -n, --iterations N     number of authentications (default 100)\n"
+            "  -u, --user USER        user to authenticate (default: current user)\n"
+            "  -t, --threads N        concurrent authentications; with N > 1 only\n"
+            "                         the total latency is reported (default 1)\n"
+            "  -o, --options OPTIONS  additional module options\n"
+            "  -b, --broker EID-PAMD  authenticate through eid-pamd, which is\n"
+            "                         started on a private socket\n"
+            "  -F, --fork             authenticate in a new process each time,\n"
+            "                         without connections of the previous ones\n"
+            "  -T, --ttys             authenticate each time on another terminal\n"
+            "  --client-port PORT     port of the eID client (default 24727)\n"
+            "  --client-socket PATH   UNIX domain socket of the eID client instead\n"
+            "  --service-port PORT    port of the eService (default 24443)\n"
+            "  --hops N               redirects within the eService (default 1)\n"
+            "  --client-delay MS      delay of the eID client's response\n"
+            "  --service-delay MS     delay of each eService response\n"
+            "  --connect-delay MS     delay of the eService's TLS handshake\n"
+            "  --chunk-size BYTES     split the result into chunks\n"
+            "  --chunk-delay MS       delay between chunks\n"
+            "  --fail-percent P       fail P percent of the eService requests\n"
+            "  --replay FILE          serve the hops of a capture (capture=DIR)\n"
+            "                         instead of the redirects and the result\n"
+            "  --replay-speed F       replay F times faster, 0 without delays\n"
+            "                         (default 1)\n"
+            "  --identities N         enroll N - 1 other identities first\n",
+            name);
+}
+
+/* starts eid-pamd with the same options as the module and waits until it
+ * accepts connections */
+static pid_t start_broker(const char *program, const char *path,
+        const char *dir, const struct mock_config *config,
+        const char *module_options)
+{
+    char cainfo[PATH_MAX], resolve[300], tctoken_url[300];
+    char *copy, *arg, *args[64];
+    struct sockaddr_un addr;
+    struct timespec delay = {0, 10*1000*1000};
+    pid_t pid;
+    int i, fd, n = 0;
+
+    if (strlen(path) >= sizeof addr.sun_path)
+        return -1;
+    snprintf(cainfo, sizeof cainfo, "cainfo=%s/ca.pem", dir);
+    snprintf(resolve, sizeof resolve, "resolve=%s:%u:127.0.0.1",
+            config->service_host, config->service_port);
+    snprintf(tctoken_url, sizeof tctoken_url,
+            "tctoken_url=https://%s:%u/tcToken", config->service_host, config->service_port);
+
+    pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        args[n++] = (char *) program;
+        args[n++] = "-s";
+        args[n++] = (char *) path;
+        args[n++] = cainfo;
+        args[n++] = resolve;
+        args[n++] = tctoken_url;
+        /* the options of the module itself aren't passed to eid-pamd */
+        copy = strdup(module_options);
+        if (!copy)
+            _exit(1);
+        for (arg = strtok(copy, " "); arg && n < 63; arg = strtok(NULL, " "))
+            if (0 != strcmp(arg, "nonblocking")
+                    && 0 != strncmp(arg, "broker=", 7))
+                args[n++] = arg;
+        args[n] = NULL;
+        execv(program, args);
+        fprintf(stderr, "Failed to run %s: %s\n", program, strerror(errno));
+        _exit(1);
+    }
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    for (i = 0; i < 500; i++) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            break;
+        if (0 == connect(fd, (struct sockaddr *) &addr, sizeof addr)) {
+            /* the broker drops the incomplete request */
+            close(fd);
+            return pid;
+        }
+        close(fd);
+        if (0 != waitpid(pid, NULL, WNOHANG))
+            return -1;
+        nanosleep(&delay, NULL);
+    }
+
+    fprintf(stderr, "%s didn't start\n", program);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    struct mock_config config = MOCK_CONFIG_DEFAULT;
+    struct mock mock;
+    struct samples samples[PHASE_LAST];
+    struct mock_stats stats;
+    struct passwd *pw;
+    const char *user = NULL, *module_options = "", *broker = NULL,
+          *replay = NULL;
+    struct capture *capture = NULL;
+    char broker_socket[PATH_MAX] = "";
+    pid_t broker_pid = -1;
+    char dir[] = "/tmp/eid-bench.XXXXXX";
+    char filename[PATH_MAX], eid_dir[PATH_MAX], backup[PATH_MAX];
+    unsigned long iterations = 100, threads = 1, identities = 1, i,
+                  results[PAM_INCOMPLETE + 1];
+    struct run run = {NULL};
+    int c, backed_up = 0, prepared = 0, dir_created = 0, mock_started = 0, r = 1;
+    FILE *file;
+    static const struct option options[] = {
+        {"iterations", required_argument, NULL, 'n'},
+        {"user", required_argument, NULL, 'u'},
+        {"threads", required_argument, NULL, 't'},
+        {"options", required_argument, NULL, 'o'},
+        {"broker", required_argument, NULL, 'b'},
+        {"fork", no_argument, NULL, 'F'},
+        {"ttys", no_argument, NULL, 'T'},
+        {"client-port", required_argument, NULL, 'c'},
+        {"client-socket", required_argument, NULL, 'S'},
+        {"service-port", required_argument, NULL, 's'},
+        {"hops", required_argument, NULL, 'r'},
+        {"client-delay", required_argument, NULL, 'd'},
+        {"service-delay", required_argument, NULL, 'D'},
+        {"connect-delay", required_argument, NULL, 'L'},
+        {"chunk-size", required_argument, NULL, 'k'},
+        {"chunk-delay", required_argument, NULL, 'K'},
+        {"fail-percent", required_argument, NULL, 'f'},
+        {"replay", required_argument, NULL, 'R'},
+        {"replay-speed", required_argument, NULL, 'V'},
+        {"identities", required_argument, NULL, 'i'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    memset(samples, 0, sizeof samples);
+    memset(results, 0, sizeof results);
+
+    while (-1 != (c = getopt_long(argc, argv, "n:u:t:o:b:FTh", options, NULL))) {
+        switch (c) {
+            case 'n': iterations = strtoul(optarg, NULL, 10); break;
+            case 'u': user = optarg; break;
+            case 't': threads = strtoul(optarg, NULL, 10); break;
+            case 'o': module_options = optarg; break;
+            case 'b': broker = optarg; break;
+            case 'F': run.fork = 1; break;
+            case 'T': run.ttys = 1; break;
+            case 'c': config.client_port = atoi(optarg); break;
+            case 'S': config.client_socket = optarg; break;
+            case 's': config.service_port = atoi(optarg); break;
+            case 'r': config.hops = atoi(optarg); break;
+            case 'd': config.client_delay = atoi(optarg); break;
+            case 'D': config.service_delay = atoi(optarg); break;
+            case 'L': config.connect_delay = atoi(optarg); break;
+            case 'k': config.chunk_size = atoi(optarg); break;
+            case 'K': config.chunk_delay = atoi(optarg); break;
+            case 'f': config.fail_percent = atoi(optarg); break;
+            case 'R': replay = optarg; break;
+            case 'V': config.replay_speed = atof(optarg); break;
+            case 'i': identities = strtoul(optarg, NULL, 10); break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind + 1 != argc || iterations == 0 || threads == 0
+            || identities == 0 || identities > AUTH_REFERENCE_MAX) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    pw = user ? getpwnam(user) : getpwuid(getuid());
+    if (!pw || !pw->pw_dir) {
+        fprintf(stderr, "Unknown user\n");
+        return 1;
+    }
+    user = strdup(pw->pw_name);
+    if (!user)
+        return 1;
+
+    for (i = 0; i < PHASE_LAST; i++) {
+        samples[i].v = calloc(iterations, sizeof *samples[i].v);
+        if (!samples[i].v)
+            goto err;
+    }
+
+    if (replay) {
+        capture = capture_read(replay);
+        if (!capture) {
+            fprintf(stderr, "Failed to read %s: %s\n", replay,
+                    strerror(errno));
+            goto err;
+        }
+        config.replay = capture;
+    }
+
+    /* the module may give up while a delayed response is pending */
+    signal(SIGPIPE, SIG_IGN);
+    if (!mock_start(&mock, &config))
+        goto err;
+    mock_started = 1;
+
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "Failed to create %s\n", dir);
+        goto err;
+    }
+    dir_created = 1;
+    /* the module reads the CA file with the user's privileges */
+    if (0 != chmod(dir, 0755))
+        goto err;
+
+    if (!join_path(eid_dir, pw->pw_dir, ".eid")
+            || !join_path(backup, pw->pw_dir, ".eid.eid-bench")) {
+        fprintf(stderr, "Home directory of %s is too long\n", pw->pw_name);
+        goto err;
+    }
+    if (0 == rename(eid_dir, backup)) {
+        backed_up = 1;
+    } else if (errno != ENOENT) {
+        fprintf(stderr, "Failed to back up %s: %s\n", eid_dir, strerror(errno));
+        goto err;
+    }
+    prepared = 1;
+
+    if (!setup_reference(pw, &mock, identities)) {
+        fprintf(stderr, "Failed to set up %s\n", eid_dir);
+        goto err;
+    }
+
+    snprintf(filename, sizeof filename, "%s/ca.pem", dir);
+    if (!write_file(filename, mock_write_cert, &mock, 0, 0, 0644))
+        goto err;
+
+    snprintf(filename, sizeof filename, "%s/%s", dir, service);
+    file = fopen(filename, "w");
+    if (!file)
+        goto err;
+    if (broker) {
+        snprintf(broker_socket, sizeof broker_socket, "%s/broker.sock", dir);
+        broker_pid = start_broker(broker, broker_socket, dir, &config,
+                module_options);
+        if (broker_pid < 0)
+            goto err;
+    }
+    /* without --broker, make sure that a system wide eid-pamd isn't used */
+    /* the eService of the mock is trusted as an on-premises one */
+    fprintf(file, "auth required %s cainfo=%s/ca.pem resolve=%s:%u:127.0.0.1 "
+            "tctoken_url=https://%s:%u/tcToken broker=%s %s\n",
+            argv[optind], dir, config.service_host, config.service_port,
+            config.service_host, config.service_port, broker_socket,
+            module_options);
+    if (0 != fclose(file))
+        goto err;
+
+    run.mock = &mock;
+    run.user = user;
+    run.dir = dir;
+    run.iterations = iterations;
+    run.samples = samples;
+    run.results = results;
+    run.phases = threads == 1;
+    pthread_mutex_init(&run.lock, NULL);
+
+    if (threads == 1) {
+        run_loop(&run);
+    } else {
+        pthread_t *tids = calloc(threads, sizeof *tids);
+        if (!tids)
+            goto err;
+        for (i = 0; i < threads; i++) {
+            if (0 != pthread_create(&tids[i], NULL, run_loop, &run)) {
+                fprintf(stderr, "Failed to start thread\n");
+                threads = i;
+                break;
+            }
+        }
+        for (i = 0; i < threads; i++)
+            pthread_join(tids[i], NULL);
+        free(tids);
+    }
+
+    printf("%-12s %8s %10s %10s %10s\n", "phase", "samples",
+            "p50 [ms]", "p95 [ms]", "p99 [ms]");
+    for (i = 0; i < PHASE_LAST; i++) {
+        qsort(samples[i].v, samples[i].count, sizeof *samples[i].v,
+                compare_double);
+        printf("%-12s %8zu %10.3f %10.3f %10.3f\n", phase_names[i],
+                samples[i].count,
+                percentile(&samples[i], .50),
+                percentile(&samples[i], .95),
+                percentile(&samples[i], .99));
+    }
+
+    printf("\n");
+    for (i = 0; i <= PAM_INCOMPLETE; i++) {
+        if (results[i])
+            printf("%-26s %lu\n", pam_strerror(NULL, i), results[i]);
+    }
+    if (run.resumed)
+        printf("%-26s %lu\n", "Resumed after incomplete", run.resumed);
+
+    mock_get(&mock, NULL, &stats);
+    printf("\n"
+            "eID client requests        %lu\n"
+            "eService requests          %lu\n"
+            "eService HEAD requests     %lu\n"
+            "eService failures injected %lu\n"
+            "TLS handshakes             %lu\n"
+            "TLS sessions resumed       %lu\n",
+            stats.client_requests, stats.service_requests,
+            stats.head_requests, stats.failures,
+            stats.handshakes, stats.resumed);
+
+    r = results[PAM_SUCCESS] ? 0 : 1;
+
+err:
+    if (broker_pid > 0) {
+        kill(broker_pid, SIGTERM);
+        waitpid(broker_pid, NULL, 0);
+        unlink(broker_socket);
+    }
+    if (mock_started)
+        mock_stop(&mock);
+    if (prepared) {
+        if (join_path(filename, eid_dir, "authorized_eid"))
+            unlink(filename);
+        if (join_path(filename, eid_dir, "authorized_pubkey"))
+            unlink(filename);
+        rmdir(eid_dir);
+        if (backed_up && 0 != rename(backup, eid_dir))
+            fprintf(stderr, "Failed to restore %s from %s\n", eid_dir, backup);
+    }
+    if (dir_created) {
+        snprintf(filename, sizeof filename, "%s/ca.pem", dir);
+        unlink(filename);
+        snprintf(filename, sizeof filename, "%s/%s", dir, service);
+        unlink(filename);
+        rmdir(dir);
+    }
+    for (i = 0; i < PHASE_LAST; i++)
+        free(samples[i].v);
+    capture_free(capture);
+
+    return r;
+}
@@ -0,0 +1,213 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "authenticate.h"
+#include "eid.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Feeds responses of the eService to auth_compare() and eid_match_update()
+ * as a whole, byte by byte, split at every offset and in random chunks. The
+ * verdict must not depend on how the body was split. */
+
+static const char result_ok[] =
+    "<ns3:ResultMajor>http://www.bsi.bund.de/ecard/api/1.1/resultmajor#ok"
+    "</ns3:ResultMajor>";
+
+static unsigned long failures;
+
+/* returns the size of the next chunk */
+typedef size_t (*split_fn)(size_t offset, size_t left, void *ctx);
+
+static size_t split_fixed(size_t offset, size_t left, void *ctx)
+{
+    size_t size = *(size_t *) ctx;
+
+    (void) offset;
+    return size && size < left ? size : left;
+}
+
+static size_t split_at(size_t offset, size_t left, void *ctx)
+{
+    size_t at = *(size_t *) ctx;
+
+    return offset < at && at - offset < left ? at - offset : left;
+}
+
+static size_t split_random(size_t offset, size_t left, void *ctx)
+{
+    unsigned int *seed = ctx;
+    size_t size;
+
+    (void) offset;
+    *seed = *seed * 1103515245 + 12345;
+    size = 1 + (*seed >> 16) % 97;
+    return size < left ? size : left;
+}
+
+static int compare(const struct auth_reference *reference, const char *body,
+        size_t length, split_fn split, void *ctx)
+{
+    struct auth_status status;
+    size_t offset, n;
+    int verdict;
+
+    memset(&status, 0, sizeof status);
+    status.reference = *reference;
+    if (1 != auth_status_start(&status))
+        abort();
+    for (offset = 0; offset < length; offset += n) {
+        n = split(offset, length - offset, ctx);
+        if (n != auth_compare((char *) body + offset, 1, n, &status))
+            abort();
+    }
+    verdict = auth_status_verdict(&status);
+    /* the reference belongs to the caller */
+    status.reference.data = NULL;
+    auth_status_free(&status);
+
+    return verdict;
+}
+
+static void check(const char *name, const struct auth_reference *reference,
+        const char *body, int expected)
+{
+    size_t length = strlen(body), size, at;
+    unsigned int seed;
+    int i;
+
+    for (size = 0; size <= 1; size++) {
+        if (expected != compare(reference, body, length, split_fixed, &size)) {
+            fprintf(stderr, "%s: wrong verdict with chunks of %zu\n", name,
+                    size ? size : length);
+            failures++;
+        }
+    }
+    for (at = 1; at < length; at++) {
+        if (expected != compare(reference, body, length, split_at, &at)) {
+            fprintf(stderr, "%s: wrong verdict when split at %zu\n", name, at);
+            failures++;
+        }
+    }
+    for (i = 0; i < 100; i++) {
+        seed = i;
+        if (expected != compare(reference, body, length, split_random,
+                    &seed)) {
+            fprintf(stderr, "%s: wrong verdict with random chunks (seed %d)\n",
+                    name, i);
+            failures++;
+        }
+    }
+}
+
+static void check_digest(const char *name, const char *enrolled,
+        const char *body, int expected)
+{
+    struct auth_reference reference;
+    unsigned char md[AUTH_DIGEST_LENGTH];
+    EVP_MD_CTX *ctx = auth_digest_new();
+
+    memset(&reference, 0, sizeof reference);
+    if (!ctx || 1 != EVP_DigestUpdate(ctx, enrolled, strlen(enrolled))
+            || 1 != auth_digest_final(ctx, md)
+            || 1 != auth_reference_add(&reference, md, NULL))
+        abort();
+    EVP_MD_CTX_free(ctx);
+
+    check(name, &reference, body, expected);
+}
+
+static void check_legacy(const char *name, const char *enrolled,
+        const char *body, int expected)
+{
+    struct auth_reference reference;
+
+    memset(&reference, 0, sizeof reference);
+    reference.data = (const unsigned char *) enrolled;
+    reference.length = strlen(enrolled);
+
+    check(name, &reference, body, expected);
+}
+
+static void check_match(const char *needle, const char *haystack)
+{
+    struct eid_match match;
+    size_t length = strlen(haystack), offset, n, size;
+    int expected = NULL != strstr(haystack, needle);
+    unsigned int seed = 0;
+    int found;
+
+    for (size = 0; size <= length + 1; size++) {
+        if (1 != eid_match_init(&match, needle))
+            abort();
+        found = 0;
+        for (offset = 0; offset < length; offset += n) {
+            n = size == length + 1
+                ? split_random(offset, length - offset, &seed)
+                : split_fixed(offset, length - offset, &size);
+            found = eid_match_update(&match, haystack + offset, n);
+        }
+        if (found != expected) {
+            fprintf(stderr, "\"%s\" in \"%s\": %s with chunks of %zu\n",
+                    needle, haystack, found ? "found" : "not found", size);
+            failures++;
+        }
+    }
+}
+
+int main(void)
+{
+    static const char prefix[] =
+        "<?xml version=\"1.0\"?><ns3:Result>"
+        /* partial matches of the needle, which need the failure function */
+        "<ns3:ResultMajor>http://www.bsi.bund.de/ecard/api/1.1/resultmajor#"
+        "<ns3:ResultMajor>http://www.bsi.bund.de/ecard/api/1.1/resultmajor#o"
+        "</ns3:ResultMajor><ns3:ResultMajor>http://";
+    static const char suffix[] =
+        "</ns3:Result><ns3:RestrictedID>0123456789</ns3:RestrictedID>";
+    char ok[1024], other[1024], missing[1024], partial[1024];
+
+    snprintf(ok, sizeof ok, "%s%s%s", prefix, result_ok, suffix);
+    /* the same length, a different person */
+    snprintf(other, sizeof other, "%s%s%s", prefix, result_ok, suffix);
+    *strstr(other, "0123456789") = '1';
+    snprintf(missing, sizeof missing, "%s%s", prefix, suffix);
+    /* the result without its last byte */
+    snprintf(partial, sizeof partial, "%s%.*s", prefix,
+            (int) sizeof result_ok - 2, result_ok);
+
+    check_digest("digest", ok, ok, 1);
+    check_digest("digest, other person", ok, other, 0);
+    check_digest("digest, missing result", ok, missing, -1);
+    check_digest("digest, partial result", ok, partial, -1);
+    check_digest("digest, prefix of the reference", ok, prefix, -1);
+
+    check_legacy("legacy", ok, ok, 1);
+    check_legacy("legacy, other person", ok, other, 0);
+    check_legacy("legacy, missing result", ok, missing, 0);
+    check_legacy("legacy, partial result", ok, partial, -1);
+    /* the whole reference has to be received */
+    snprintf(partial, sizeof partial, "%s%s", prefix, result_ok);
+    check_legacy("legacy, truncated", ok, partial, 0);
+    check_legacy("legacy, longer than the reference", partial, ok, 0);
+
+    check_match("abab", "abaabab");
+    check_match("abab", "abaaba");
+    check_match("aaab", "aaaaaab");
+    check_match("aaab", "aaaaaaa");
+    check_match("abcabd", "abcabcabd");
+    check_match("abcabd", "abcabcab");
+    check_match("a", "bbba");
+    check_match(result_ok, ok);
+    check_match(result_ok, missing);
+    check_match(result_ok, partial);
+
+    if (failures) {
+        fprintf(stderr, "%lu failures\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
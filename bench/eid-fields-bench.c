@@ -0,0 +1,138 @@
+/* for memmem() */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "eid.h"
+#include "mock.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [options]\n"
+            "\n"
+            "Compares the extraction of the personal data from the eService's "
+            "result with\na search per field and chunk against the streaming "
+            "tokenizer.\n"
+            "\n"
+            "  -n, --iterations N     responses to process (default 100000)\n"
+            "  --chunk-size BYTES     split the result into chunks\n",
+            name);
+}
+
+static const char *const tags[][2] = {
+    {"<GivenNames>", "</GivenNames>"},
+    {"<FamilyNames>", "</FamilyNames>"},
+    {"<DateOfBirth>", "</DateOfBirth>"},
+    {"<DateOfExpiry>", "</DateOfExpiry>"},
+    {"<RestrictedID>", "</RestrictedID>"},
+};
+
+/* the previous approach of eid-add, with a bounded search */
+static unsigned long search(const char *chunk, size_t count)
+{
+    const char *data, *end;
+    unsigned long found = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof tags/sizeof *tags; i++) {
+        data = memmem(chunk, count, tags[i][0], strlen(tags[i][0]));
+        if (!data)
+            continue;
+        data += strlen(tags[i][0]);
+        end = memmem(data, count - (data - chunk), tags[i][1],
+                strlen(tags[i][1]));
+        if (end)
+            found++;
+    }
+
+    return found;
+}
+
+static void count_field(void *ctx, enum eid_field field, const char *data,
+        size_t length, int final)
+{
+    if (final)
+        (*(unsigned long *) ctx)++;
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e9
+        + (now.tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long iterations = 100000, i, found;
+    size_t length, chunk_size = 0, offset, n;
+    const char *result = mock_result(&length);
+    struct eid_fields fields;
+    struct timespec start;
+    double ns;
+    int c;
+    static const struct option options[] = {
+        {"iterations", required_argument, NULL, 'n'},
+        {"chunk-size", required_argument, NULL, 'k'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    while (-1 != (c = getopt_long(argc, argv, "n:h", options, NULL))) {
+        switch (c) {
+            case 'n': iterations = strtoul(optarg, NULL, 10); break;
+            case 'k': chunk_size = strtoul(optarg, NULL, 10); break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc || iterations == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (chunk_size == 0 || chunk_size > length)
+        chunk_size = length;
+
+    printf("method      ns/response   MB/s   fields found\n");
+
+    found = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iterations; i++) {
+        for (offset = 0; offset < length; offset += n) {
+            n = length - offset < chunk_size ? length - offset : chunk_size;
+            found += search(result + offset, n);
+        }
+    }
+    ns = elapsed(&start) / iterations;
+    printf("search    %11.0f %8.1f   %lu/%lu\n", ns, length / ns * 1e3,
+            found / iterations, (unsigned long) (sizeof tags/sizeof *tags));
+
+    found = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iterations; i++) {
+        eid_fields_init(&fields, EID_FIELD(EID_FIELD_GIVEN_NAMES)
+                | EID_FIELD(EID_FIELD_FAMILY_NAMES)
+                | EID_FIELD(EID_FIELD_DATE_OF_BIRTH)
+                | EID_FIELD(EID_FIELD_DATE_OF_EXPIRY)
+                | EID_FIELD(EID_FIELD_RESTRICTED_ID), count_field, &found);
+        for (offset = 0; offset < length; offset += n) {
+            n = length - offset < chunk_size ? length - offset : chunk_size;
+            eid_fields_update(&fields, result + offset, n);
+        }
+        eid_fields_finish(&fields);
+    }
+    ns = elapsed(&start) / iterations;
+    printf("tokenizer %11.0f %8.1f   %lu/%lu\n", ns, length / ns * 1e3,
+            found / iterations, (unsigned long) (sizeof tags/sizeof *tags));
+
+    return 0;
+}
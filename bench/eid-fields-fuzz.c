@@ -0,0 +1,112 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "eid.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Fuzz target of the field tokenizer. The input is tokenized as a whole and
+ * in chunks, whose sizes are taken from the first byte. Both must yield the
+ * same fields and all pieces must point into the chunk being processed.
+ *
+ * Built with -DEID_FUZZ_LIBFUZZER and -fsanitize=fuzzer for libFuzzer,
+ * otherwise the inputs are read from the files on the command line. */
+
+struct collected {
+    const char *chunk;
+    size_t chunk_length;
+    char values[EID_FIELDS][1024];
+    size_t lengths[EID_FIELDS];
+    unsigned int final;
+};
+
+static void collect(void *ctx, enum eid_field field, const char *data,
+        size_t length, int final)
+{
+    struct collected *c = ctx;
+
+    if (field >= EID_FIELDS || (c->final & EID_FIELD(field)))
+        abort();
+    /* the pieces are not copied */
+    if (length > 0 && (data < c->chunk
+                || data + length > c->chunk + c->chunk_length))
+        abort();
+
+    if (length > sizeof c->values[field] - c->lengths[field])
+        length = sizeof c->values[field] - c->lengths[field];
+    memcpy(c->values[field] + c->lengths[field], data, length);
+    c->lengths[field] += length;
+    if (final)
+        c->final |= EID_FIELD(field);
+}
+
+static void tokenize(struct collected *c, const uint8_t *data, size_t size,
+        size_t chunk_size)
+{
+    struct eid_fields fields;
+    size_t offset, n;
+
+    memset(c, 0, sizeof *c);
+    eid_fields_init(&fields, EID_FIELD(EID_FIELDS) - 1, collect, c);
+    for (offset = 0; offset < size; offset += n) {
+        n = size - offset < chunk_size ? size - offset : chunk_size;
+        c->chunk = (const char *) data + offset;
+        c->chunk_length = n;
+        eid_fields_update(&fields, data + offset, n);
+    }
+    eid_fields_finish(&fields);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static struct collected whole, chunked;
+    size_t chunk_size;
+
+    if (size < 1)
+        return 0;
+    chunk_size = data[0] ? data[0] : 1;
+    data++;
+    size--;
+
+    tokenize(&whole, data, size, size ? size : 1);
+    tokenize(&chunked, data, size, chunk_size);
+
+    if (whole.final != chunked.final
+            || 0 != memcmp(whole.lengths, chunked.lengths,
+                sizeof whole.lengths)
+            || 0 != memcmp(whole.values, chunked.values, sizeof whole.values))
+        abort();
+
+    return 0;
+}
+
+#ifndef EID_FUZZ_LIBFUZZER
+int main(int argc, char **argv)
+{
+    static uint8_t buf[1 << 20];
+    FILE *file;
+    size_t size;
+    int i;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s file...\n", argv[0]);
+        return 1;
+    }
+
+    for (i = 1; i < argc; i++) {
+        file = fopen(argv[i], "rb");
+        if (!file) {
+            perror(argv[i]);
+            return 1;
+        }
+        size = fread(buf, 1, sizeof buf, file);
+        fclose(file);
+        LLVMFuzzerTestOneInput(buf, size);
+    }
+
+    return 0;
+}
+#endif
@@ -0,0 +1,228 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <getopt.h>
+#include <limits.h>
+#include <security/pam_appl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char service[] = "eid-load-bench";
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [options] MODULE\n"
+            "\n"
+            "Measures what loading the eid-pam MODULE costs a process, which "
+            "never calls\ninto it because pam_permit.so before it is "
+            "`sufficient`. Each sample runs\npam_start(), pam_authenticate() "
+            "and pam_end() in a new process, with and\nwithout MODULE in the "
+            "stack.\n"
+            "\n"
+            "  -n, --iterations N     processes per stack (default 50)\n",
+            name);
+}
+
+struct sample {
+    double ms;
+    long rss_kb;
+    int libraries;
+    int curl;
+};
+
+static double ms_between(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
+
+static long rss_kb(void)
+{
+    char line[256];
+    long kb = -1;
+    FILE *file = fopen("/proc/self/status", "r");
+
+    if (!file)
+        return -1;
+    while (fgets(line, sizeof line, file)) {
+        if (1 == sscanf(line, "VmRSS: %ld kB", &kb))
+            break;
+    }
+    fclose(file);
+
+    return kb;
+}
+
+/* counts the shared objects mapped into the process */
+static void count_libraries(struct sample *sample)
+{
+    char line[PATH_MAX + 128], last[PATH_MAX] = "";
+    const char *path;
+    FILE *file = fopen("/proc/self/maps", "r");
+
+    if (!file)
+        return;
+    while (fgets(line, sizeof line, file)) {
+        path = strchr(line, '/');
+        if (!path || !strstr(path, ".so"))
+            continue;
+        /* the segments of a library are adjacent */
+        if (0 == strcmp(path, last))
+            continue;
+        snprintf(last, sizeof last, "%s", path);
+        sample->libraries++;
+        if (strstr(path, "libcurl"))
+            sample->curl = 1;
+    }
+    fclose(file);
+}
+
+static int measure(const char *dir, struct sample *sample)
+{
+    struct pam_conv conv = {NULL, NULL};
+    struct timespec start, end;
+    pam_handle_t *pamh = NULL;
+    long before;
+    int fds[2], status;
+    pid_t pid;
+
+    if (0 != pipe(fds))
+        return 0;
+
+    pid = fork();
+    if (pid < 0)
+        return 0;
+    if (pid == 0) {
+        memset(sample, 0, sizeof *sample);
+        before = rss_kb();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (PAM_SUCCESS == pam_start_confdir(service, "nobody", &conv, dir,
+                    &pamh)) {
+            pam_authenticate(pamh, PAM_SILENT);
+            count_libraries(sample);
+            sample->rss_kb = rss_kb() - before;
+            pam_end(pamh, PAM_SUCCESS);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        sample->ms = ms_between(&start, &end);
+        _exit(sizeof *sample == write(fds[1], sample, sizeof *sample)
+                ? 0 : 1);
+    }
+
+    close(fds[1]);
+    status = sizeof *sample == read(fds[0], sample, sizeof *sample);
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+
+    return status;
+}
+
+static int write_stack(const char *dir, const char *module)
+{
+    char filename[PATH_MAX];
+    FILE *file;
+
+    snprintf(filename, sizeof filename, "%s/%s", dir, service);
+    file = fopen(filename, "w");
+    if (!file)
+        return 0;
+    fprintf(file, "auth sufficient pam_permit.so\n");
+    if (module)
+        fprintf(file, "auth required %s\n", module);
+
+    return 0 == fclose(file);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+static int run(const char *dir, const char *name, const char *module,
+        unsigned long iterations)
+{
+    struct sample sample;
+    double *ms = calloc(iterations, sizeof *ms);
+    long *rss = calloc(iterations, sizeof *rss);
+    unsigned long i, curl = 0;
+    int libraries = 0, ok = 0;
+
+    if (!ms || !rss || !write_stack(dir, module))
+        goto err;
+
+    for (i = 0; i < iterations; i++) {
+        if (!measure(dir, &sample)) {
+            fprintf(stderr, "Failed to measure %s\n", name);
+            goto err;
+        }
+        ms[i] = sample.ms;
+        rss[i] = sample.rss_kb;
+        libraries = sample.libraries;
+        curl += sample.curl;
+    }
+    qsort(ms, iterations, sizeof *ms, compare_double);
+    qsort(rss, iterations, sizeof *rss, compare_long);
+
+    printf("%-12s %10.3f %10.3f %10ld %10d %10s\n", name,
+            ms[iterations / 2], ms[iterations * 95 / 100], rss[iterations / 2],
+            libraries, curl ? "yes" : "no");
+    ok = 1;
+
+err:
+    free(ms);
+    free(rss);
+
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    char dir[] = "/tmp/eid-load-bench.XXXXXX", filename[PATH_MAX];
+    unsigned long iterations = 50;
+    int c, r = 1;
+    static const struct option options[] = {
+        {"iterations", required_argument, NULL, 'n'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    while (-1 != (c = getopt_long(argc, argv, "n:h", options, NULL))) {
+        switch (c) {
+            case 'n': iterations = strtoul(optarg, NULL, 10); break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind + 1 != argc || iterations == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "Failed to create %s\n", dir);
+        return 1;
+    }
+
+    printf("%-12s %10s %10s %10s %10s %10s\n", "stack", "p50 [ms]",
+            "p95 [ms]", "RSS [kB]", "libraries", "libcurl");
+    if (run(dir, "pam_permit", NULL, iterations)
+            && run(dir, "+ eid-pam", argv[optind], iterations))
+        r = 0;
+
+    snprintf(filename, sizeof filename, "%s/%s", dir, service);
+    unlink(filename);
+    rmdir(dir);
+
+    return r;
+}
@@ -0,0 +1,137 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "mock.h"
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [options]\n"
+            "\n"
+            "Local stand-in for the eID client and the eService.\n"
+            "\n"
+            "  --client-port PORT     port of the eID client (default 24727)\n"
+            "  --client-socket PATH   UNIX domain socket of the eID client instead\n"
+            "  --service-host HOST    host name of the eService (default www.autentapp.de)\n"
+            "  --service-port PORT    port of the eService (default 24443)\n"
+            "  --hops N               redirects within the eService (default 1)\n"
+            "  --client-delay MS      delay of the eID client's response\n"
+            "  --service-delay MS     delay of each eService response\n"
+            "  --connect-delay MS     delay of the eService's TLS handshake\n"
+            "  --chunk-size BYTES     split the result into chunks\n"
+            "  --chunk-delay MS       delay between chunks\n"
+            "  --fail-percent P       fail P percent of the eService requests\n"
+            "  --replay FILE          serve the hops of a capture (capture=DIR)\n"
+            "                         instead of the redirects and the result\n"
+            "  --replay-speed F       replay F times faster, 0 without delays\n"
+            "                         (default 1)\n"
+            "  --cert FILE            write the eService's certificate (PEM)\n"
+            "  --pubkey FILE          write the eService's public key (DER)\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    struct mock_config config = MOCK_CONFIG_DEFAULT;
+    struct mock mock;
+    const char *cert = NULL, *pubkey = NULL, *replay = NULL;
+    struct capture *capture = NULL;
+    sigset_t set;
+    int sig, c;
+    static const struct option options[] = {
+        {"client-port", required_argument, NULL, 'c'},
+        {"client-socket", required_argument, NULL, 'S'},
+        {"service-host", required_argument, NULL, 'H'},
+        {"service-port", required_argument, NULL, 's'},
+        {"hops", required_argument, NULL, 'r'},
+        {"client-delay", required_argument, NULL, 'd'},
+        {"service-delay", required_argument, NULL, 'D'},
+        {"connect-delay", required_argument, NULL, 'L'},
+        {"chunk-size", required_argument, NULL, 'k'},
+        {"chunk-delay", required_argument, NULL, 'K'},
+        {"fail-percent", required_argument, NULL, 'f'},
+        {"replay", required_argument, NULL, 'R'},
+        {"replay-speed", required_argument, NULL, 'V'},
+        {"cert", required_argument, NULL, 'C'},
+        {"pubkey", required_argument, NULL, 'P'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    while (-1 != (c = getopt_long(argc, argv, "h", options, NULL))) {
+        switch (c) {
+            case 'c': config.client_port = atoi(optarg); break;
+            case 'S': config.client_socket = optarg; break;
+            case 'H': config.service_host = optarg; break;
+            case 's': config.service_port = atoi(optarg); break;
+            case 'r': config.hops = atoi(optarg); break;
+            case 'd': config.client_delay = atoi(optarg); break;
+            case 'D': config.service_delay = atoi(optarg); break;
+            case 'L': config.connect_delay = atoi(optarg); break;
+            case 'k': config.chunk_size = atoi(optarg); break;
+            case 'K': config.chunk_delay = atoi(optarg); break;
+            case 'f': config.fail_percent = atoi(optarg); break;
+            case 'R': replay = optarg; break;
+            case 'V': config.replay_speed = atof(optarg); break;
+            case 'C': cert = optarg; break;
+            case 'P': pubkey = optarg; break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (replay) {
+        capture = capture_read(replay);
+        if (!capture) {
+            fprintf(stderr, "Failed to read %s: %s\n", replay,
+                    strerror(errno));
+            return 1;
+        }
+        config.replay = capture;
+    }
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    /* clients may give up while a delayed response is pending */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!mock_start(&mock, &config)) {
+        capture_free(capture);
+        return 1;
+    }
+
+    if ((cert && !mock_write_cert(&mock, cert))
+            || (pubkey && !mock_write_pubkey(&mock, pubkey))) {
+        fprintf(stderr, "Failed to write the eService's key\n");
+        mock_stop(&mock);
+        capture_free(capture);
+        return 1;
+    }
+
+    if (config.client_socket)
+        printf("eID client on %s\n", config.client_socket);
+    else
+        printf("eID client on http://127.0.0.1:%u/eID-Client\n",
+                config.client_port);
+    printf("eService on https://%s:%u (127.0.0.1)\n",
+            config.service_host, config.service_port);
+    if (capture)
+        printf("Replaying %lu hops of %s\n",
+                (unsigned long) capture->hop_count, replay);
+    fflush(stdout);
+
+    sigwait(&set, &sig);
+    mock_stop(&mock);
+    capture_free(capture);
+
+    return 0;
+}
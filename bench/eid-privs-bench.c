@@ -0,0 +1,202 @@
+/* for RTLD_NEXT */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "drop_privs.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <getopt.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [options]\n"
+            "\n"
+            "Compares the privilege drop of the fallback for home directories "
+            "that root can't\nread (e.g. NFS with root squashing), including "
+            "the lookup of the user, with a\ndirectory service that takes "
+            "--nss-delay for each request. The previous\ninitgroups() "
+            "enumerates all groups, the current drop only switches the file\n"
+            "system IDs of the thread to the user and the user's primary "
+            "group. Needs to\nrun as root.\n"
+            "\n"
+            "  -n, --iterations N     drops per method (default 100)\n"
+            "  -u, --user USER        user to switch to (default nobody)\n"
+            "  --nss-delay MS         delay of each NSS request (default 10)\n",
+            name);
+}
+
+/* Slow NSS stub: the functions that query the directory service are
+ * interposed to add the delay of a remote LDAP or SSSD request */
+static unsigned int nss_delay = 10;
+static unsigned long nss_requests;
+
+static void nss_wait(void)
+{
+    struct timespec ts = {nss_delay / 1000, (nss_delay % 1000) * 1000000L};
+
+    nss_requests++;
+    while (0 != nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+int getpwnam_r(const char *name, struct passwd *pwd, char *buf, size_t size,
+        struct passwd **result)
+{
+    static int (*next)(const char *, struct passwd *, char *, size_t,
+            struct passwd **);
+
+    if (!next)
+        *(void **) &next = dlsym(RTLD_NEXT, "getpwnam_r");
+    nss_wait();
+
+    return next(name, pwd, buf, size, result);
+}
+
+int initgroups(const char *user, gid_t group)
+{
+    static int (*next)(const char *, gid_t);
+
+    if (!next)
+        *(void **) &next = dlsym(RTLD_NEXT, "initgroups");
+    nss_wait();
+
+    return next(user, group);
+}
+
+static int resolve(const char *user, struct passwd *pwd, char *buf,
+        size_t size)
+{
+    struct passwd *result = NULL;
+
+    return 0 == getpwnam_r(user, pwd, buf, size, &result) && result;
+}
+
+/* the drop of pam_modutil_drop_priv() and of the previous fallback */
+static int drop_initgroups(const char *user)
+{
+    struct passwd pwd;
+    char buf[4096];
+    gid_t groups[64];
+    uid_t euid = geteuid();
+    gid_t egid = getegid();
+    int n, ok;
+
+    if (!resolve(user, &pwd, buf, sizeof buf))
+        return 0;
+    n = getgroups(sizeof groups/sizeof *groups, groups);
+    ok = n >= 0
+        && 0 == initgroups(pwd.pw_name, pwd.pw_gid)
+        && 0 == setegid(pwd.pw_gid)
+        && 0 == seteuid(pwd.pw_uid);
+
+    return 0 == seteuid(euid) && 0 == setegid(egid)
+        && 0 == setgroups(n > 0 ? n : 0, groups) && ok;
+}
+
+static int drop_primary(const char *user)
+{
+    struct auth_privs privs = AUTH_PRIVS_INIT;
+    struct passwd pwd;
+    char buf[4096];
+    int ok;
+
+    if (!resolve(user, &pwd, buf, sizeof buf))
+        return 0;
+    ok = 0 == auth_drop_priv(NULL, &privs, &pwd);
+
+    return 0 == auth_regain_priv(NULL, &privs) && ok;
+}
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3
+        + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static int run(const char *name, int (*drop)(const char *), const char *user,
+        unsigned long iterations)
+{
+    struct timespec start;
+    double *ms = calloc(iterations, sizeof *ms);
+    unsigned long i, requests = nss_requests;
+
+    if (!ms)
+        return 0;
+
+    for (i = 0; i < iterations; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (!drop(user)) {
+            fprintf(stderr, "Failed to drop the privileges for %s: %s\n",
+                    user, strerror(errno));
+            free(ms);
+            return 0;
+        }
+        ms[i] = elapsed_ms(&start);
+    }
+    qsort(ms, iterations, sizeof *ms, compare_double);
+
+    printf("%-14s %10.3f %10.3f %12.1f\n", name, ms[iterations / 2],
+            ms[iterations * 95 / 100],
+            (double) (nss_requests - requests) / iterations);
+    free(ms);
+
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long iterations = 100;
+    const char *user = "nobody";
+    int c;
+    static const struct option options[] = {
+        {"iterations", required_argument, NULL, 'n'},
+        {"user", required_argument, NULL, 'u'},
+        {"nss-delay", required_argument, NULL, 'd'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    while (-1 != (c = getopt_long(argc, argv, "n:u:h", options, NULL))) {
+        switch (c) {
+            case 'n': iterations = strtoul(optarg, NULL, 10); break;
+            case 'u': user = optarg; break;
+            case 'd': nss_delay = strtoul(optarg, NULL, 10); break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc || iterations == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (0 != geteuid()) {
+        fprintf(stderr, "%s needs to run as root\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-14s %10s %10s %12s\n", "method", "p50 [ms]", "p95 [ms]",
+            "NSS requests");
+    if (!run("initgroups", drop_initgroups, user, iterations)
+            || !run("primary group", drop_primary, user, iterations))
+        return 1;
+
+    return 0;
+}
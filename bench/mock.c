@@ -0,0 +1,718 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "mock.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static const char result[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<ns4:AuskunftResponse xmlns:ns3=\"urn:oasis:names:tc:dss:1.0:core:schema\" xmlns:ns4=\"http://www.autentapp.de/AusweisAuskunft\">\n"
+    "<ns3:Result>\n"
+    "<ns3:ResultMajor>http://www.bsi.bund.de/ecard/api/1.1/resultmajor#ok</ns3:ResultMajor>\n"
+    "</ns3:Result>\n"
+    "<PersonalData>\n"
+    "<DocumentType>ID</DocumentType>\n"
+    "<IssuingState>D</IssuingState>\n"
+    "<DateOfExpiry>2029-10-31</DateOfExpiry>\n"
+    "<GivenNames>ERIKA</GivenNames>\n"
+    "<FamilyNames>MUSTERMANN</FamilyNames>\n"
+    "<BirthName>GABLER</BirthName>\n"
+    "<DateOfBirth>1964-08-12</DateOfBirth>\n"
+    "<PlaceOfBirth>BERLIN</PlaceOfBirth>\n"
+    "<Nationality>D</Nationality>\n"
+    "<PlaceOfResidence><StructuredPlace><Street>HEIDESTRASSE 17</Street><City>KOELN</City><Country>D</Country><ZipCode>51147</ZipCode></StructuredPlace></PlaceOfResidence>\n"
+    "<RestrictedID>4bd5ee1d1b85bb0e53ce3a0b5a0bd5e20ac5a9f5d1d8a7a3f55f6b8e0d7cb1f6</RestrictedID>\n"
+    "</PersonalData>\n"
+    "</ns4:AuskunftResponse>\n";
+
+const char *mock_result(size_t *length)
+{
+    *length = sizeof result - 1;
+    return result;
+}
+
+const unsigned char *mock_replay_body(const struct mock *mock, size_t hop,
+        size_t *length)
+{
+    const struct capture *replay = mock->config.replay;
+
+    if (!replay || hop == 0 || hop >= replay->hop_count)
+        return NULL;
+
+    *length = replay->hops[hop].body_length;
+    return replay->hops[hop].body ? replay->hops[hop].body
+        : (const unsigned char *) "";
+}
+
+struct conn {
+    struct mock *mock;
+    int fd;
+    SSL *ssl;
+};
+
+static void sleep_ms(unsigned int ms)
+{
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+
+    if (ms)
+        while (0 != nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+static int conn_write(struct conn *conn, const void *data, size_t length)
+{
+    const char *p = data;
+
+    while (length > 0) {
+        int n;
+        if (conn->ssl)
+            n = SSL_write(conn->ssl, p, length);
+        else
+            n = send(conn->fd, p, length, MSG_NOSIGNAL);
+        if (n <= 0)
+            return 0;
+        p += n;
+        length -= n;
+    }
+
+    return 1;
+}
+
+static int conn_read(struct conn *conn, void *data, size_t length)
+{
+    if (conn->ssl)
+        return SSL_read(conn->ssl, data, length);
+    return recv(conn->fd, data, length, 0);
+}
+
+/* reads the request line and headers, returns the request target */
+static char *read_request(struct conn *conn, char *buf, size_t size,
+        int *head)
+{
+    size_t length = 0;
+    char *target, *end;
+
+    while (1) {
+        int n;
+        if (length + 1 >= size)
+            return NULL;
+        n = conn_read(conn, buf + length, size - length - 1);
+        if (n <= 0)
+            return NULL;
+        length += n;
+        buf[length] = '\0';
+        if (strstr(buf, "\r\n\r\n"))
+            break;
+    }
+
+    *head = 0 == strncmp(buf, "HEAD ", 5);
+    if (0 != strncmp(buf, "GET ", 4) && !*head)
+        return NULL;
+    target = buf + (*head ? 5 : 4);
+    end = strchr(target, ' ');
+    if (!end)
+        return NULL;
+    *end = '\0';
+
+    return target;
+}
+
+static int respond(struct conn *conn, int code, const char *reason,
+        const char *location, const char *body, size_t length)
+{
+    char headers[1024];
+    size_t chunk = conn->mock->config.chunk_size;
+    int n;
+
+    n = snprintf(headers, sizeof headers,
+            "HTTP/1.1 %d %s\r\n"
+            "%s%s%s"
+            "Content-Type: text/xml\r\n"
+            "Content-Length: %zu\r\n"
+            "\r\n",
+            code, reason,
+            location ? "Location: " : "",
+            location ? location : "",
+            location ? "\r\n" : "",
+            length);
+    if (n < 0 || (size_t) n >= sizeof headers
+            || !conn_write(conn, headers, n))
+        return 0;
+
+    if (!body || !length)
+        return 1;
+
+    if (code != 200 || chunk == 0 || chunk > length)
+        return conn_write(conn, body, length);
+
+    while (length > 0) {
+        size_t n = length < chunk ? length : chunk;
+        if (!conn_write(conn, body, n))
+            return 0;
+        body += n;
+        length -= n;
+        if (length)
+            sleep_ms(conn->mock->config.chunk_delay);
+    }
+
+    return 1;
+}
+
+/* sleeps until the recorded time after start at the configured speed */
+static void sleep_replay(const struct mock *mock, const struct timespec *start,
+        uint32_t us)
+{
+    struct timespec ts = *start;
+    double speed = mock->config.replay_speed;
+    long long ns;
+
+    if (speed <= 0)
+        return;
+
+    ns = ts.tv_nsec + (long long) (us * 1000.0 / speed);
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                NULL));
+}
+
+/* headers that depend on how the response is sent or that point to the next
+ * hop */
+static int replay_skip_header(const char *line, size_t length)
+{
+    static const char *const skipped[] = {
+        "Content-Length", "Transfer-Encoding", "Connection", "Keep-Alive",
+        "Location",
+    };
+    const char *colon = memchr(line, ':', length);
+    size_t i, n;
+
+    /* status lines and the end of the headers */
+    if (!colon)
+        return 1;
+    n = colon - line;
+    for (i = 0; i < sizeof skipped/sizeof *skipped; i++) {
+        if (n == strlen(skipped[i]) && 0 == strncasecmp(line, skipped[i], n))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* serves the recorded hop with its headers and chunks at the recorded
+ * times, redirecting to the next hop */
+static int respond_replay(struct conn *conn, size_t index)
+{
+    struct mock *mock = conn->mock;
+    const struct capture *replay = mock->config.replay;
+    const struct capture_hop *hop = &replay->hops[index];
+    char headers[CAPTURE_HEADERS_MAX + 1024];
+    const char *line, *eol, *end = hop->headers + hop->headers_length;
+    struct timespec start;
+    size_t length = 0, offset = 0, i;
+    int n;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sleep_replay(mock, &start, hop->header);
+    /* the request failed, e.g. timed out */
+    if (0 == hop->code) {
+        sleep_replay(mock, &start, hop->duration);
+        return 0;
+    }
+
+    n = snprintf(headers, sizeof headers, "HTTP/1.1 %u Replayed\r\n",
+            (unsigned int) hop->code);
+    length = n;
+    for (line = hop->headers; line < end; line = eol) {
+        eol = memchr(line, '\n', end - line);
+        eol = eol ? eol + 1 : end;
+        if (!replay_skip_header(line, eol - line)) {
+            memcpy(headers + length, line, eol - line);
+            length += eol - line;
+        }
+    }
+    if (index + 1 < replay->hop_count)
+        length += snprintf(headers + length, sizeof headers - length,
+                "Location: https://%s:%u/replay/%zu\r\n",
+                mock->config.service_host, mock->config.service_port,
+                index + 1);
+    n = snprintf(headers + length, sizeof headers - length,
+            "Content-Length: %zu\r\n\r\n", hop->body_length);
+    if (n < 0 || (size_t) n >= sizeof headers - length
+            || !conn_write(conn, headers, length + n))
+        return 0;
+
+    for (i = 0; i < hop->chunk_count; i++) {
+        sleep_replay(mock, &start, hop->chunks[i].offset);
+        if (!conn_write(conn, hop->body + offset, hop->chunks[i].size))
+            return 0;
+        offset += hop->chunks[i].size;
+    }
+
+    return 1;
+}
+
+static void stamp(struct mock *mock, struct timespec *ts, int only_first)
+{
+    pthread_mutex_lock(&mock->lock);
+    if (!only_first || (ts->tv_sec == 0 && ts->tv_nsec == 0))
+        clock_gettime(CLOCK_MONOTONIC, ts);
+    pthread_mutex_unlock(&mock->lock);
+}
+
+static int handle_client(struct conn *conn, const char *target)
+{
+    struct mock *mock = conn->mock;
+    static const char status[] =
+        "Name: Mock eID Client\n"
+        "Implementation-Title: eid-pam mock\n";
+    char location[512];
+
+    pthread_mutex_lock(&mock->lock);
+    mock->stats.client_requests++;
+    pthread_mutex_unlock(&mock->lock);
+
+    if (0 == strcmp(target, "/eID-Client?Status"))
+        return respond(conn, 200, "OK", NULL, status, strlen(status));
+
+    if (0 == strncmp(target, "/eID-Client?ShowUI=", 19))
+        return respond(conn, 200, "OK", NULL, NULL, 0);
+
+    if (0 == strncmp(target, "/eID-Client?tcTokenURL=", 23)) {
+        stamp(mock, &mock->times.client, 0);
+        if (mock->config.replay)
+            return respond_replay(conn, 0);
+        sleep_ms(mock->config.client_delay);
+        if (mock->config.hops > 0)
+            snprintf(location, sizeof location, "https://%s:%u/hop/1",
+                    mock->config.service_host, mock->config.service_port);
+        else
+            snprintf(location, sizeof location, "https://%s:%u/result",
+                    mock->config.service_host, mock->config.service_port);
+        return respond(conn, 302, "Found", location, NULL, 0);
+    }
+
+    return respond(conn, 404, "Not Found", NULL, NULL, 0);
+}
+
+static int handle_service(struct conn *conn, const char *target)
+{
+    struct mock *mock = conn->mock;
+    char location[512];
+    unsigned int hop;
+    int fail, ok;
+
+    stamp(mock, &mock->times.service_first, 1);
+    sleep_ms(mock->config.service_delay);
+
+    pthread_mutex_lock(&mock->lock);
+    mock->stats.service_requests++;
+    fail = mock->config.fail_percent
+        && (unsigned int) rand_r(&mock->seed) % 100 < mock->config.fail_percent;
+    if (fail)
+        mock->stats.failures++;
+    pthread_mutex_unlock(&mock->lock);
+
+    if (fail) {
+        /* close the connection after the error */
+        respond(conn, 500, "Internal Server Error", NULL, NULL, 0);
+        return 0;
+    }
+
+    if (mock->config.replay && 1 == sscanf(target, "/replay/%u", &hop)
+            && hop > 0 && hop < mock->config.replay->hop_count) {
+        ok = respond_replay(conn, hop);
+        if (hop + 1 == mock->config.replay->hop_count)
+            stamp(mock, &mock->times.service_done, 0);
+        return ok;
+    }
+
+    if (1 == sscanf(target, "/hop/%u", &hop)) {
+        if (hop < mock->config.hops)
+            snprintf(location, sizeof location, "https://%s:%u/hop/%u",
+                    mock->config.service_host, mock->config.service_port,
+                    hop + 1);
+        else
+            snprintf(location, sizeof location, "https://%s:%u/result",
+                    mock->config.service_host, mock->config.service_port);
+        return respond(conn, 302, "Found", location, NULL, 0);
+    }
+
+    if (0 == strcmp(target, "/result")) {
+        ok = respond(conn, 200, "OK", NULL, result, sizeof result - 1);
+        stamp(mock, &mock->times.service_done, 0);
+        return ok;
+    }
+
+    return respond(conn, 404, "Not Found", NULL, NULL, 0);
+}
+
+static void *serve_conn(void *arg)
+{
+    struct conn *conn = arg;
+    struct mock *mock = conn->mock;
+    char buf[8192];
+    char *target;
+    int one = 1, head;
+
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    if (conn->ssl) {
+        sleep_ms(mock->config.connect_delay);
+        SSL_set_fd(conn->ssl, conn->fd);
+        if (1 != SSL_accept(conn->ssl))
+            goto err;
+        pthread_mutex_lock(&mock->lock);
+        mock->stats.handshakes++;
+        if (SSL_session_reused(conn->ssl))
+            mock->stats.resumed++;
+        pthread_mutex_unlock(&mock->lock);
+    }
+
+    /* keep-alive until the client closes the connection */
+    while (NULL != (target = read_request(conn, buf, sizeof buf, &head))) {
+        int ok;
+        if (head) {
+            pthread_mutex_lock(&mock->lock);
+            mock->stats.head_requests++;
+            pthread_mutex_unlock(&mock->lock);
+            ok = respond(conn, 200, "OK", NULL, NULL, 0);
+        } else if (conn->ssl)
+            ok = handle_service(conn, target);
+        else
+            ok = handle_client(conn, target);
+        if (!ok)
+            break;
+    }
+
+err:
+    if (conn->ssl) {
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+    }
+    close(conn->fd);
+    free(conn);
+
+    return NULL;
+}
+
+static void accept_loop(struct mock *mock, int fd, int tls)
+{
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (1) {
+        pthread_t thread;
+        struct conn *conn;
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        conn = calloc(1, sizeof *conn);
+        if (!conn) {
+            close(client);
+            continue;
+        }
+        conn->mock = mock;
+        conn->fd = client;
+        if (tls) {
+            conn->ssl = SSL_new(mock->ssl_ctx);
+            if (!conn->ssl) {
+                close(client);
+                free(conn);
+                continue;
+            }
+        }
+        if (0 != pthread_create(&thread, &attr, serve_conn, conn)) {
+            if (conn->ssl)
+                SSL_free(conn->ssl);
+            close(client);
+            free(conn);
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
+static void *client_loop(void *arg)
+{
+    struct mock *mock = arg;
+    accept_loop(mock, mock->client_fd, 0);
+    return NULL;
+}
+
+static void *service_loop(void *arg)
+{
+    struct mock *mock = arg;
+    accept_loop(mock, mock->service_fd, 1);
+    return NULL;
+}
+
+static int listen_on(unsigned short port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    if (0 != bind(fd, (struct sockaddr *) &addr, sizeof addr)
+            || 0 != listen(fd, 128)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int listen_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    unlink(path);
+    if (0 != bind(fd, (struct sockaddr *) &addr, sizeof addr)
+            || 0 != listen(fd, 128)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int generate_cert(struct mock *mock)
+{
+    EVP_PKEY_CTX *pctx = NULL;
+    EVP_PKEY *pkey = NULL;
+    X509 *cert = NULL;
+    X509_EXTENSION *ext = NULL;
+    X509V3_CTX v3;
+    char san[300];
+    int ok = 0;
+
+    pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if (!pctx
+            || 1 != EVP_PKEY_keygen_init(pctx)
+            || 1 != EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx,
+                NID_X9_62_prime256v1)
+            || 1 != EVP_PKEY_keygen(pctx, &pkey))
+        goto err;
+
+    cert = X509_new();
+    if (!cert
+            || 1 != X509_set_version(cert, 2)
+            || 1 != ASN1_INTEGER_set(X509_get_serialNumber(cert), 1)
+            || !X509_gmtime_adj(X509_getm_notBefore(cert), -3600)
+            || !X509_gmtime_adj(X509_getm_notAfter(cert), 24*3600)
+            || 1 != X509_set_pubkey(cert, pkey)
+            || 1 != X509_NAME_add_entry_by_txt(X509_get_subject_name(cert),
+                "CN", MBSTRING_ASC,
+                (const unsigned char *) mock->config.service_host, -1, -1, 0)
+            || 1 != X509_set_issuer_name(cert, X509_get_subject_name(cert)))
+        goto err;
+
+    snprintf(san, sizeof san, "DNS:%s", mock->config.service_host);
+    X509V3_set_ctx(&v3, cert, cert, NULL, NULL, 0);
+    ext = X509V3_EXT_conf_nid(NULL, &v3, NID_subject_alt_name, san);
+    if (!ext || 1 != X509_add_ext(cert, ext, -1))
+        goto err;
+    X509_EXTENSION_free(ext);
+    ext = X509V3_EXT_conf_nid(NULL, &v3, NID_basic_constraints, "critical,CA:TRUE");
+    if (!ext || 1 != X509_add_ext(cert, ext, -1))
+        goto err;
+
+    if (!X509_sign(cert, pkey, EVP_sha256()))
+        goto err;
+
+    mock->pkey = pkey;
+    mock->cert = cert;
+    pkey = NULL;
+    cert = NULL;
+    ok = 1;
+
+err:
+    X509_EXTENSION_free(ext);
+    X509_free(cert);
+    EVP_PKEY_free(pkey);
+    EVP_PKEY_CTX_free(pctx);
+
+    return ok;
+}
+
+int mock_start(struct mock *mock, const struct mock_config *config)
+{
+    SSL_CTX *ctx = NULL;
+    static const unsigned char sid_ctx[] = "eid-pam mock";
+
+    memset(mock, 0, sizeof *mock);
+    mock->config = *config;
+    mock->client_fd = -1;
+    mock->service_fd = -1;
+    mock->seed = 1;
+    pthread_mutex_init(&mock->lock, NULL);
+
+    if (!generate_cert(mock)) {
+        fprintf(stderr, "Failed to generate the eService's certificate\n");
+        goto err;
+    }
+
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx
+            || 1 != SSL_CTX_use_certificate(ctx, mock->cert)
+            || 1 != SSL_CTX_use_PrivateKey(ctx, mock->pkey)
+            || 1 != SSL_CTX_set_session_id_context(ctx, sid_ctx,
+                sizeof sid_ctx - 1)) {
+        fprintf(stderr, "Failed to initialize TLS\n");
+        goto err;
+    }
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    mock->ssl_ctx = ctx;
+    ctx = NULL;
+
+    mock->client_fd = mock->config.client_socket
+        ? listen_unix(mock->config.client_socket)
+        : listen_on(mock->config.client_port);
+    if (mock->client_fd < 0) {
+        if (mock->config.client_socket)
+            fprintf(stderr, "Failed to listen on %s: %s\n",
+                    mock->config.client_socket, strerror(errno));
+        else
+            fprintf(stderr, "Failed to listen on 127.0.0.1:%u: %s\n",
+                    mock->config.client_port, strerror(errno));
+        goto err;
+    }
+    mock->service_fd = listen_on(mock->config.service_port);
+    if (mock->service_fd < 0) {
+        fprintf(stderr, "Failed to listen on 127.0.0.1:%u: %s\n",
+                mock->config.service_port, strerror(errno));
+        goto err;
+    }
+
+    if (0 != pthread_create(&mock->client_thread, NULL, client_loop, mock))
+        goto err;
+    if (0 != pthread_create(&mock->service_thread, NULL, service_loop, mock)) {
+        shutdown(mock->client_fd, SHUT_RDWR);
+        pthread_join(mock->client_thread, NULL);
+        goto err;
+    }
+    mock->running = 1;
+
+    return 1;
+
+err:
+    SSL_CTX_free(ctx);
+    mock_stop(mock);
+    return 0;
+}
+
+void mock_stop(struct mock *mock)
+{
+    if (mock->running) {
+        shutdown(mock->client_fd, SHUT_RDWR);
+        shutdown(mock->service_fd, SHUT_RDWR);
+        pthread_join(mock->client_thread, NULL);
+        pthread_join(mock->service_thread, NULL);
+    }
+    if (mock->client_fd >= 0) {
+        close(mock->client_fd);
+        if (mock->config.client_socket)
+            unlink(mock->config.client_socket);
+    }
+    if (mock->service_fd >= 0)
+        close(mock->service_fd);
+    mock->client_fd = -1;
+    mock->service_fd = -1;
+    mock->running = 0;
+    SSL_CTX_free(mock->ssl_ctx);
+    X509_free(mock->cert);
+    EVP_PKEY_free(mock->pkey);
+    mock->ssl_ctx = NULL;
+    mock->cert = NULL;
+    mock->pkey = NULL;
+}
+
+int mock_write_cert(struct mock *mock, const char *filename)
+{
+    int ok;
+    FILE *file = fopen(filename, "w");
+
+    if (!file)
+        return 0;
+    ok = PEM_write_X509(file, mock->cert);
+    if (0 != fclose(file))
+        ok = 0;
+
+    return ok;
+}
+
+int mock_write_pubkey(struct mock *mock, const char *filename)
+{
+    int ok;
+    FILE *file = fopen(filename, "wb");
+
+    if (!file)
+        return 0;
+    ok = i2d_PUBKEY_fp(file, mock->pkey);
+    if (0 != fclose(file))
+        ok = 0;
+
+    return ok;
+}
+
+void mock_reset_times(struct mock *mock)
+{
+    pthread_mutex_lock(&mock->lock);
+    memset(&mock->times, 0, sizeof mock->times);
+    pthread_mutex_unlock(&mock->lock);
+}
+
+void mock_get(struct mock *mock, struct mock_times *times,
+        struct mock_stats *stats)
+{
+    pthread_mutex_lock(&mock->lock);
+    if (times)
+        *times = mock->times;
+    if (stats)
+        *stats = mock->stats;
+    pthread_mutex_unlock(&mock->lock);
+}
@@ -0,0 +1,96 @@
+#ifndef _EID_PAM_MOCK_H
+#define _EID_PAM_MOCK_H
+
+#include "capture.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Local stand-in for the eID client (plain HTTP over TCP or a UNIX domain
+ * socket, emulating the Status and tcTokenURL endpoints) and for the eService (HTTPS with a freshly generated
+ * self-signed key), including the redirect chain between them. */
+
+struct mock_config {
+    /* port of the eID client, 24727 for AusweisApp2 */
+    unsigned short client_port;
+    /* host name and port of the eService */
+    const char *service_host;
+    unsigned short service_port;
+    /* number of redirects within the eService before the result */
+    unsigned int hops;
+    /* artificial delays in milliseconds */
+    unsigned int client_delay;
+    unsigned int service_delay;
+    unsigned int chunk_delay;
+    /* delay of the eService's TLS handshake, emulating the round trips to a
+     * remote host */
+    unsigned int connect_delay;
+    /* split the result into chunks of this size, 0 for a single write */
+    size_t chunk_size;
+    /* percentage of eService requests to fail */
+    unsigned int fail_percent;
+    /* UNIX domain socket of the eID client instead of client_port */
+    const char *client_socket;
+    /* serves the hops of a capture instead of the redirect chain and the
+     * result above, the first one from the eID client */
+    const struct capture *replay;
+    /* replays the capture this many times faster, 0 without delays */
+    double replay_speed;
+};
+
+#define MOCK_CONFIG_DEFAULT {24727, "www.autentapp.de", 24443, 1, 0, 0, 0, 0, 0, 0, NULL, NULL, 1}
+
+/* timestamps (CLOCK_MONOTONIC) of the last transaction */
+struct mock_times {
+    struct timespec client;
+    struct timespec service_first;
+    struct timespec service_done;
+};
+
+struct mock_stats {
+    unsigned long client_requests;
+    unsigned long service_requests;
+    /* HEAD requests, which only warm up the connection */
+    unsigned long head_requests;
+    unsigned long handshakes;
+    unsigned long resumed;
+    unsigned long failures;
+};
+
+struct mock {
+    struct mock_config config;
+    int client_fd;
+    int service_fd;
+    void *ssl_ctx;
+    void *pkey;
+    void *cert;
+    pthread_t client_thread;
+    pthread_t service_thread;
+    int running;
+    pthread_mutex_t lock;
+    struct mock_times times;
+    struct mock_stats stats;
+    unsigned int seed;
+};
+
+int mock_start(struct mock *mock, const struct mock_config *config);
+void mock_stop(struct mock *mock);
+
+/* returns the body of the eService's result */
+const char *mock_result(size_t *length);
+
+/* returns the body of the hop of the replayed capture, NULL if there is none
+ * or if it isn't served by the eService */
+const unsigned char *mock_replay_body(const struct mock *mock, size_t hop,
+        size_t *length);
+
+/* writes the self-signed certificate (PEM) for use as CA file */
+int mock_write_cert(struct mock *mock, const char *filename);
+/* writes the public key (DER) for use with CURLOPT_PINNEDPUBLICKEY */
+int mock_write_pubkey(struct mock *mock, const char *filename);
+
+void mock_reset_times(struct mock *mock);
+void mock_get(struct mock *mock, struct mock_times *times,
+        struct mock_stats *stats);
+
+#endif
@@ -0,0 +1,331 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "auth_cache.h"
+#include "authenticate.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <security/pam_modules.h>
+#ifdef HAVE_SECURITY_PAM_EXT_H
+#include <security/pam_ext.h>
+#else
+#define pam_syslog(handle, level, msg...) syslog(level, ## msg)
+#endif
+
+#define AUTH_CACHE_KEY_LENGTH 32
+#define AUTH_CACHE_MAC_LENGTH 32
+
+static const unsigned char auth_cache_magic[8] = "EIDAUTH1";
+
+/* all integers in network byte order */
+struct auth_cache_entry {
+    unsigned char magic[8];
+    unsigned char created[8];
+    unsigned char key[AUTH_CACHE_KEY_LENGTH];
+    unsigned char fingerprint[AUTH_CACHE_FINGERPRINT_LENGTH];
+    unsigned char mac[AUTH_CACHE_MAC_LENGTH];
+};
+
+struct auth_cache_counters {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long invalidations;
+};
+
+int auth_cache_trusted_fd(int fd, mode_t type)
+{
+    struct stat sb;
+
+    return 0 == fstat(fd, &sb)
+        && (sb.st_mode & S_IFMT) == type
+        && sb.st_uid == 0
+        && !(sb.st_mode & (S_IWGRP|S_IWOTH));
+}
+
+int auth_cache_open_dir(const char *dir, int create)
+{
+    int fd;
+
+    if (create && 0 != mkdir(dir, 0700) && errno != EEXIST)
+        return -1;
+
+    fd = open(dir, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd >= 0 && !auth_cache_trusted_fd(fd, S_IFDIR)) {
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+static int read_exactly(int fd, void *buf, size_t len)
+{
+    ssize_t n = read(fd, buf, len);
+    return n >= 0 && (size_t) n == len;
+}
+
+static int write_exactly(int fd, const void *buf, size_t len)
+{
+    ssize_t n = write(fd, buf, len);
+    return n >= 0 && (size_t) n == len;
+}
+
+/* reads (or creates) the secret for authenticating the entries */
+static int load_secret(int dirfd, unsigned char secret[32])
+{
+    int fd, ok = 0;
+
+    fd = openat(dirfd, ".secret", O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) {
+        if (1 != RAND_bytes(secret, 32))
+            return 0;
+        fd = openat(dirfd, ".secret",
+                O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+        if (fd >= 0) {
+            ok = write_exactly(fd, secret, 32);
+            if (0 != close(fd))
+                ok = 0;
+            if (!ok)
+                unlinkat(dirfd, ".secret", 0);
+            return ok;
+        }
+        if (errno != EEXIST)
+            return 0;
+        /* someone else was faster */
+        fd = openat(dirfd, ".secret", O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    }
+    if (fd < 0)
+        return 0;
+
+    ok = auth_cache_trusted_fd(fd, S_IFREG) && read_exactly(fd, secret, 32);
+    close(fd);
+
+    return ok;
+}
+
+static void count(int dirfd, size_t offset)
+{
+    struct auth_cache_counters *counters;
+    int fd;
+
+    fd = openat(dirfd, ".stats", O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+
+    if (!auth_cache_trusted_fd(fd, S_IFREG)
+            || 0 != ftruncate(fd, sizeof *counters)) {
+        close(fd);
+        return;
+    }
+
+    counters = mmap(NULL, sizeof *counters, PROT_READ|PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == counters)
+        return;
+
+    __atomic_add_fetch((unsigned long long *) ((char *) counters + offset),
+            1, __ATOMIC_RELAXED);
+    munmap(counters, sizeof *counters);
+}
+
+int auth_cache_get_stats(const char *dir, struct auth_cache_stats *stats)
+{
+    struct auth_cache_counters counters;
+    int dirfd, fd, ok = 0;
+
+    memset(stats, 0, sizeof *stats);
+
+    dirfd = auth_cache_open_dir(dir, 0);
+    if (dirfd < 0)
+        return 0;
+
+    fd = openat(dirfd, ".stats", O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd >= 0) {
+        if (auth_cache_trusted_fd(fd, S_IFREG)
+                && read_exactly(fd, &counters, sizeof counters)) {
+            stats->hits = counters.hits;
+            stats->misses = counters.misses;
+            stats->invalidations = counters.invalidations;
+            ok = 1;
+        }
+        close(fd);
+    }
+    close(dirfd);
+
+    return ok;
+}
+
+/* derives the key of the entry from user, TTY and session */
+static int entry_key(const struct auth_request *request,
+        unsigned char key[AUTH_CACHE_KEY_LENGTH], char name[2*AUTH_CACHE_KEY_LENGTH + 1])
+{
+    const char *user = request->user;
+    const char *tty = request->tty ? request->tty : "";
+    char sid[32];
+    unsigned int len = 0;
+    size_t i;
+    int ok = 0;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+    snprintf(sid, sizeof sid, "%ld", (long) request->sid);
+
+    if (ctx
+            && 1 == EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)
+            && 1 == EVP_DigestUpdate(ctx, user, strlen(user) + 1)
+            && 1 == EVP_DigestUpdate(ctx, tty, strlen(tty) + 1)
+            && 1 == EVP_DigestUpdate(ctx, sid, strlen(sid) + 1)
+            && 1 == EVP_DigestFinal_ex(ctx, key, &len)
+            && len == AUTH_CACHE_KEY_LENGTH)
+        ok = 1;
+    EVP_MD_CTX_free(ctx);
+
+    for (i = 0; ok && i < AUTH_CACHE_KEY_LENGTH; i++)
+        sprintf(name + 2*i, "%02x", key[i]);
+
+    return ok;
+}
+
+static int entry_mac(const unsigned char secret[32],
+        const struct auth_cache_entry *entry,
+        unsigned char mac[AUTH_CACHE_MAC_LENGTH])
+{
+    unsigned int len = 0;
+
+    return NULL != HMAC(EVP_sha256(), secret, 32,
+            (const unsigned char *) entry, offsetof(struct auth_cache_entry, mac),
+            mac, &len)
+        && len == AUTH_CACHE_MAC_LENGTH;
+}
+
+int auth_cache_check(pam_handle_t *pamh, const char *dir, long ttl,
+        const struct auth_request *request,
+        const unsigned char fingerprint[AUTH_CACHE_FINGERPRINT_LENGTH])
+{
+    struct auth_cache_entry entry;
+    unsigned char key[AUTH_CACHE_KEY_LENGTH], mac[AUTH_CACHE_MAC_LENGTH];
+    unsigned char secret[32];
+    char name[2*AUTH_CACHE_KEY_LENGTH + 1];
+    uint64_t created = 0;
+    time_t now = time(NULL);
+    size_t i;
+    int dirfd, fd = -1, hit = 0;
+
+    dirfd = auth_cache_open_dir(dir, 0);
+    if (dirfd < 0)
+        return 0;
+
+    if (1 != entry_key(request, key, name))
+        goto err;
+
+    fd = openat(dirfd, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd < 0)
+        goto miss;
+
+    if (!auth_cache_trusted_fd(fd, S_IFREG)
+            || !read_exactly(fd, &entry, sizeof entry)
+            || !load_secret(dirfd, secret)
+            || !entry_mac(secret, &entry, mac)
+            || 0 != CRYPTO_memcmp(mac, entry.mac, sizeof mac)
+            || 0 != memcmp(entry.magic, auth_cache_magic, sizeof entry.magic)
+            || 0 != CRYPTO_memcmp(entry.key, key, sizeof key)) {
+        pam_syslog(pamh, LOG_WARNING, "Ignoring invalid cache entry %s/%s",
+                dir, name);
+        goto invalidate;
+    }
+
+    if (0 != CRYPTO_memcmp(entry.fingerprint, fingerprint,
+                AUTH_CACHE_FINGERPRINT_LENGTH)) {
+        /* the reference has been changed */
+        goto invalidate;
+    }
+
+    for (i = 0; i < sizeof entry.created; i++)
+        created = (created << 8) | entry.created[i];
+    if ((uint64_t) now < created || (uint64_t) now - created >= (uint64_t) ttl)
+        goto invalidate;
+
+    hit = 1;
+    count(dirfd, offsetof(struct auth_cache_counters, hits));
+    goto err;
+
+invalidate:
+    unlinkat(dirfd, name, 0);
+    count(dirfd, offsetof(struct auth_cache_counters, invalidations));
+miss:
+    count(dirfd, offsetof(struct auth_cache_counters, misses));
+err:
+    OPENSSL_cleanse(secret, sizeof secret);
+    if (fd >= 0)
+        close(fd);
+    close(dirfd);
+
+    return hit;
+}
+
+void auth_cache_store(pam_handle_t *pamh, const char *dir,
+        const struct auth_request *request,
+        const unsigned char fingerprint[AUTH_CACHE_FINGERPRINT_LENGTH])
+{
+    struct auth_cache_entry entry;
+    unsigned char secret[32];
+    char name[2*AUTH_CACHE_KEY_LENGTH + 1], tmp[2*AUTH_CACHE_KEY_LENGTH + 32];
+    unsigned char nonce[8];
+    uint64_t now = time(NULL);
+    size_t i;
+    int dirfd, fd, ok;
+
+    dirfd = auth_cache_open_dir(dir, 1);
+    if (dirfd < 0) {
+        pam_syslog(pamh, LOG_WARNING,
+                "%s must be a directory owned by root, not caching", dir);
+        return;
+    }
+
+    memcpy(entry.magic, auth_cache_magic, sizeof entry.magic);
+    for (i = 0; i < sizeof entry.created; i++)
+        entry.created[i] = now >> (8*(sizeof entry.created - 1 - i));
+    memcpy(entry.fingerprint, fingerprint, sizeof entry.fingerprint);
+
+    if (1 != entry_key(request, entry.key, name)
+            || !load_secret(dirfd, secret)
+            || !entry_mac(secret, &entry, entry.mac))
+        goto err;
+
+    if (1 != RAND_bytes(nonce, sizeof nonce))
+        goto err;
+    snprintf(tmp, sizeof tmp, ".%s.%02x%02x%02x%02x%02x%02x%02x%02x", name,
+            nonce[0], nonce[1], nonce[2], nonce[3],
+            nonce[4], nonce[5], nonce[6], nonce[7]);
+    fd = openat(dirfd, tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC,
+            0600);
+    if (fd < 0)
+        goto err;
+    ok = write_exactly(fd, &entry, sizeof entry);
+    if (0 != close(fd))
+        ok = 0;
+    if (!ok || 0 != renameat(dirfd, tmp, dirfd, name))
+        unlinkat(dirfd, tmp, 0);
+
+err:
+    OPENSSL_cleanse(secret, sizeof secret);
+    close(dirfd);
+}
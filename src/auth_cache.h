@@ -0,0 +1,43 @@
+#ifndef _EID_PAM_AUTH_CACHE_H
+#define _EID_PAM_AUTH_CACHE_H
+
+#include <security/pam_appl.h>
+#include <sys/types.h>
+
+struct auth_request;
+
+/* Short-lived cache of successful authentications, which spares the user
+ * from presenting the ID card for every sudo within a few minutes. Entries
+ * are kept in a root-owned directory, keyed by user, TTY and session and
+ * authenticated with a secret key. An entry is only accepted if the
+ * reference of the user is still the same as when the entry was created. */
+
+#define AUTH_CACHE_DIR "/run/eid-pam"
+#define AUTH_CACHE_FINGERPRINT_LENGTH 32
+
+struct auth_cache_stats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long invalidations;
+};
+
+/* Returns 1 if a valid entry younger than ttl seconds exists */
+int auth_cache_check(pam_handle_t *pamh, const char *dir, long ttl,
+        const struct auth_request *request,
+        const unsigned char fingerprint[AUTH_CACHE_FINGERPRINT_LENGTH]);
+
+void auth_cache_store(pam_handle_t *pamh, const char *dir,
+        const struct auth_request *request,
+        const unsigned char fingerprint[AUTH_CACHE_FINGERPRINT_LENGTH]);
+
+/* Opens (and optionally creates) dir if it is owned by root and not writable
+ * by others */
+int auth_cache_open_dir(const char *dir, int create);
+
+/* Returns 1 if fd is of the given type, owned by root and not writable by
+ * others */
+int auth_cache_trusted_fd(int fd, mode_t type);
+
+int auth_cache_get_stats(const char *dir, struct auth_cache_stats *stats);
+
+#endif
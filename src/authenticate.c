@@ -0,0 +1,1388 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "authenticate.h"
+#include "auth_cache.h"
+#include "capture.h"
+#include "client_health.h"
+#include "curl_pool.h"
+#include "drop_privs.h"
+#include "eid.h"
+#include "metrics.h"
+#include "session_cache.h"
+#include "single_flight.h"
+#include "store.h"
+#include "trace.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <security/pam_modules.h>
+#ifdef HAVE_SECURITY_PAM_EXT_H
+#include <security/pam_ext.h>
+#else
+#define pam_syslog(handle, level, msg...) syslog(level, ## msg)
+#endif
+
+/* time budgets of a single request in milliseconds */
+#define AUTH_CONNECT_TIMEOUT 5000
+#define AUTH_REQUEST_TIMEOUT_MIN 1000
+/* abort non-interactive requests which didn't receive anything for this
+ * number of seconds */
+#define AUTH_STALL_TIMEOUT 10
+/* time for the eID clients to answer the Status request in milliseconds */
+#define AUTH_CLIENT_PROBE_TIMEOUT 100
+
+void auth_options_init(struct auth_options *options)
+{
+	memset(options, 0, sizeof *options);
+	options->cache_dir = AUTH_CACHE_DIR;
+	options->queue_wait = READER_QUEUE_WAIT;
+	options->timeout = AUTH_TIMEOUT;
+	options->max_redirects = AUTH_MAX_REDIRECTS;
+	options->tctoken_url = eid_tctoken_url_default;
+	eid_origin_parse(&options->service_origin, options->tctoken_url);
+}
+
+int auth_options_set(pam_handle_t *pamh, struct auth_options *options,
+		const char *arg)
+{
+	if (0 == strncmp(arg, "cache_ttl=", 10)) {
+		options->cache_ttl = strtol(arg + 10, NULL, 10);
+	} else if (0 == strncmp(arg, "client_ttl=", 11)) {
+		options->client_ttl = strtol(arg + 11, NULL, 10);
+	} else if (0 == strncmp(arg, "client=", 7)) {
+		if (options->client_count >= AUTH_CLIENTS_MAX
+				|| !client_endpoint_set(
+					&options->clients[options->client_count], arg + 7)) {
+			return 0;
+		}
+		options->client_count++;
+	} else if (0 == strncmp(arg, "tctoken_url=", 12)) {
+		/* the URL is passed to the eID client as a whole */
+		if (strlen(arg + 12) >= EID_URL_MAX) {
+			pam_syslog(pamh, LOG_ERR, "tctoken_url is longer than %d "
+					"characters", EID_URL_MAX - 1);
+			return 0;
+		}
+		if (!eid_origin_parse(&options->service_origin, arg + 12)) {
+			return 0;
+		}
+		options->tctoken_url = arg + 12;
+	} else if (0 == strncmp(arg, "origin=", 7)) {
+		if (strcspn(arg + 7, ",") >= EID_URL_MAX) {
+			pam_syslog(pamh, LOG_ERR, "origin is longer than %d characters",
+					EID_URL_MAX - 1);
+			return 0;
+		}
+		if (options->origin_count >= AUTH_ORIGINS_MAX
+				|| !eid_origin_set(
+					&options->origins[options->origin_count], arg + 7)) {
+			return 0;
+		}
+		options->origin_count++;
+	} else if (0 == strncmp(arg, "cache_dir=", 10)) {
+		options->cache_dir = arg + 10;
+	} else if (0 == strncmp(arg, "queue_wait=", 11)) {
+		options->queue_wait = strtol(arg + 11, NULL, 10);
+	} else if (0 == strcmp(arg, "queue_info")) {
+		options->queue_info = 1;
+	} else if (0 == strncmp(arg, "timeout=", 8)) {
+		options->timeout = strtol(arg + 8, NULL, 10);
+	} else if (0 == strncmp(arg, "max_redirects=", 14)) {
+		options->max_redirects = strtol(arg + 14, NULL, 10);
+	} else if (0 == strcmp(arg, "trace")) {
+		options->trace = 1;
+	} else if (0 == strcmp(arg, "metrics")) {
+		options->metrics = 1;
+	} else if (0 == strncmp(arg, "capture=", 8)) {
+		options->capture = arg + 8;
+	} else if (0 == strcmp(arg, "store")) {
+		options->store = STORE_PATH;
+	} else if (0 == strncmp(arg, "store=", 6)) {
+		options->store = arg + 6;
+	} else if (0 == strncmp(arg, "session_cache=", 14)) {
+		options->session_cache = arg + 14;
+	} else if (0 == strncmp(arg, "cainfo=", 7)) {
+		options->cainfo = arg + 7;
+	} else if (0 == strcmp(arg, "prewarm")) {
+		options->prewarm = "";
+	} else if (0 == strncmp(arg, "prewarm=", 8)) {
+		/* checked against the trusted origins when used */
+		options->prewarm = arg + 8;
+	} else if (0 == strncmp(arg, "resolve=", 8)) {
+		struct curl_slist *resolve = curl_slist_append(options->resolve,
+				arg + 8);
+		if (resolve) {
+			options->resolve = resolve;
+		}
+	} else {
+		return 0;
+	}
+
+	return 1;
+}
+
+void auth_options_apply(const struct auth_options *options, CURL *curl)
+{
+	/* timeouts must not use signals in threaded applications */
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	if (options->cainfo) {
+		curl_easy_setopt(curl, CURLOPT_CAINFO, options->cainfo);
+	}
+	if (options->resolve) {
+		curl_easy_setopt(curl, CURLOPT_RESOLVE, options->resolve);
+	}
+}
+
+/* Returns the trusted origin of url, NULL if it isn't one */
+static const struct eid_origin *auth_origin(
+		const struct auth_options *options, const char *url)
+{
+	if (options->origin_count == 0) {
+		return eid_origin_match(&options->service_origin, 1, url);
+	}
+
+	return eid_origin_match(options->origins, options->origin_count, url);
+}
+
+void auth_options_free(struct auth_options *options)
+{
+	curl_slist_free_all(options->resolve);
+	options->resolve = NULL;
+}
+
+size_t auth_compare(void *contents, size_t size, size_t nmemb, void *userp)
+{
+	size_t count = size*nmemb;
+	struct auth_status *status = (struct auth_status *)userp;
+
+	if (status->ok == 0) {
+		/* we already know that the received data doesn't match */
+		return count;
+	}
+
+	if (status->reference.digest) {
+		if (1 != EVP_DigestUpdate(status->digest, contents, count)) {
+			status->ok = 0;
+			return count;
+		}
+	} else if (count > status->reference.length - status->offset
+			|| 0 != memcmp(status->reference.data + status->offset,
+				contents, count)) {
+		/* the received data doesn't match */
+		status->ok = 0;
+		return count;
+	}
+	status->offset += count;
+
+	if (eid_match_update(&status->result, contents, count)) {
+		status->ok = 1;
+	}
+
+	return count;
+}
+
+int auth_status_start(struct auth_status *status)
+{
+	status->ok = -1;
+	status->offset = 0;
+	eid_match_init(&status->result, action_eid_ok);
+	if (status->reference.digest) {
+		status->digest = auth_digest_new();
+		if (!status->digest) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int auth_status_verdict(struct auth_status *status)
+{
+	unsigned char md[AUTH_DIGEST_LENGTH];
+
+	if (status->ok != 1) {
+		return status->ok;
+	}
+	if (status->reference.digest) {
+		/* the digest over all received data matches one of the enrolled
+		 * identities */
+		return 1 == auth_digest_final(status->digest, md)
+			&& 1 == auth_reference_match(&status->reference, md);
+	}
+	/* we received the correct data *and* all of our reference data has been
+	 * consumed */
+	return status->offset == status->reference.length;
+}
+
+void auth_status_free(struct auth_status *status)
+{
+	auth_reference_free(&status->reference);
+	if (status->digest) {
+		EVP_MD_CTX_free(status->digest);
+		status->digest = NULL;
+	}
+}
+
+static int auth_getpwnam(pam_handle_t *pamh, const char *user,
+		struct passwd *pwd, char **buf)
+{
+	struct passwd *result = NULL;
+	long size = sysconf(_SC_GETPW_R_SIZE_MAX);
+	int e;
+
+	if (size <= 0) {
+		size = 16384;
+	}
+
+	while (1) {
+		char *p = realloc(*buf, size);
+		if (!p) {
+			pam_syslog(pamh, LOG_CRIT, "realloc() failed: %s",
+					strerror(errno));
+			return PAM_BUF_ERR;
+		}
+		*buf = p;
+		e = getpwnam_r(user, pwd, *buf, size, &result);
+		if (e != ERANGE || size > 1024*1024) {
+			break;
+		}
+		size *= 2;
+	}
+
+	if (!result) {
+		pam_syslog(pamh, LOG_ERR, "getpwnam_r() failed for %s: %s", user,
+				e ? strerror(e) : "unknown user");
+		return PAM_USER_UNKNOWN;
+	}
+
+	return PAM_SUCCESS;
+}
+
+#ifndef HAVE_SYS_FSUID_H
+/* Without setfsuid(), privileges are switched for the whole process, so
+ * concurrent authentications in threaded applications need to be
+ * serialized */
+static pthread_mutex_t privs_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int auth_load(pam_handle_t *pamh, const struct trace *trace,
+		struct passwd *passwd, struct auth_reference *reference,
+		struct client_pubkey *pubkey)
+{
+	int r = PAM_SERVICE_ERR, ok;
+	struct trace_mark mark;
+	struct auth_privs privs = AUTH_PRIVS_INIT;
+
+	if (1 == auth_read_reference(passwd, reference)
+			&& 1 == client_pubkey_load(passwd, pubkey)) {
+		return PAM_SUCCESS;
+	}
+	auth_reference_free(reference);
+
+	if (errno != EACCES) {
+		pam_syslog(pamh, LOG_ERR, "Failed to load ~/.eid of %s: %s",
+				passwd->pw_name, strerror(errno));
+		return PAM_SERVICE_ERR;
+	}
+
+	/* root may not have access to the home directory, e.g. on NFS with
+	 * root squashing */
+#ifndef HAVE_SYS_FSUID_H
+	pthread_mutex_lock(&privs_lock);
+#endif
+	trace_mark(trace, &mark);
+	ok = !auth_drop_priv(pamh, &privs, passwd);
+	trace_span(trace, &mark, TRACE_DROP_PRIVS, 0, ok ? PAM_SUCCESS : r, NULL);
+	if (!ok) {
+		goto err;
+	}
+	ok = 1 == auth_read_reference(passwd, reference)
+		&& 1 == client_pubkey_load(passwd, pubkey);
+	if (auth_regain_priv(pamh, &privs)) {
+		r = PAM_SESSION_ERR;
+		goto err;
+	}
+	if (ok) {
+		r = PAM_SUCCESS;
+	} else {
+		pam_syslog(pamh, LOG_ERR, "Failed to load ~/.eid of %s",
+				passwd->pw_name);
+	}
+
+err:
+#ifndef HAVE_SYS_FSUID_H
+	pthread_mutex_unlock(&privs_lock);
+#endif
+	if (PAM_SUCCESS != r) {
+		auth_reference_free(reference);
+	}
+
+	return r;
+}
+
+void auth_deadline_start(struct auth_deadline *deadline,
+		const struct auth_options *options)
+{
+	deadline->enabled = options->timeout > 0;
+	clock_gettime(CLOCK_MONOTONIC, &deadline->end);
+	deadline->end.tv_sec += options->timeout;
+}
+
+long auth_deadline_remaining(const struct auth_deadline *deadline)
+{
+	struct timespec now;
+	long ms;
+
+	if (!deadline->enabled) {
+		return LONG_MAX;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline->end.tv_sec - now.tv_sec) * 1000
+		+ (deadline->end.tv_nsec - now.tv_nsec) / 1000000;
+
+	return ms > 0 ? ms : 0;
+}
+
+int auth_deadline_budget(pam_handle_t *pamh,
+		const struct auth_deadline *deadline, CURL *curl, long requests,
+		int interactive)
+{
+	long remaining = auth_deadline_remaining(deadline), budget;
+
+	if (!deadline->enabled) {
+		return 1;
+	}
+	if (remaining <= 0) {
+		pam_syslog(pamh, LOG_ERR, "Authentication timed out");
+		return 0;
+	}
+
+	budget = remaining;
+	if (!interactive && requests > 1) {
+		budget = remaining / requests;
+		if (budget < AUTH_REQUEST_TIMEOUT_MIN) {
+			budget = remaining < AUTH_REQUEST_TIMEOUT_MIN
+				? remaining : AUTH_REQUEST_TIMEOUT_MIN;
+		}
+	}
+
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, budget);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS,
+			budget < AUTH_CONNECT_TIMEOUT ? budget : AUTH_CONNECT_TIMEOUT);
+	if (interactive) {
+		/* the eID client only answers after the user entered the PIN */
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 0L);
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 0L);
+	} else {
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME,
+				budget/1000 < AUTH_STALL_TIMEOUT
+				? (budget/1000 > 0 ? budget/1000 : 1) : AUTH_STALL_TIMEOUT);
+	}
+
+	return 1;
+}
+
+/* Status requests racing for the eID client that answers first */
+struct auth_select {
+	CURL *probes[AUTH_CLIENTS_MAX];
+	size_t count;
+	size_t running;
+	/* connections that were refused */
+	size_t refused;
+	const struct client_endpoint *winner;
+	struct trace_mark started;
+};
+
+static size_t
+auth_discard(void *contents, size_t size, size_t nmemb, void *userp)
+{
+	return size*nmemb;
+}
+
+/* Returns the endpoint if there is nothing to select from */
+static const struct client_endpoint *auth_client_single(
+		const struct auth_options *options)
+{
+	if (0 == options->client_count) {
+		return &client_endpoint_default;
+	}
+
+	return 1 == options->client_count ? &options->clients[0] : NULL;
+}
+
+static int auth_select_start(pam_handle_t *pamh,
+		const struct auth_options *options,
+		const struct auth_deadline *deadline, const struct trace *trace,
+		CURLM *multi, struct auth_select *select)
+{
+	long timeout = AUTH_CLIENT_PROBE_TIMEOUT;
+	size_t i;
+	CURL *curl;
+
+	memset(select, 0, sizeof *select);
+	if (deadline->enabled && auth_deadline_remaining(deadline) < timeout) {
+		timeout = auth_deadline_remaining(deadline);
+		if (timeout <= 0) {
+			pam_syslog(pamh, LOG_ERR, "Authentication timed out");
+			return 0;
+		}
+	}
+
+	trace_mark(trace, &select->started);
+	for (i = 0; i < options->client_count; i++) {
+		curl = curl_pool_acquire();
+		if (!curl) {
+			continue;
+		}
+		auth_options_apply(options, curl);
+		client_endpoint_prepare(curl, &options->clients[i], action_status);
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, auth_discard);
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
+		curl_easy_setopt(curl, CURLOPT_PRIVATE,
+				(void *) &options->clients[i]);
+		if (CURLM_OK != curl_multi_add_handle(multi, curl)) {
+			curl_pool_release(curl);
+			continue;
+		}
+		select->probes[select->count++] = curl;
+	}
+	select->running = select->count;
+
+	return select->count > 0;
+}
+
+/* Handles a finished transfer, returns 0 if it wasn't one of the probes */
+static int auth_select_done(CURLM *multi, struct auth_select *select,
+		CURLMsg *msg)
+{
+	char *endpoint = NULL;
+	long code = 0;
+	size_t i;
+
+	for (i = 0; i < select->count; i++) {
+		if (select->probes[i] && select->probes[i] == msg->easy_handle) {
+			break;
+		}
+	}
+	if (i == select->count) {
+		return 0;
+	}
+
+	if (CURLE_COULDNT_CONNECT == msg->data.result) {
+		select->refused++;
+	}
+	if (!select->winner && CURLE_OK == msg->data.result
+			&& CURLE_OK == curl_easy_getinfo(msg->easy_handle,
+				CURLINFO_RESPONSE_CODE, &code)
+			&& 200 == code
+			&& CURLE_OK == curl_easy_getinfo(msg->easy_handle,
+				CURLINFO_PRIVATE, &endpoint)) {
+		select->winner = (const struct client_endpoint *) endpoint;
+	}
+	curl_multi_remove_handle(multi, select->probes[i]);
+	curl_pool_release(select->probes[i]);
+	select->probes[i] = NULL;
+	select->running--;
+
+	return 1;
+}
+
+/* Drives the probes. Returns 1 while none has answered and some are still
+ * running. */
+static int auth_select_run(CURLM *multi, struct auth_select *select,
+		int blocking)
+{
+	CURLMsg *msg;
+	int running, queued;
+
+	while (1) {
+		if (CURLM_OK != curl_multi_perform(multi, &running)) {
+			return 0;
+		}
+		while ((msg = curl_multi_info_read(multi, &queued))) {
+			if (msg->msg == CURLMSG_DONE) {
+				auth_select_done(multi, select, msg);
+			}
+		}
+		if (select->winner || 0 == select->running) {
+			return 0;
+		}
+		if (!blocking) {
+			return 1;
+		}
+		if (CURLM_OK != curl_multi_wait(multi, NULL, 0, 1000, NULL)) {
+			return 0;
+		}
+	}
+}
+
+static void auth_select_cancel(CURLM *multi, struct auth_select *select)
+{
+	size_t i;
+
+	for (i = 0; i < select->count; i++) {
+		if (select->probes[i]) {
+			curl_multi_remove_handle(multi, select->probes[i]);
+			curl_pool_release(select->probes[i]);
+			select->probes[i] = NULL;
+		}
+	}
+	select->running = 0;
+}
+
+/* Cancels the remaining probes and reports the outcome */
+static void auth_select_finish(pam_handle_t *pamh,
+		const struct auth_options *options, const struct trace *trace,
+		CURLM *multi, struct auth_select *select)
+{
+	auth_select_cancel(multi, select);
+
+	trace_span(trace, &select->started, TRACE_SELECT, 0,
+			select->winner ? PAM_SUCCESS : PAM_AUTHINFO_UNAVAIL,
+			select->winner ? (select->winner->socket
+				? select->winner->socket : select->winner->url) : NULL);
+	if (select->winner) {
+		return;
+	}
+	pam_syslog(pamh, LOG_ERR, "None of the %lu eID clients answered",
+			(unsigned long) select->count);
+	if (select->count > 0 && select->refused == select->count
+			&& options->client_ttl > 0) {
+		struct client_health health = {0};
+		client_health_store(pamh, options->cache_dir, &health);
+	}
+}
+
+const struct client_endpoint *auth_client_select(pam_handle_t *pamh,
+		const struct auth_options *options,
+		const struct auth_deadline *deadline)
+{
+	const struct client_endpoint *single = auth_client_single(options);
+	struct auth_select select;
+	struct trace trace = {0};
+	CURLM *multi;
+
+	if (single) {
+		return single;
+	}
+
+	multi = curl_multi_init();
+	if (!multi) {
+		return NULL;
+	}
+	if (auth_select_start(pamh, options, deadline, &trace, multi, &select)) {
+		auth_select_run(multi, &select, 1);
+	}
+	auth_select_finish(pamh, options, &trace, multi, &select);
+	curl_multi_cleanup(multi);
+
+	return select.winner;
+}
+
+static void auth_queue_notify(void *ctx, unsigned int position)
+{
+	const struct auth_request *request = ctx;
+	char message[80];
+
+	snprintf(message, sizeof message,
+			"Waiting for the card reader, position %u", position);
+	request->info(request->info_ctx, message);
+}
+
+static long auth_queue_wait(pam_handle_t *pamh,
+		const struct auth_options *options,
+		const struct auth_deadline *deadline)
+{
+	long wait = options->queue_wait;
+	long remaining = auth_deadline_remaining(deadline);
+
+	/* don't wait longer than we are allowed to take overall */
+	if (wait > 0 && deadline->enabled && (remaining + 999) / 1000 < wait) {
+		wait = (remaining + 999) / 1000;
+		if (wait == 0) {
+			pam_syslog(pamh, LOG_ERR, "Authentication timed out");
+			return -1;
+		}
+	}
+
+	return wait;
+}
+
+int auth_queue_enter(pam_handle_t *pamh, const struct auth_options *options,
+		const struct auth_request *request,
+		const struct auth_deadline *deadline, struct reader_queue *queue)
+{
+	long wait = auth_queue_wait(pamh, options, deadline);
+
+	if (wait < 0) {
+		queue->fd = -1;
+		return PAM_AUTHINFO_UNAVAIL;
+	}
+
+	return reader_queue_enter(pamh, options->cache_dir, wait, request->uid,
+			options->queue_info && request->info ? auth_queue_notify : NULL,
+			(void *) request, queue);
+}
+
+enum auth_state {
+	AUTH_FLIGHT,
+	AUTH_QUEUE,
+	AUTH_SELECT,
+	AUTH_TRANSFER,
+	AUTH_DONE,
+};
+
+struct auth_flow {
+	enum auth_state state;
+	const struct auth_options *options;
+	struct auth_request request;
+	struct auth_deadline deadline;
+	struct auth_status status;
+	struct session_cache session_cache;
+	struct single_flight flight;
+	struct reader_queue queue;
+	struct client_pubkey pubkey;
+	/* NULL until the race for the eID client is decided */
+	const struct client_endpoint *client;
+	struct auth_select select;
+	unsigned char fingerprint[AUTH_DIGEST_LENGTH];
+	int cache;
+	long redirects;
+	struct trace trace;
+	/* start of the authentication, the current wait and request and the
+	 * speculative connection */
+	struct trace_mark started, waiting, requested, prewarmed;
+	unsigned int hop;
+	struct timespec start;
+	enum metrics_reason reason;
+	CURLM *multi;
+	CURL *curl;
+	CURL *prewarm;
+	/* NULL unless capturing, whether the current hop is compared */
+	struct capture *capture;
+	int trusted;
+	int result;
+};
+
+/* remembers the first reason for a failure */
+static void auth_flow_fail(struct auth_flow *flow, enum metrics_reason reason)
+{
+	if (METRICS_REASON_NONE == flow->reason) {
+		flow->reason = reason;
+	}
+}
+
+static void auth_flow_count(struct auth_flow *flow)
+{
+	struct timespec now;
+
+	if (!flow->options->metrics) {
+		return;
+	}
+
+	if (PAM_SUCCESS == flow->result) {
+		flow->reason = METRICS_REASON_NONE;
+	} else {
+		auth_flow_fail(flow, METRICS_REASON_OTHER);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	metrics_record(flow->options->cache_dir, METRICS_AUTHENTICATE,
+			flow->result, flow->reason,
+			(now.tv_sec - flow->start.tv_sec) * 1000000
+			+ (now.tv_nsec - flow->start.tv_nsec) / 1000);
+}
+
+void auth_flow_free(struct auth_flow *flow)
+{
+	if (!flow) {
+		return;
+	}
+
+	if (flow->multi) {
+		if (flow->curl) {
+			curl_multi_remove_handle(flow->multi, flow->curl);
+		}
+		if (flow->prewarm) {
+			curl_multi_remove_handle(flow->multi, flow->prewarm);
+		}
+		auth_select_cancel(flow->multi, &flow->select);
+		curl_multi_cleanup(flow->multi);
+	}
+	curl_pool_release(flow->prewarm);
+	if (flow->curl) {
+		curl_easy_setopt(flow->curl, CURLOPT_WRITEFUNCTION, NULL);
+		curl_easy_setopt(flow->curl, CURLOPT_WRITEDATA, NULL);
+		curl_easy_setopt(flow->curl, CURLOPT_HEADERFUNCTION, NULL);
+		curl_easy_setopt(flow->curl, CURLOPT_HEADERDATA, NULL);
+	}
+	capture_free(flow->capture);
+	/* waiting callers take over if we didn't finish */
+	single_flight_abort(&flow->flight);
+	reader_queue_leave(&flow->queue);
+	auth_status_free(&flow->status);
+	session_cache_free(&flow->session_cache);
+	trace_span(&flow->trace, &flow->started, TRACE_TOTAL, 0, flow->result,
+			flow->request.user);
+	trace_close(&flow->trace);
+	auth_flow_count(flow);
+	free((char *) flow->request.user);
+	free((char *) flow->request.tty);
+	free(flow);
+}
+
+/* Loads the reference and checks the result cache. Returns PAM_INCOMPLETE if
+ * the eID client needs to be asked. */
+static int auth_flow_start(pam_handle_t *pamh, struct auth_flow *flow)
+{
+	int r;
+	const char *user = flow->request.user;
+	struct passwd passwd;
+	struct trace_mark mark;
+	struct client_health health;
+	char *pwbuf = NULL;
+	int hit;
+
+	if (flow->options->client_ttl > 0
+			&& 1 == client_health_check(flow->options->cache_dir,
+				flow->options->client_ttl, &health)
+			&& !health.reachable) {
+		pam_syslog(pamh, LOG_ERR, "eID client was not reachable recently");
+		auth_flow_fail(flow, METRICS_REASON_CLIENT);
+		return PAM_AUTHINFO_UNAVAIL;
+	}
+
+	session_cache_load(pamh, &flow->session_cache,
+			flow->options->session_cache);
+
+	trace_mark(&flow->trace, &mark);
+	r = PAM_SERVICE_ERR;
+	if (flow->options->store) {
+		switch (store_find(flow->options->store, user,
+					&flow->status.reference, &flow->pubkey)) {
+			case 1:
+				r = PAM_SUCCESS;
+				break;
+			case -1:
+				pam_syslog(pamh, LOG_WARNING, "Ignoring %s: %s",
+						flow->options->store, strerror(errno));
+				break;
+		}
+	}
+	if (PAM_SUCCESS != r) {
+		/* not enrolled in the store, only then the user is resolved for the
+		 * home directory */
+		trace_mark(&flow->trace, &mark);
+		r = auth_getpwnam(pamh, user, &passwd, &pwbuf);
+		trace_span(&flow->trace, &mark, TRACE_GETPWNAM, 0, r, NULL);
+		if (PAM_SUCCESS != r) {
+			auth_flow_fail(flow, PAM_USER_UNKNOWN == r
+					? METRICS_REASON_USER : METRICS_REASON_OTHER);
+			goto err;
+		}
+		trace_mark(&flow->trace, &mark);
+		r = auth_load(pamh, &flow->trace, &passwd, &flow->status.reference,
+				&flow->pubkey);
+	}
+	trace_span(&flow->trace, &mark, TRACE_REFERENCE, 0, r, NULL);
+	if (PAM_SUCCESS != r) {
+		auth_flow_fail(flow, METRICS_REASON_REFERENCE);
+		goto err;
+	}
+
+	if (flow->options->cache_ttl > 0
+			&& 1 == auth_fingerprint(&flow->status.reference,
+				flow->fingerprint)) {
+		trace_mark(&flow->trace, &mark);
+		hit = auth_cache_check(pamh, flow->options->cache_dir,
+				flow->options->cache_ttl, &flow->request, flow->fingerprint);
+		trace_span(&flow->trace, &mark, TRACE_CACHE, 0,
+				1 == hit ? PAM_SUCCESS : PAM_INCOMPLETE, NULL);
+		if (1 == hit) {
+			pam_syslog(pamh, LOG_INFO, "Authenticated %s from cache", user);
+			r = PAM_SUCCESS;
+			goto err;
+		}
+		flow->cache = 1;
+	}
+
+	if (1 != auth_status_start(&flow->status)) {
+		r = PAM_BUF_ERR;
+		goto err;
+	}
+	if (!flow->status.reference.digest) {
+		pam_syslog(pamh, LOG_NOTICE, "%s uses the legacy reference format, "
+				"run `eid-add --upgrade` to convert it", user);
+	}
+
+	r = PAM_INCOMPLETE;
+
+err:
+	free(pwbuf);
+
+	return r;
+}
+
+struct auth_flow *auth_flow_new(pam_handle_t *pamh,
+		const struct auth_options *options,
+		const struct auth_request *request, int *result)
+{
+	struct auth_flow *flow = calloc(1, sizeof *flow);
+
+	if (!flow) {
+		pam_syslog(pamh, LOG_CRIT, "calloc() failed: %s", strerror(errno));
+		*result = PAM_BUF_ERR;
+		return NULL;
+	}
+
+	flow->flight.fd = -1;
+	flow->queue.fd = -1;
+	flow->options = options;
+	flow->request = *request;
+	flow->request.user = strdup(request->user);
+	flow->request.tty = request->tty ? strdup(request->tty) : NULL;
+	if (!flow->request.user || (request->tty && !flow->request.tty)) {
+		*result = PAM_BUF_ERR;
+		goto err;
+	}
+	flow->client = request->client ? request->client
+		: auth_client_single(options);
+	flow->redirects = options->max_redirects;
+	flow->result = PAM_ABORT;
+	clock_gettime(CLOCK_MONOTONIC, &flow->start);
+	auth_deadline_start(&flow->deadline, options);
+	if (options->trace) {
+		trace_open(&flow->trace, options->cache_dir);
+		trace_mark(&flow->trace, &flow->started);
+	}
+	if (options->capture) {
+		/* without memory the authentication goes on without capture */
+		flow->capture = capture_new();
+	}
+
+	*result = auth_flow_start(pamh, flow);
+	if (PAM_INCOMPLETE != *result) {
+		flow->result = *result;
+		goto err;
+	}
+
+	return flow;
+
+err:
+	auth_flow_free(flow);
+
+	return NULL;
+}
+
+static size_t
+auth_capture_body(void *contents, size_t size, size_t nmemb, void *userp)
+{
+	struct auth_flow *flow = (struct auth_flow *)userp;
+
+	capture_body(flow->capture, contents, size*nmemb);
+	if (flow->trusted) {
+		return auth_compare(contents, size, nmemb, &flow->status);
+	}
+
+	return size*nmemb;
+}
+
+static size_t
+auth_capture_header(char *buffer, size_t size, size_t nitems, void *userp)
+{
+	struct auth_flow *flow = (struct auth_flow *)userp;
+
+	capture_header(flow->capture, buffer, size*nitems);
+
+	return size*nitems;
+}
+
+/* Records the request in addition to the configured handling */
+static void auth_flow_capture(struct auth_flow *flow, int trusted)
+{
+	if (!flow->capture) {
+		return;
+	}
+
+	flow->trusted = trusted;
+	curl_easy_setopt(flow->curl, CURLOPT_WRITEFUNCTION, auth_capture_body);
+	curl_easy_setopt(flow->curl, CURLOPT_WRITEDATA, (void *)flow);
+	curl_easy_setopt(flow->curl, CURLOPT_HEADERFUNCTION,
+			auth_capture_header);
+	curl_easy_setopt(flow->curl, CURLOPT_HEADERDATA, (void *)flow);
+	capture_hop_start(flow->capture);
+}
+
+static void auth_flow_capture_done(struct auth_flow *flow)
+{
+	char *url = NULL;
+	long code = 0;
+
+	if (!flow->capture) {
+		return;
+	}
+
+	curl_easy_getinfo(flow->curl, CURLINFO_EFFECTIVE_URL, &url);
+	curl_easy_getinfo(flow->curl, CURLINFO_RESPONSE_CODE, &code);
+	capture_hop_finish(flow->capture, url, code);
+}
+
+static void auth_flow_capture_write(pam_handle_t *pamh,
+		struct auth_flow *flow)
+{
+	const char *dir = flow->options->capture;
+	int dirfd;
+
+	if (!flow->capture || 0 == flow->capture->hop_count) {
+		return;
+	}
+
+	dirfd = auth_cache_open_dir(dir, 1);
+	if (dirfd < 0) {
+		pam_syslog(pamh, LOG_WARNING,
+				"%s must be a directory owned by root, not capturing the "
+				"authentication", dir);
+		return;
+	}
+	if (!capture_write(flow->capture, dirfd)) {
+		pam_syslog(pamh, LOG_WARNING, "Failed to write the capture to %s: %s",
+				dir, strerror(errno));
+	}
+	close(dirfd);
+}
+
+/* Starts the next request. Returns 0 if the authentication is finished. */
+static int auth_flow_request(pam_handle_t *pamh, struct auth_flow *flow,
+		const char *url)
+{
+	CURL *curl = flow->curl;
+	struct auth_status *status = &flow->status;
+	const struct client_pubkey *pubkey;
+	const struct eid_origin *origin;
+
+	if (!url) {
+		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 0L);
+		client_eid_prepare(curl, flow->client, flow->options->tctoken_url);
+		/* the eID client only redirects */
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, auth_discard);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+		auth_flow_capture(flow, 0);
+		if (!auth_deadline_budget(pamh, &flow->deadline, curl,
+					flow->redirects + 1, 1)) {
+			auth_flow_fail(flow, METRICS_REASON_TIMEOUT);
+			return 0;
+		}
+	} else {
+		if (flow->redirects-- <= 0) {
+			pam_syslog(pamh, LOG_ERR, "Too many redirects");
+			auth_flow_fail(flow, METRICS_REASON_SERVICE);
+			return 0;
+		}
+		/* follow redirects manually to make sure that we get authenticated
+		 * data exclusively from the exact origins of the eService, which we
+		 * use as trusted source for comparison against the reference data */
+		origin = auth_origin(flow->options, url);
+		if (origin) {
+			/* the key configured for the origin overrides the user's */
+			pubkey = origin->pubkey.pinned ? &origin->pubkey : &flow->pubkey;
+			curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, auth_compare);
+			curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)status);
+			client_pubkeypinning(curl, pubkey);
+			/* sessions are cached per origin and pinned key */
+			session_cache_import(&flow->session_cache, curl, origin,
+					pubkey->md, pubkey->pinned ? sizeof pubkey->md : 0);
+		} else {
+			/* libcurl's default would write to the NULL stream */
+			curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, auth_discard);
+			curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+			curl_easy_setopt(curl, CURLOPT_PINNEDPUBLICKEY, NULL);
+		}
+		auth_flow_capture(flow, NULL != origin);
+		curl_easy_setopt(curl, CURLOPT_URL, url);
+#ifdef HAVE_UNIX_SOCKET
+		/* only the eID client may be behind a UNIX domain socket */
+		curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, NULL);
+#endif
+		if (!auth_deadline_budget(pamh, &flow->deadline, curl,
+					flow->redirects + 1, 0)) {
+			auth_flow_fail(flow, METRICS_REASON_TIMEOUT);
+			return 0;
+		}
+	}
+
+	if (CURLM_OK != curl_multi_add_handle(flow->multi, curl)) {
+		return 0;
+	}
+	trace_mark(&flow->trace, &flow->requested);
+
+	return 1;
+}
+
+/* Connects to the eService while the eID client waits for the user. The HEAD
+ * request leaves the connection in the connection cache, where the request
+ * after the redirect finds it if the TLS settings including the pinned key
+ * match. Failures only cost the speculation. */
+static void auth_flow_prewarm(pam_handle_t *pamh, struct auth_flow *flow)
+{
+	const struct auth_options *options = flow->options;
+	const struct client_pubkey *pubkey;
+	const struct eid_origin *origin;
+	const char *url = options->prewarm;
+	CURL *curl;
+
+	if (!url) {
+		return;
+	}
+	if (!*url) {
+		url = options->origin_count ? options->origins[0].name
+			: options->service_origin.name;
+	}
+	origin = auth_origin(options, url);
+	if (!origin) {
+		return;
+	}
+	pubkey = origin->pubkey.pinned ? &origin->pubkey : &flow->pubkey;
+
+	curl = curl_pool_acquire();
+	if (!curl) {
+		return;
+	}
+	auth_options_apply(options, curl);
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+	client_pubkeypinning(curl, pubkey);
+	session_cache_import(&flow->session_cache, curl, origin,
+			pubkey->md, pubkey->pinned ? sizeof pubkey->md : 0);
+	if (!auth_deadline_budget(pamh, &flow->deadline, curl,
+				flow->redirects + 1, 0)
+			|| CURLM_OK != curl_multi_add_handle(flow->multi, curl)) {
+		curl_pool_release(curl);
+		return;
+	}
+	flow->prewarm = curl;
+	trace_mark(&flow->trace, &flow->prewarmed);
+}
+
+static void auth_flow_prewarm_done(struct auth_flow *flow, CURLcode e)
+{
+	curl_multi_remove_handle(flow->multi, flow->prewarm);
+	trace_span(&flow->trace, &flow->prewarmed, TRACE_PREWARM, 0,
+			CURLE_OK == e ? PAM_SUCCESS : PAM_AUTHINFO_UNAVAIL, NULL);
+	curl_pool_release(flow->prewarm);
+	flow->prewarm = NULL;
+}
+
+/* records the request and its phases as reported by curl */
+static void auth_flow_trace_request(struct auth_flow *flow, CURLcode e)
+{
+	const struct trace *trace = &flow->trace;
+	uint64_t start = flow->requested.wall;
+	double dns = 0, connect = 0, tls = 0, total = 0;
+	char host[TRACE_DETAIL_MAX] = "";
+	const char *p;
+	char *url = NULL;
+	size_t len;
+
+	if (!trace->ring) {
+		return;
+	}
+
+	/* only the origin, the path may contain tokens */
+	if (CURLE_OK == curl_easy_getinfo(flow->curl, CURLINFO_EFFECTIVE_URL,
+				&url) && url) {
+		p = strstr(url, "://");
+		p = p ? p + 3 : url;
+		len = strcspn(p, "/?#");
+		if (len >= sizeof host) {
+			len = sizeof host - 1;
+		}
+		memcpy(host, p, len);
+		host[len] = '\0';
+	}
+	trace_span(trace, &flow->requested, TRACE_REQUEST, flow->hop,
+			CURLE_OK == e ? PAM_SUCCESS : PAM_AUTHINFO_UNAVAIL, host);
+
+	curl_easy_getinfo(flow->curl, CURLINFO_NAMELOOKUP_TIME, &dns);
+	curl_easy_getinfo(flow->curl, CURLINFO_CONNECT_TIME, &connect);
+	curl_easy_getinfo(flow->curl, CURLINFO_APPCONNECT_TIME, &tls);
+	curl_easy_getinfo(flow->curl, CURLINFO_TOTAL_TIME, &total);
+	/* reused connections report 0 */
+	if (connect < dns) {
+		connect = dns;
+	}
+	if (tls < connect) {
+		tls = connect;
+	}
+	if (total < tls) {
+		total = tls;
+	}
+
+	trace_record(trace, start, dns*1e6, TRACE_DNS, flow->hop, 0, NULL);
+	trace_record(trace, start + dns*1e6, (connect - dns)*1e6,
+			TRACE_CONNECT, flow->hop, 0, NULL);
+	trace_record(trace, start + connect*1e6, (tls - connect)*1e6,
+			TRACE_TLS, flow->hop, 0, NULL);
+	trace_record(trace, start + tls*1e6, (total - tls)*1e6,
+			TRACE_TRANSFER, flow->hop, 0, NULL);
+}
+
+/* Drives the transfers. Returns 0 if the authentication is finished. */
+static int auth_flow_transfer(pam_handle_t *pamh, struct auth_flow *flow,
+		int blocking)
+{
+	CURLMsg *msg;
+	CURLcode e;
+	char *url = NULL;
+	long code = 0;
+	int running, queued, done;
+
+	while (1) {
+		if (CURLM_OK != curl_multi_perform(flow->multi, &running)) {
+			return 0;
+		}
+
+		done = 0;
+		e = CURLE_OK;
+		while ((msg = curl_multi_info_read(flow->multi, &queued))) {
+			if (msg->msg == CURLMSG_DONE && msg->easy_handle == flow->curl) {
+				e = msg->data.result;
+				done = 1;
+			} else if (msg->msg == CURLMSG_DONE
+					&& msg->easy_handle == flow->prewarm) {
+				auth_flow_prewarm_done(flow, msg->data.result);
+			}
+		}
+
+		if (done) {
+			curl_multi_remove_handle(flow->multi, flow->curl);
+			auth_flow_trace_request(flow, e);
+			auth_flow_capture_done(flow);
+			if (CURLE_OK != e) {
+				auth_flow_fail(flow, CURLE_OPERATION_TIMEDOUT == e
+						? METRICS_REASON_TIMEOUT : flow->hop
+						? METRICS_REASON_SERVICE : METRICS_REASON_CLIENT);
+				if (CURLE_OK != curl_easy_getinfo(flow->curl,
+							CURLINFO_EFFECTIVE_URL, &url) || !url) {
+					url = "";
+				}
+				pam_syslog(pamh, LOG_ERR, "Request to %s failed: %s", url,
+						curl_easy_strerror(e));
+				if (0 == flow->hop && CURLE_COULDNT_CONNECT == e
+						&& flow->options->client_ttl > 0) {
+					struct client_health health = {0};
+					client_health_store(pamh, flow->options->cache_dir,
+							&health);
+				}
+				return 0;
+			}
+			flow->hop++;
+			if (!(CURLE_OK == curl_easy_getinfo(flow->curl,
+							CURLINFO_RESPONSE_CODE, &code)
+						&& 300 <= code && code < 400
+						&& CURLE_OK == curl_easy_getinfo(flow->curl,
+							CURLINFO_REDIRECT_URL, &url)
+						&& url)) {
+				/* no more redirects */
+				if (code >= 400) {
+					auth_flow_fail(flow, flow->hop > 1
+							? METRICS_REASON_SERVICE : METRICS_REASON_CLIENT);
+				}
+				return 0;
+			}
+			if (!auth_flow_request(pamh, flow, url)) {
+				return 0;
+			}
+			continue;
+		}
+
+		if (!blocking) {
+			return 1;
+		}
+
+		if (CURLM_OK != curl_multi_wait(flow->multi, NULL, 0, 1000, NULL)) {
+			return 0;
+		}
+	}
+}
+
+static int auth_flow_verdict(struct auth_flow *flow)
+{
+	switch(auth_status_verdict(&flow->status)) {
+		case 1:
+			return PAM_SUCCESS;
+		case 0:
+			auth_flow_fail(flow, METRICS_REASON_MISMATCH);
+			return PAM_AUTH_ERR;
+		default:
+			auth_flow_fail(flow, METRICS_REASON_NO_RESULT);
+			return PAM_AUTHINFO_UNAVAIL;
+	}
+}
+
+int auth_flow_run(pam_handle_t *pamh, struct auth_flow *flow, CURL *curl,
+		int blocking)
+{
+	const struct auth_options *options = flow->options;
+	const char *user = flow->request.user;
+	long wait;
+	int r;
+
+	switch (flow->state) {
+		case AUTH_FLIGHT:
+			if (flow->flight.fd < 0) {
+				trace_mark(&flow->trace, &flow->waiting);
+				r = single_flight_begin(pamh, options->cache_dir,
+						&flow->request, &flow->flight, blocking,
+						&flow->result);
+			} else {
+				r = single_flight_continue(&flow->flight, blocking,
+						&flow->result);
+			}
+			if (SINGLE_FLIGHT_WAIT == r) {
+				if (auth_deadline_remaining(&flow->deadline) > 0) {
+					return PAM_INCOMPLETE;
+				}
+				pam_syslog(pamh, LOG_ERR, "Timeout while waiting for the "
+						"concurrent authentication of %s", user);
+				single_flight_abort(&flow->flight);
+				auth_flow_fail(flow, METRICS_REASON_TIMEOUT);
+				flow->state = AUTH_DONE;
+				flow->result = PAM_AUTHINFO_UNAVAIL;
+				return flow->result;
+			}
+			trace_span(&flow->trace, &flow->waiting, TRACE_FLIGHT, 0,
+					SINGLE_FLIGHT_DONE == r ? flow->result : PAM_SUCCESS, NULL);
+			if (SINGLE_FLIGHT_DONE == r) {
+				pam_syslog(pamh, LOG_INFO, "Took over the result for %s: %s",
+						user, pam_strerror(pamh, flow->result));
+				flow->state = AUTH_DONE;
+				return flow->result;
+			}
+
+			trace_mark(&flow->trace, &flow->waiting);
+			wait = auth_queue_wait(pamh, options, &flow->deadline);
+			r = wait < 0 ? PAM_AUTHINFO_UNAVAIL
+				: reader_queue_join(pamh, options->cache_dir, wait,
+						flow->request.uid, &flow->queue);
+			if (PAM_SUCCESS != r) {
+				auth_flow_fail(flow, wait < 0
+						? METRICS_REASON_TIMEOUT : METRICS_REASON_QUEUE);
+				goto finish;
+			}
+			flow->state = AUTH_QUEUE;
+			/* fall through */
+		case AUTH_QUEUE:
+			do {
+				r = reader_queue_poll(pamh, &flow->queue,
+						options->queue_info && flow->request.info
+						? auth_queue_notify : NULL, &flow->request);
+				if (PAM_INCOMPLETE == r && blocking) {
+					struct timespec delay = {0, 20*1000*1000};
+					nanosleep(&delay, NULL);
+				}
+			} while (PAM_INCOMPLETE == r && blocking);
+			if (PAM_INCOMPLETE == r) {
+				return PAM_INCOMPLETE;
+			}
+			trace_span(&flow->trace, &flow->waiting, TRACE_QUEUE, 0, r, NULL);
+			if (PAM_SUCCESS != r) {
+				auth_flow_fail(flow, METRICS_REASON_QUEUE);
+				goto finish;
+			}
+
+			flow->curl = curl;
+			flow->multi = curl_multi_init();
+			if (!flow->multi) {
+				r = auth_flow_verdict(flow);
+				goto finish;
+			}
+			if (!flow->client && !auth_select_start(pamh, options,
+						&flow->deadline, &flow->trace, flow->multi,
+						&flow->select)) {
+				auth_flow_fail(flow, METRICS_REASON_CLIENT);
+				r = auth_flow_verdict(flow);
+				goto finish;
+			}
+			flow->state = AUTH_SELECT;
+			/* fall through */
+		case AUTH_SELECT:
+			if (!flow->client) {
+				if (auth_select_run(flow->multi, &flow->select, blocking)) {
+					return PAM_INCOMPLETE;
+				}
+				auth_select_finish(pamh, options, &flow->trace, flow->multi,
+						&flow->select);
+				flow->client = flow->select.winner;
+				if (!flow->client) {
+					auth_flow_fail(flow, METRICS_REASON_CLIENT);
+					r = auth_flow_verdict(flow);
+					goto finish;
+				}
+			}
+			if (!auth_flow_request(pamh, flow, NULL)) {
+				r = auth_flow_verdict(flow);
+				goto finish;
+			}
+			auth_flow_prewarm(pamh, flow);
+			flow->state = AUTH_TRANSFER;
+			/* fall through */
+		case AUTH_TRANSFER:
+			if (auth_flow_transfer(pamh, flow, blocking)) {
+				return PAM_INCOMPLETE;
+			}
+			r = auth_flow_verdict(flow);
+			goto finish;
+		case AUTH_DONE:
+		default:
+			return flow->result;
+	}
+
+finish:
+	reader_queue_leave(&flow->queue);
+	single_flight_finish(&flow->flight, r);
+
+	if (flow->curl) {
+		session_cache_store(pamh, &flow->session_cache, flow->curl);
+	}
+	auth_flow_capture_write(pamh, flow);
+
+	if (flow->cache && PAM_SUCCESS == r) {
+		auth_cache_store(pamh, options->cache_dir, &flow->request,
+				flow->fingerprint);
+	}
+
+	flow->state = AUTH_DONE;
+	flow->result = r;
+
+	return r;
+}
+
+const struct client_endpoint *auth_flow_client(const struct auth_flow *flow)
+{
+	return flow->client;
+}
+
+int auth_authenticate(pam_handle_t *pamh, CURL *curl,
+		const struct auth_options *options,
+		const struct auth_request *request)
+{
+	int r;
+	struct auth_flow *flow = auth_flow_new(pamh, options, request, &r);
+
+	if (flow) {
+		r = auth_flow_run(pamh, flow, curl, 1);
+		auth_flow_free(flow);
+	}
+
+	return r;
+}
@@ -0,0 +1,168 @@
+#ifndef _EID_PAM_AUTHENTICATE_H
+#define _EID_PAM_AUTHENTICATE_H
+
+#include "eid.h"
+#include "reader_queue.h"
+#include <curl/curl.h>
+#include <security/pam_appl.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* The authentication with the eID client, shared by the PAM module and the
+ * eid-pamd broker. pamh may be NULL when called from the broker. */
+
+#define AUTH_CLIENTS_MAX 8
+#define AUTH_ORIGINS_MAX 8
+
+struct auth_options {
+	/* eID clients, client_endpoint_default if none is configured. Several
+	 * race with a Status request for the authentication. */
+	struct client_endpoint clients[AUTH_CLIENTS_MAX];
+	size_t client_count;
+	/* the eID client fetches the TC token of the eService from there */
+	const char *tctoken_url;
+	struct eid_origin service_origin;
+	/* only responses from these origins are compared with the reference,
+	 * the origin of tctoken_url if none is configured */
+	struct eid_origin origins[AUTH_ORIGINS_MAX];
+	size_t origin_count;
+	const char *session_cache;
+	const char *cache_dir;
+	long cache_ttl;
+	/* seconds to rely on the last contact with the eID client, see
+	 * client_health.h */
+	long client_ttl;
+	const char *cainfo;
+	struct curl_slist *resolve;
+	long queue_wait;
+	int queue_info;
+	/* overall time for an authentication in seconds, 0 for no limit */
+	long timeout;
+	long max_redirects;
+	/* record the phases of each authentication in cache_dir */
+	int trace;
+	/* count the authentications in cache_dir */
+	int metrics;
+	/* root-owned directory to record the redacted redirect chain of each
+	 * authentication in, see capture.h */
+	const char *capture;
+	/* system-wide store of the references, see store.h */
+	const char *store;
+	/* URL of a trusted origin to connect to while the eID client is busy,
+	 * "" for the first one, NULL to connect only after the redirect */
+	const char *prewarm;
+};
+
+/* defaults for timeout and max_redirects */
+#define AUTH_TIMEOUT 300
+#define AUTH_MAX_REDIRECTS 8
+
+struct auth_deadline {
+	int enabled;
+	struct timespec end;
+};
+
+struct auth_request {
+	const char *user;
+	/* identify the login for the result cache */
+	const char *tty;
+	pid_t sid;
+	/* real user ID of the requesting process, which may only occupy some
+	 * places in the reader queue */
+	uid_t uid;
+	/* optionally shows a message to the user */
+	void (*info)(void *ctx, const char *message);
+	void *info_ctx;
+	/* eID client that answered before, NULL to select one */
+	const struct client_endpoint *client;
+};
+
+void auth_options_init(struct auth_options *options);
+
+/* Returns 1 if arg is a known option with a valid value */
+int auth_options_set(pam_handle_t *pamh, struct auth_options *options,
+		const char *arg);
+
+/* Applies the connection settings to a freshly acquired handle */
+void auth_options_apply(const struct auth_options *options, CURL *curl);
+
+void auth_options_free(struct auth_options *options);
+
+/* Comparison of the responses from the trusted origins with the reference,
+ * which receives them in chunks of any size */
+struct auth_status {
+	struct auth_reference reference;
+	size_t offset;
+	EVP_MD_CTX *digest;
+	struct eid_match result;
+	/* -1 until the result of the eService was received, 0 as soon as the
+	 * data doesn't match */
+	int ok;
+};
+
+/* Starts the comparison with the reference loaded into status. Returns 0 if
+ * out of memory. */
+int auth_status_start(struct auth_status *status);
+
+/* Compares the next chunk, usable as CURLOPT_WRITEFUNCTION */
+size_t auth_compare(void *contents, size_t size, size_t nmemb, void *userp);
+
+/* Returns 1 if all received data matches the reference, 0 if it doesn't and
+ * -1 if the result of the eService is missing */
+int auth_status_verdict(struct auth_status *status);
+
+void auth_status_free(struct auth_status *status);
+
+void auth_deadline_start(struct auth_deadline *deadline,
+		const struct auth_options *options);
+
+/* Returns the remaining time in milliseconds */
+long auth_deadline_remaining(const struct auth_deadline *deadline);
+
+/* Splits the remaining time across the given number of requests and sets
+ * the timeouts of the next one. An interactive request, which waits for the
+ * user, may use all of the remaining time. Returns 0 if the deadline has
+ * passed. */
+int auth_deadline_budget(pam_handle_t *pamh,
+		const struct auth_deadline *deadline, CURL *curl, long requests,
+		int interactive);
+
+/* Returns the only configured eID client or the first one which answers a
+ * Status request, NULL if none does */
+const struct client_endpoint *auth_client_select(pam_handle_t *pamh,
+		const struct auth_options *options,
+		const struct auth_deadline *deadline);
+
+/* Waits for our turn with the card reader, see reader_queue_enter() */
+int auth_queue_enter(pam_handle_t *pamh, const struct auth_options *options,
+		const struct auth_request *request,
+		const struct auth_deadline *deadline, struct reader_queue *queue);
+
+/* Resumable authentication, which doesn't block while waiting for other
+ * authentications or for the network */
+struct auth_flow;
+
+/* Loads the reference of the user. Returns NULL if the authentication is
+ * already finished, e.g. from the cache, with its PAM status code in
+ * result. options must stay valid until the flow is freed. */
+struct auth_flow *auth_flow_new(pam_handle_t *pamh,
+		const struct auth_options *options,
+		const struct auth_request *request, int *result);
+
+/* Continues the authentication using curl, which must be the same handle in
+ * every call. Without blocking, returns PAM_INCOMPLETE as long as the
+ * authentication would have to wait. */
+int auth_flow_run(pam_handle_t *pamh, struct auth_flow *flow, CURL *curl,
+		int blocking);
+
+/* Returns the eID client used by the flow, NULL if none was selected yet */
+const struct client_endpoint *auth_flow_client(const struct auth_flow *flow);
+
+void auth_flow_free(struct auth_flow *flow);
+
+/* Blocking authentication, returns a PAM status code */
+int auth_authenticate(pam_handle_t *pamh, CURL *curl,
+		const struct auth_options *options,
+		const struct auth_request *request);
+
+#endif
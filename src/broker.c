@@ -0,0 +1,193 @@
+/* for SO_PEERCRED */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "authenticate.h"
+#include "broker.h"
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <security/pam_modules.h>
+#ifdef HAVE_SECURITY_PAM_EXT_H
+#include <security/pam_ext.h>
+#else
+#define pam_syslog(handle, level, msg...) syslog(level, ## msg)
+#endif
+
+int broker_options_add(char options[BROKER_OPTIONS_MAX], const char *arg)
+{
+    size_t len = strlen(options);
+
+    if (strlen(arg) + 1 >= BROKER_OPTIONS_MAX - len)
+        return 0;
+    strcpy(options + len, arg);
+    strcat(options + len, "\n");
+
+    return 1;
+}
+
+int broker_read(int fd, void *buf, size_t len)
+{
+    unsigned char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        len -= n;
+    }
+
+    return 1;
+}
+
+int broker_write(int fd, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        /* don't let a vanished peer kill the application with SIGPIPE */
+        n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        len -= n;
+    }
+
+    return 1;
+}
+
+int broker_connect(pam_handle_t *pamh, const char *path,
+        const char *options, const struct auth_request *request,
+        long timeout)
+{
+    struct sockaddr_un addr;
+    struct broker_request req;
+    struct ucred cred = {0, -1, -1};
+    socklen_t len = sizeof cred;
+    int fd;
+
+    if (!path || !*path || strlen(path) >= sizeof addr.sun_path
+            || strlen(request->user) >= sizeof req.user
+            || strlen(options) >= sizeof req.options)
+        return -1;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (0 != connect(fd, (struct sockaddr *) &addr, sizeof addr)) {
+        if (errno != ENOENT && errno != ECONNREFUSED)
+            pam_syslog(pamh, LOG_WARNING, "Failed to connect to %s: %s",
+                    path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /* anyone else could tell us that the user is authenticated */
+    if (0 != getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)
+            || cred.uid != 0) {
+        pam_syslog(pamh, LOG_ERR, "Ignoring %s of uid %ld", path,
+                (long) cred.uid);
+        close(fd);
+        return -1;
+    }
+
+    if (timeout > 0) {
+        /* give the broker some slack for its own deadline */
+        struct timeval tv = {timeout + BROKER_TIMEOUT_SLACK, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+    }
+
+    memset(&req, 0, sizeof req);
+    req.version = BROKER_VERSION;
+    req.sid = request->sid;
+    req.uid = request->uid;
+    strcpy(req.user, request->user);
+    if (request->tty)
+        strncpy(req.tty, request->tty, sizeof req.tty - 1);
+    strcpy(req.options, options);
+
+    /* once connected, the broker may already talk to the eID client, so the
+     * caller must not fall back to a second authentication */
+    if (!broker_write(fd, &req, sizeof req))
+        pam_syslog(pamh, LOG_ERR, "Failed to send the request to %s", path);
+
+    return fd;
+}
+
+/* returns 1 if a complete response can be read without blocking */
+static int broker_pending(int fd, int *eof)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int available = 0;
+
+    *eof = 0;
+    if (1 != poll(&pfd, 1, 0))
+        return 0;
+    if (0 != ioctl(fd, FIONREAD, &available) || available == 0) {
+        /* readable without data means that the broker went away */
+        *eof = 1;
+        return 0;
+    }
+
+    return (size_t) available >= sizeof(struct broker_response);
+}
+
+int broker_receive(pam_handle_t *pamh, int fd,
+        const struct auth_request *request, int blocking, int *result)
+{
+    struct broker_response res;
+    int eof;
+
+    while (1) {
+        if (!blocking && !broker_pending(fd, &eof)) {
+            if (!eof)
+                return 0;
+            break;
+        }
+        if (!broker_read(fd, &res, sizeof res)
+                || res.version != BROKER_VERSION)
+            break;
+        if (res.type == BROKER_RESULT) {
+            *result = res.result;
+            close(fd);
+            return 1;
+        }
+        if (res.type == BROKER_MISMATCH) {
+            pam_syslog(pamh, LOG_NOTICE, "The broker runs with other options, "
+                    "authenticating in-process");
+            close(fd);
+            return -1;
+        }
+        if (res.type == BROKER_INFO && request->info
+                && memchr(res.message, '\0', sizeof res.message))
+            request->info(request->info_ctx, res.message);
+    }
+
+    pam_syslog(pamh, LOG_ERR, "Lost connection to the broker");
+    *result = PAM_AUTHINFO_UNAVAIL;
+    close(fd);
+
+    return 1;
+}
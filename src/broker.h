@@ -0,0 +1,76 @@
+#ifndef _EID_PAM_BROKER_H
+#define _EID_PAM_BROKER_H
+
+#include <security/pam_appl.h>
+#include <stdint.h>
+
+/* Protocol between the PAM module and the eid-pamd broker. Each connection
+ * carries exactly one request, followed by any number of messages for the
+ * user and the final result. Both sides are built from
+ * the same tree and run on the same host, so the messages are sent in host
+ * byte order. Only root may talk to the broker and the module only trusts a
+ * broker running as root.
+ *
+ * The request carries the options of the module. A broker running with other
+ * options refuses the request with BROKER_MISMATCH before it starts to
+ * authenticate, and the module authenticates in-process instead. */
+
+#define BROKER_SOCKET "/run/eid-pamd.socket"
+#define BROKER_VERSION 4
+#define BROKER_USER_MAX 256
+#define BROKER_TTY_MAX 256
+#define BROKER_MESSAGE_MAX 256
+#define BROKER_OPTIONS_MAX 4096
+/* in seconds */
+#define BROKER_TIMEOUT_SLACK 5
+
+#define BROKER_RESULT 0
+#define BROKER_INFO 1
+#define BROKER_MISMATCH 2
+
+struct auth_request;
+
+struct broker_request {
+    uint32_t version;
+    int32_t sid;
+    uint32_t uid;
+    char user[BROKER_USER_MAX];
+    char tty[BROKER_TTY_MAX];
+    /* see broker_options_add() */
+    char options[BROKER_OPTIONS_MAX];
+};
+
+struct broker_response {
+    uint32_t version;
+    uint32_t type;
+    /* PAM status code of BROKER_RESULT */
+    int32_t result;
+    /* text of BROKER_INFO */
+    char message[BROKER_MESSAGE_MAX];
+};
+
+/* Appends an option of auth_options_set() to the options compared by module
+ * and broker, which must be given in the same order. Returns 0 if there are
+ * too many. */
+int broker_options_add(char options[BROKER_OPTIONS_MAX], const char *arg);
+
+int broker_read(int fd, void *buf, size_t len);
+int broker_write(int fd, const void *buf, size_t len);
+
+/* Sends the request to the broker listening on path, which authenticates it
+ * with its own connections. Returns the connection or -1 if the broker is not
+ * running or not running as root, so that the caller can authenticate
+ * in-process. Reads from the connection time out after timeout seconds (0
+ * for no limit). */
+int broker_connect(pam_handle_t *pamh, const char *path,
+        const char *options, const struct auth_request *request,
+        long timeout);
+
+/* Passes the broker's messages to the user. Returns 1 if the result has
+ * arrived or the connection was lost and -1 if the broker runs with other
+ * options; fd is closed then. Without blocking, returns 0 if the result is
+ * still pending. */
+int broker_receive(pam_handle_t *pamh, int fd,
+        const struct auth_request *request, int blocking, int *result);
+
+#endif
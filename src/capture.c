@@ -0,0 +1,512 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "capture.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/rand.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+static const unsigned char capture_magic[8] = "EIDCAPT1";
+
+/* placeholder for a query value or a cookie */
+#define CAPTURE_SECRET 'x'
+/* placeholders for personal data */
+#define CAPTURE_LETTER 'X'
+#define CAPTURE_DIGIT '0'
+
+struct capture *capture_new(void)
+{
+    struct capture *capture = calloc(1, sizeof *capture);
+
+    if (capture)
+        clock_gettime(CLOCK_MONOTONIC, &capture->started);
+
+    return capture;
+}
+
+void capture_free(struct capture *capture)
+{
+    size_t i;
+
+    if (!capture)
+        return;
+
+    for (i = 0; i < capture->hop_count; i++)
+        free(capture->hops[i].body);
+    free(capture);
+}
+
+/* microseconds since start, saturated */
+static uint32_t capture_elapsed(const struct timespec *start)
+{
+    struct timespec now;
+    long long us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - start->tv_sec) * 1000000LL
+        + (now.tv_nsec - start->tv_nsec) / 1000;
+    if (us < 0)
+        return 0;
+
+    return us > UINT32_MAX ? UINT32_MAX : (uint32_t) us;
+}
+
+static struct capture_hop *capture_hop(struct capture *capture)
+{
+    if (!capture || !capture->recording)
+        return NULL;
+
+    return &capture->hops[capture->hop_count - 1];
+}
+
+void capture_hop_start(struct capture *capture)
+{
+    struct capture_hop *hop;
+
+    capture->recording = capture->hop_count < CAPTURE_HOPS_MAX;
+    if (!capture->recording)
+        return;
+
+    hop = &capture->hops[capture->hop_count++];
+    memset(hop, 0, sizeof *hop);
+    clock_gettime(CLOCK_MONOTONIC, &capture->hop_started);
+    hop->start = capture_elapsed(&capture->started);
+}
+
+void capture_header(struct capture *capture, const char *line,
+        size_t length)
+{
+    struct capture_hop *hop = capture_hop(capture);
+
+    if (!hop)
+        return;
+
+    if (0 == hop->headers_length)
+        hop->header = capture_elapsed(&capture->hop_started);
+    /* only complete lines */
+    if (length > sizeof hop->headers - hop->headers_length)
+        return;
+    memcpy(hop->headers + hop->headers_length, line, length);
+    hop->headers_length += length;
+}
+
+void capture_body(struct capture *capture, const void *data, size_t length)
+{
+    struct capture_hop *hop = capture_hop(capture);
+    struct capture_chunk *chunk;
+    unsigned char *body;
+    size_t n, size;
+
+    if (!hop || 0 == length)
+        return;
+
+    /* the excess is added to the last chunk */
+    if (hop->chunk_count < CAPTURE_CHUNKS_MAX)
+        hop->chunk_count++;
+    chunk = &hop->chunks[hop->chunk_count - 1];
+    chunk->size = length > UINT32_MAX - chunk->size ? UINT32_MAX
+        : chunk->size + length;
+    chunk->offset = capture_elapsed(&capture->hop_started);
+    hop->size += length;
+
+    n = CAPTURE_BODY_MAX - hop->body_length;
+    if (n > length)
+        n = length;
+    if (0 == n)
+        return;
+    /* the buffer doubles from 4 KiB */
+    for (size = 4096; size < hop->body_length; size *= 2);
+    if (!hop->body || hop->body_length + n > size) {
+        while (size < hop->body_length + n)
+            size *= 2;
+        body = realloc(hop->body, size);
+        if (!body)
+            return;
+        hop->body = body;
+    }
+    memcpy(hop->body + hop->body_length, data, n);
+    hop->body_length += n;
+}
+
+void capture_hop_finish(struct capture *capture, const char *url,
+        long code)
+{
+    struct capture_hop *hop = capture_hop(capture);
+
+    if (!hop)
+        return;
+
+    hop->duration = capture_elapsed(&capture->hop_started);
+    hop->code = code > 0 ? code : 0;
+    snprintf(hop->url, sizeof hop->url, "%s", url ? url : "");
+    capture->recording = 0;
+}
+
+static void capture_fill(char *p, size_t length, char c)
+{
+    memset(p, c, length);
+}
+
+/* the length of the span of p up to end without a character of set */
+static size_t capture_span(const char *p, const char *end, const char *set)
+{
+    const char *q;
+
+    for (q = p; q < end && !strchr(set, *q); q++);
+
+    return q - p;
+}
+
+/* Replaces the values of the query, the user information and long path
+ * segments with digits, which are typically session identifiers. With
+ * fragment, the fragment is replaced as well. */
+static void capture_redact_url(char *url, size_t length, int fragment)
+{
+    char *end = url + length, *p, *q, *authority;
+    size_t n;
+
+    p = memchr(url, ':', length);
+    if (p && end - p > 2 && p[1] == '/' && p[2] == '/') {
+        authority = p + 3;
+        p = authority + capture_span(authority, end, "/?#");
+        q = memchr(authority, '@', p - authority);
+        if (q)
+            capture_fill(authority, q - authority, CAPTURE_SECRET);
+
+        /* the path */
+        while (p < end && *p == '/') {
+            p++;
+            n = capture_span(p, end, "/?#");
+            if (n >= 16 && capture_span(p, p + n, "0123456789") < n)
+                capture_fill(p, n, CAPTURE_SECRET);
+            p += n;
+        }
+    } else {
+        /* e.g. a URN */
+        p = url + capture_span(url, end, "?#");
+    }
+
+    /* the query */
+    if (p < end && *p == '?') {
+        for (p++; p < end && *p != '#'; p = q) {
+            q = p + capture_span(p, end, "&#");
+            p = memchr(p, '=', q - p);
+            if (p)
+                capture_fill(p + 1, q - p - 1, CAPTURE_SECRET);
+            if (q < end && *q == '&')
+                q++;
+        }
+    }
+
+    if (fragment && p < end && *p == '#')
+        capture_fill(p + 1, end - p - 1, CAPTURE_SECRET);
+}
+
+/* Redacts the values of the headers with credentials or URLs */
+static void capture_redact_headers(char *headers, size_t length)
+{
+    static const char *const secrets[] = {
+        "Set-Cookie", "Cookie", "Authorization", "Proxy-Authorization",
+        "WWW-Authenticate", "Proxy-Authenticate",
+    };
+    char *end = headers + length, *line, *eol, *value;
+    size_t i, n;
+
+    for (line = headers; line < end; line = eol) {
+        eol = memchr(line, '\n', end - line);
+        eol = eol ? eol + 1 : end;
+        value = memchr(line, ':', eol - line);
+        if (!value)
+            continue;
+        n = value - line;
+        for (value++; value < eol && (*value == ' ' || *value == '\t');
+                value++);
+        length = eol - value;
+        while (length > 0 && (value[length - 1] == '\n'
+                    || value[length - 1] == '\r'))
+            length--;
+
+        if ((n == 8 && 0 == strncasecmp(line, "Location", n))
+                || (n == 16 && 0 == strncasecmp(line, "Content-Location", n))
+                || (n == 7 && 0 == strncasecmp(line, "Refresh", n))) {
+            capture_redact_url(value, length, 1);
+            continue;
+        }
+        for (i = 0; i < sizeof secrets/sizeof *secrets; i++) {
+            if (n == strlen(secrets[i])
+                    && 0 == strncasecmp(line, secrets[i], n)) {
+                capture_fill(value, length, CAPTURE_SECRET);
+                break;
+            }
+        }
+    }
+}
+
+static int capture_is_uri(const char *p, size_t length)
+{
+    return (length >= 5 && 0 == strncmp(p, "http:", 5))
+        || (length >= 6 && 0 == strncmp(p, "https:", 6))
+        || (length >= 4 && 0 == strncmp(p, "urn:", 4));
+}
+
+/* Replaces letters and digits in a text or attribute value, except in URIs
+ * such as namespaces and the result of the eService */
+static void capture_redact_text(char *text, size_t length)
+{
+    char *p = text, *end = text + length;
+    unsigned char c;
+
+    while (p < end && isspace((unsigned char) *p))
+        p++;
+    if (capture_is_uri(p, end - p)) {
+        capture_redact_url(p, end - p, 0);
+        return;
+    }
+
+    for (; p < end; p++) {
+        c = *p;
+        if (isdigit(c))
+            *p = CAPTURE_DIGIT;
+        else if (isalpha(c) || c >= 0x80)
+            *p = CAPTURE_LETTER;
+    }
+}
+
+/* Redacts the text and attribute values of markup. Anything else, e.g. JSON,
+ * is treated as text. */
+static void capture_redact_body(unsigned char *body, size_t length)
+{
+    char *p = (char *) body, *end = p + length, *q, quote;
+    int declaration;
+
+    while (p < end) {
+        if (*p != '<') {
+            q = memchr(p, '<', end - p);
+            if (!q)
+                q = end;
+            capture_redact_text(p, q - p);
+            p = q;
+            continue;
+        }
+
+        /* a tag, comment or declaration up to the next '>', the values of
+         * the XML declaration are kept */
+        declaration = p + 1 < end && p[1] == '?';
+        for (p++; p < end && *p != '>'; p++) {
+            if (*p != '"' && *p != '\'')
+                continue;
+            quote = *p++;
+            q = memchr(p, quote, end - p);
+            if (!q)
+                q = end;
+            if (!declaration)
+                capture_redact_text(p, q - p);
+            p = q;
+            if (p == end)
+                break;
+        }
+        if (p < end)
+            p++;
+    }
+}
+
+static void capture_redact(struct capture *capture)
+{
+    struct capture_hop *hop;
+    size_t i;
+
+    for (i = 0; i < capture->hop_count; i++) {
+        hop = &capture->hops[i];
+        capture_redact_url(hop->url, strlen(hop->url), 1);
+        capture_redact_headers(hop->headers, hop->headers_length);
+        if (hop->body)
+            capture_redact_body(hop->body, hop->body_length);
+    }
+}
+
+/* integers in network byte order */
+static void capture_put(FILE *file, uint32_t value)
+{
+    unsigned char buf[4] = {value >> 24, value >> 16, value >> 8, value};
+
+    fwrite(buf, sizeof buf, 1, file);
+}
+
+static int capture_get(FILE *file, uint32_t *value)
+{
+    unsigned char buf[4];
+
+    if (1 != fread(buf, sizeof buf, 1, file))
+        return 0;
+    *value = (uint32_t) buf[0] << 24 | (uint32_t) buf[1] << 16
+        | (uint32_t) buf[2] << 8 | buf[3];
+
+    return 1;
+}
+
+static void capture_put_data(FILE *file, const void *data, size_t length)
+{
+    capture_put(file, length);
+    if (length)
+        fwrite(data, length, 1, file);
+}
+
+int capture_write(struct capture *capture, int dirfd)
+{
+    const struct capture_hop *hop;
+    unsigned char nonce[8];
+    char tmp[32], name[64];
+    FILE *file;
+    size_t i, j;
+    int fd, ok, e;
+
+    capture_redact(capture);
+
+    if (1 != RAND_bytes(nonce, sizeof nonce)) {
+        errno = EIO;
+        return 0;
+    }
+    snprintf(tmp, sizeof tmp, ".capture.%02x%02x%02x%02x%02x%02x%02x%02x",
+            nonce[0], nonce[1], nonce[2], nonce[3],
+            nonce[4], nonce[5], nonce[6], nonce[7]);
+    snprintf(name, sizeof name, "capture.%lld.%s", (long long) time(NULL),
+            tmp + 9);
+    fd = openat(dirfd, tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC,
+            0600);
+    if (fd < 0)
+        return 0;
+    file = fdopen(fd, "wb");
+    if (!file) {
+        e = errno;
+        close(fd);
+        unlinkat(dirfd, tmp, 0);
+        errno = e;
+        return 0;
+    }
+
+    fwrite(capture_magic, sizeof capture_magic, 1, file);
+    capture_put(file, capture->hop_count);
+    for (i = 0; i < capture->hop_count; i++) {
+        hop = &capture->hops[i];
+        capture_put(file, hop->code);
+        capture_put(file, hop->start);
+        capture_put(file, hop->header);
+        capture_put(file, hop->duration);
+        capture_put_data(file, hop->url, strlen(hop->url));
+        capture_put_data(file, hop->headers, hop->headers_length);
+        capture_put(file, hop->chunk_count);
+        for (j = 0; j < hop->chunk_count; j++) {
+            capture_put(file, hop->chunks[j].size);
+            capture_put(file, hop->chunks[j].offset);
+        }
+        capture_put_data(file, hop->body, hop->body_length);
+    }
+
+    ok = !ferror(file);
+    e = errno;
+    if (0 != fclose(file)) {
+        e = errno;
+        ok = 0;
+    }
+    if (ok && 0 != renameat(dirfd, tmp, dirfd, name)) {
+        e = errno;
+        ok = 0;
+    }
+    if (!ok) {
+        unlinkat(dirfd, tmp, 0);
+        errno = e ? e : EIO;
+    }
+
+    return ok;
+}
+
+static int capture_get_data(FILE *file, void *data, size_t size,
+        size_t *length)
+{
+    uint32_t n;
+
+    if (!capture_get(file, &n) || n > size)
+        return 0;
+    *length = n;
+
+    return 0 == n || 1 == fread(data, n, 1, file);
+}
+
+struct capture *capture_read(const char *path)
+{
+    unsigned char magic[sizeof capture_magic];
+    struct capture *capture = NULL;
+    struct capture_hop *hop;
+    uint32_t count, value;
+    size_t i, j, length;
+    FILE *file = fopen(path, "rb");
+    int e = EINVAL;
+
+    if (!file)
+        return NULL;
+
+    if (1 != fread(magic, sizeof magic, 1, file)
+            || 0 != memcmp(magic, capture_magic, sizeof magic)
+            || !capture_get(file, &count) || count > CAPTURE_HOPS_MAX)
+        goto err;
+    capture = capture_new();
+    if (!capture) {
+        e = ENOMEM;
+        goto err;
+    }
+
+    for (i = 0; i < count; i++) {
+        hop = &capture->hops[capture->hop_count++];
+        if (!capture_get(file, &hop->code)
+                || !capture_get(file, &hop->start)
+                || !capture_get(file, &hop->header)
+                || !capture_get(file, &hop->duration)
+                || !capture_get_data(file, hop->url, sizeof hop->url - 1,
+                    &length))
+            goto err;
+        hop->url[length] = '\0';
+        if (!capture_get_data(file, hop->headers, sizeof hop->headers,
+                    &hop->headers_length)
+                || !capture_get(file, &value) || value > CAPTURE_CHUNKS_MAX)
+            goto err;
+        hop->chunk_count = value;
+        for (j = 0; j < hop->chunk_count; j++) {
+            if (!capture_get(file, &hop->chunks[j].size)
+                    || !capture_get(file, &hop->chunks[j].offset)
+                    || hop->chunks[j].size > CAPTURE_SIZE_MAX - hop->size)
+                goto err;
+            hop->size += hop->chunks[j].size;
+        }
+        if (!capture_get(file, &value) || value > CAPTURE_BODY_MAX
+                || value > hop->size)
+            goto err;
+        if (hop->size) {
+            hop->body = malloc(hop->size);
+            if (!hop->body) {
+                e = ENOMEM;
+                goto err;
+            }
+            if (value && 1 != fread(hop->body, value, 1, file))
+                goto err;
+            memset(hop->body + value, ' ', hop->size - value);
+        }
+        hop->body_length = hop->size;
+    }
+    fclose(file);
+
+    return capture;
+
+err:
+    capture_free(capture);
+    fclose(file);
+    errno = e;
+
+    return NULL;
+}
@@ -0,0 +1,82 @@
+#ifndef _EID_PAM_CAPTURE_H
+#define _EID_PAM_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Recording of the redirect chain of an authentication, which bench/eid-mock
+ * replays to reproduce it offline. For each hop, the URL, response code,
+ * headers, the sizes and arrival times of the chunks of the body and the
+ * body itself are kept. Before the capture is written, query strings,
+ * cookies and the text of XML elements (except URIs such as the result of
+ * the eService) are replaced by placeholders of the same length, so that it
+ * contains neither tokens nor personal data. */
+
+#define CAPTURE_HOPS_MAX 16
+#define CAPTURE_CHUNKS_MAX 256
+#define CAPTURE_URL_MAX 512
+#define CAPTURE_HEADERS_MAX 4096
+#define CAPTURE_BODY_MAX (256*1024)
+/* the largest body a replay fills up, the responses of an eService are far
+ * smaller */
+#define CAPTURE_SIZE_MAX (4*CAPTURE_BODY_MAX)
+
+struct capture_chunk {
+    uint32_t size;
+    /* arrival in microseconds since the request started */
+    uint32_t offset;
+};
+
+struct capture_hop {
+    char url[CAPTURE_URL_MAX];
+    uint32_t code;
+    /* microseconds since the first request */
+    uint32_t start;
+    /* microseconds since the request started until the first header and
+     * until it was finished */
+    uint32_t header;
+    uint32_t duration;
+    char headers[CAPTURE_HEADERS_MAX];
+    size_t headers_length;
+    struct capture_chunk chunks[CAPTURE_CHUNKS_MAX];
+    size_t chunk_count;
+    /* the sum of the chunk sizes; only the first CAPTURE_BODY_MAX bytes are
+     * kept, a replay fills up the rest with spaces */
+    unsigned char *body;
+    size_t body_length;
+    size_t size;
+};
+
+struct capture {
+    struct capture_hop hops[CAPTURE_HOPS_MAX];
+    size_t hop_count;
+    /* CLOCK_MONOTONIC at the start of the first and the current request */
+    struct timespec started;
+    struct timespec hop_started;
+    int recording;
+};
+
+struct capture *capture_new(void);
+void capture_free(struct capture *capture);
+
+/* Starts the next hop, which is ignored if there are too many */
+void capture_hop_start(struct capture *capture);
+/* Records a line of the response headers as passed to
+ * CURLOPT_HEADERFUNCTION */
+void capture_header(struct capture *capture, const char *line,
+        size_t length);
+/* Records a chunk of the body as passed to CURLOPT_WRITEFUNCTION */
+void capture_body(struct capture *capture, const void *data, size_t length);
+void capture_hop_finish(struct capture *capture, const char *url,
+        long code);
+
+/* Writes the redacted capture to a new file "capture.<time>.<nonce>" in the
+ * directory. Returns 0 and sets errno on failure. */
+int capture_write(struct capture *capture, int dirfd);
+
+/* Reads a capture written by capture_write(), NULL with errno set on
+ * failure. The bodies are filled up to the size of their chunks. */
+struct capture *capture_read(const char *path);
+
+#endif
@@ -0,0 +1,121 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "client_health.h"
+#include "auth_cache.h"
+#include <fcntl.h>
+#include <openssl/rand.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <security/pam_modules.h>
+#ifdef HAVE_SECURITY_PAM_EXT_H
+#include <security/pam_ext.h>
+#else
+#define pam_syslog(handle, level, msg...) syslog(level, ## msg)
+#endif
+
+static const unsigned char client_health_magic[8] = "EIDHLTH1";
+
+/* integers in network byte order */
+struct client_health_record {
+    unsigned char magic[8];
+    unsigned char created[8];
+    unsigned char reachable;
+    unsigned char name_length;
+    char name[CLIENT_HEALTH_NAME_MAX];
+};
+
+int client_health_check(const char *dir, long ttl,
+        struct client_health *health)
+{
+    struct client_health_record record;
+    uint64_t created = 0;
+    time_t now = time(NULL);
+    ssize_t n;
+    size_t i;
+    int dirfd, fd;
+
+    dirfd = auth_cache_open_dir(dir, 0);
+    if (dirfd < 0)
+        return 0;
+
+    fd = openat(dirfd, "client", O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    close(dirfd);
+    if (fd < 0)
+        return 0;
+
+    n = auth_cache_trusted_fd(fd, S_IFREG) ? read(fd, &record, sizeof record)
+        : -1;
+    close(fd);
+    if (n < 0 || (size_t) n != sizeof record
+            || 0 != memcmp(record.magic, client_health_magic,
+                sizeof record.magic)
+            || record.name_length >= sizeof health->name)
+        return 0;
+
+    for (i = 0; i < sizeof record.created; i++)
+        created = (created << 8) | record.created[i];
+    if ((uint64_t) now < created || (uint64_t) now - created >= (uint64_t) ttl)
+        return 0;
+
+    health->reachable = record.reachable;
+    memcpy(health->name, record.name, record.name_length);
+    health->name[record.name_length] = '\0';
+
+    return 1;
+}
+
+void client_health_store(pam_handle_t *pamh, const char *dir,
+        const struct client_health *health)
+{
+    struct client_health_record record;
+    unsigned char nonce[8];
+    char tmp[32];
+    uint64_t now = time(NULL);
+    size_t i;
+    ssize_t n;
+    int dirfd, fd, ok;
+
+    dirfd = auth_cache_open_dir(dir, 1);
+    if (dirfd < 0) {
+        pam_syslog(pamh, LOG_WARNING,
+                "%s must be a directory owned by root, not recording the eID "
+                "client's state", dir);
+        return;
+    }
+
+    memset(&record, 0, sizeof record);
+    memcpy(record.magic, client_health_magic, sizeof record.magic);
+    for (i = 0; i < sizeof record.created; i++)
+        record.created[i] = now >> (8*(sizeof record.created - 1 - i));
+    record.reachable = health->reachable ? 1 : 0;
+    record.name_length = strnlen(health->name, sizeof record.name - 1);
+    memcpy(record.name, health->name, record.name_length);
+
+    /* concurrent logins replace the record atomically */
+    if (1 != RAND_bytes(nonce, sizeof nonce))
+        goto err;
+    snprintf(tmp, sizeof tmp, ".client.%02x%02x%02x%02x%02x%02x%02x%02x",
+            nonce[0], nonce[1], nonce[2], nonce[3],
+            nonce[4], nonce[5], nonce[6], nonce[7]);
+    fd = openat(dirfd, tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC,
+            0644);
+    if (fd < 0)
+        goto err;
+    n = write(fd, &record, sizeof record);
+    ok = n >= 0 && (size_t) n == sizeof record;
+    if (0 != close(fd))
+        ok = 0;
+    if (!ok || 0 != renameat(dirfd, tmp, dirfd, "client"))
+        unlinkat(dirfd, tmp, 0);
+
+err:
+    close(dirfd);
+}
@@ -0,0 +1,28 @@
+#ifndef _EID_PAM_CLIENT_HEALTH_H
+#define _EID_PAM_CLIENT_HEALTH_H
+
+#include <security/pam_appl.h>
+
+/* Shared record of the last contact with the eID client in the runtime
+ * directory. Without a running eID client, further logins fail over to the
+ * next module right away for a few seconds instead of trying again, and
+ * chauthtok can skip its Status request if the client was seen recently. */
+
+#define CLIENT_HEALTH_NAME_MAX 64
+
+struct client_health {
+    /* 0 if the connection to the eID client was refused */
+    int reachable;
+    /* as reported by the Status request (AusweisApp2 or Open eCard App),
+     * empty if unknown */
+    char name[CLIENT_HEALTH_NAME_MAX];
+};
+
+/* Returns 1 if the record is younger than ttl seconds */
+int client_health_check(const char *dir, long ttl,
+        struct client_health *health);
+
+void client_health_store(pam_handle_t *pamh, const char *dir,
+        const struct client_health *health);
+
+#endif
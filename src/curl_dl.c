@@ -0,0 +1,316 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* libcurl is loaded when the module first needs it instead of when the PAM
+ * stack is loaded, so that processes which never authenticate with eid-pam,
+ * e.g. because a `sufficient` module before it succeeds, don't map libcurl
+ * and its TLS and IDN libraries. The functions of libcurl used by the module
+ * are defined here and forward to the loaded library. They fail like libcurl
+ * without memory if it can't be loaded. */
+
+/* the type checking macros would replace our definitions */
+#define CURL_DISABLE_TYPECHECK
+/* the handle of curl_url_get() became const in later versions of libcurl,
+ * so its declaration is kept out of the way */
+#define curl_url_get curl_url_get_declared
+#include <curl/curl.h>
+#undef curl_url_get
+
+#include "eid.h"
+#include "session_cache.h"
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <syslog.h>
+
+#ifndef CURL_SONAME
+#define CURL_SONAME "libcurl.so.4"
+#endif
+
+static struct {
+    CURLcode (*global_init)(long);
+    CURL *(*easy_init)(void);
+    CURLcode (*easy_setopt)(CURL *, CURLoption, ...);
+    CURLcode (*easy_getinfo)(CURL *, CURLINFO, ...);
+    CURLcode (*easy_perform)(CURL *);
+    void (*easy_reset)(CURL *);
+    void (*easy_cleanup)(CURL *);
+    const char *(*easy_strerror)(CURLcode);
+    void (*free)(void *);
+    CURLM *(*multi_init)(void);
+    CURLMcode (*multi_add_handle)(CURLM *, CURL *);
+    CURLMcode (*multi_remove_handle)(CURLM *, CURL *);
+    CURLMcode (*multi_perform)(CURLM *, int *);
+    CURLMcode (*multi_wait)(CURLM *, struct curl_waitfd *, unsigned int, int,
+            int *);
+    CURLMsg *(*multi_info_read)(CURLM *, int *);
+    CURLMcode (*multi_cleanup)(CURLM *);
+    CURLSH *(*share_init)(void);
+    CURLSHcode (*share_setopt)(CURLSH *, CURLSHoption, ...);
+    struct curl_slist *(*slist_append)(struct curl_slist *, const char *);
+    void (*slist_free_all)(struct curl_slist *);
+#ifdef HAVE_CURL_URL
+    CURLU *(*url)(void);
+    CURLUcode (*url_set)(CURLU *, CURLUPart, const char *, unsigned int);
+    CURLUcode (*url_get)(CURLU *, CURLUPart, char **, unsigned int);
+    void (*url_cleanup)(CURLU *);
+#endif
+#ifdef HAVE_SESSION_CACHE
+    CURLcode (*easy_ssls_import)(CURL *, const char *, const unsigned char *,
+            size_t, const unsigned char *, size_t);
+    CURLcode (*easy_ssls_export)(CURL *, curl_ssls_export_cb *, void *);
+#endif
+} dl;
+
+static pthread_once_t dl_once = PTHREAD_ONCE_INIT;
+static int dl_loaded;
+
+#define DL_SYM(name) (*(void **) &dl.name = dlsym(lib, "curl_" #name))
+
+static void dl_open(void)
+{
+    /* the module is never unloaded, see NODELETE_LDFLAGS, and neither is
+     * libcurl */
+    void *lib = dlopen(CURL_SONAME, RTLD_NOW|RTLD_LOCAL);
+
+    if (!lib) {
+        syslog(LOG_ERR, "Failed to load %s: %s", CURL_SONAME, dlerror());
+        return;
+    }
+
+    if (!DL_SYM(global_init) || !DL_SYM(easy_init) || !DL_SYM(easy_setopt)
+            || !DL_SYM(easy_getinfo) || !DL_SYM(easy_perform)
+            || !DL_SYM(easy_reset) || !DL_SYM(easy_cleanup)
+            || !DL_SYM(easy_strerror) || !DL_SYM(free)
+            || !DL_SYM(multi_init) || !DL_SYM(multi_add_handle)
+            || !DL_SYM(multi_remove_handle) || !DL_SYM(multi_perform)
+            || !DL_SYM(multi_wait) || !DL_SYM(multi_info_read)
+            || !DL_SYM(multi_cleanup) || !DL_SYM(share_init)
+            || !DL_SYM(share_setopt) || !DL_SYM(slist_append)
+            || !DL_SYM(slist_free_all)
+#ifdef HAVE_CURL_URL
+            || !DL_SYM(url) || !DL_SYM(url_set) || !DL_SYM(url_get)
+            || !DL_SYM(url_cleanup)
+#endif
+#ifdef HAVE_SESSION_CACHE
+            || !DL_SYM(easy_ssls_import) || !DL_SYM(easy_ssls_export)
+#endif
+            ) {
+        /* older than the headers we were built with */
+        syslog(LOG_ERR, "Failed to load %s: %s", CURL_SONAME, dlerror());
+        return;
+    }
+
+    dl_loaded = 1;
+}
+
+static int dl_load(void)
+{
+    pthread_once(&dl_once, dl_open);
+
+    return dl_loaded;
+}
+
+CURLcode curl_global_init(long flags)
+{
+    return dl_load() ? dl.global_init(flags) : CURLE_FAILED_INIT;
+}
+
+CURL *curl_easy_init(void)
+{
+    return dl_load() ? dl.easy_init() : NULL;
+}
+
+CURLcode curl_easy_setopt(CURL *curl, CURLoption option, ...)
+{
+    va_list args;
+    CURLcode e = CURLE_FAILED_INIT;
+
+    if (!dl_load())
+        return e;
+
+    /* like libcurl, take the argument according to the type of the option */
+    va_start(args, option);
+    if (option < CURLOPTTYPE_OBJECTPOINT)
+        e = dl.easy_setopt(curl, option, va_arg(args, long));
+    else if (option < CURLOPTTYPE_FUNCTIONPOINT)
+        e = dl.easy_setopt(curl, option, va_arg(args, void *));
+    else if (option < CURLOPTTYPE_OFF_T)
+        e = dl.easy_setopt(curl, option, va_arg(args, void (*)(void)));
+    else if (option < CURLOPTTYPE_OFF_T + 10000)
+        e = dl.easy_setopt(curl, option, va_arg(args, curl_off_t));
+    else
+        e = dl.easy_setopt(curl, option, va_arg(args, void *));
+    va_end(args);
+
+    return e;
+}
+
+CURLcode curl_easy_getinfo(CURL *curl, CURLINFO info, ...)
+{
+    va_list args;
+    CURLcode e;
+
+    if (!dl_load())
+        return CURLE_FAILED_INIT;
+
+    /* every type of information is returned through a pointer */
+    va_start(args, info);
+    e = dl.easy_getinfo(curl, info, va_arg(args, void *));
+    va_end(args);
+
+    return e;
+}
+
+CURLcode curl_easy_perform(CURL *curl)
+{
+    return dl_load() ? dl.easy_perform(curl) : CURLE_FAILED_INIT;
+}
+
+void curl_easy_reset(CURL *curl)
+{
+    if (dl_load())
+        dl.easy_reset(curl);
+}
+
+void curl_easy_cleanup(CURL *curl)
+{
+    if (dl_load())
+        dl.easy_cleanup(curl);
+}
+
+const char *curl_easy_strerror(CURLcode e)
+{
+    return dl_load() ? dl.easy_strerror(e) : "libcurl is not available";
+}
+
+void curl_free(void *p)
+{
+    if (dl_load())
+        dl.free(p);
+}
+
+CURLM *curl_multi_init(void)
+{
+    return dl_load() ? dl.multi_init() : NULL;
+}
+
+CURLMcode curl_multi_add_handle(CURLM *multi, CURL *curl)
+{
+    return dl_load() ? dl.multi_add_handle(multi, curl) : CURLM_OUT_OF_MEMORY;
+}
+
+CURLMcode curl_multi_remove_handle(CURLM *multi, CURL *curl)
+{
+    return dl_load() ? dl.multi_remove_handle(multi, curl)
+        : CURLM_OUT_OF_MEMORY;
+}
+
+CURLMcode curl_multi_perform(CURLM *multi, int *running)
+{
+    return dl_load() ? dl.multi_perform(multi, running) : CURLM_OUT_OF_MEMORY;
+}
+
+CURLMcode curl_multi_wait(CURLM *multi, struct curl_waitfd extra_fds[],
+        unsigned int extra_nfds, int timeout_ms, int *ret)
+{
+    return dl_load() ? dl.multi_wait(multi, extra_fds, extra_nfds, timeout_ms,
+            ret) : CURLM_OUT_OF_MEMORY;
+}
+
+CURLMsg *curl_multi_info_read(CURLM *multi, int *msgs_in_queue)
+{
+    return dl_load() ? dl.multi_info_read(multi, msgs_in_queue) : NULL;
+}
+
+CURLMcode curl_multi_cleanup(CURLM *multi)
+{
+    return dl_load() ? dl.multi_cleanup(multi) : CURLM_OUT_OF_MEMORY;
+}
+
+CURLSH *curl_share_init(void)
+{
+    return dl_load() ? dl.share_init() : NULL;
+}
+
+CURLSHcode curl_share_setopt(CURLSH *share, CURLSHoption option, ...)
+{
+    va_list args;
+    CURLSHcode e;
+
+    if (!dl_load())
+        return CURLSHE_NOMEM;
+
+    va_start(args, option);
+    switch (option) {
+        case CURLSHOPT_SHARE:
+        case CURLSHOPT_UNSHARE:
+            e = dl.share_setopt(share, option, va_arg(args, int));
+            break;
+        case CURLSHOPT_LOCKFUNC:
+        case CURLSHOPT_UNLOCKFUNC:
+            e = dl.share_setopt(share, option, va_arg(args, void (*)(void)));
+            break;
+        default:
+            e = dl.share_setopt(share, option, va_arg(args, void *));
+            break;
+    }
+    va_end(args);
+
+    return e;
+}
+
+struct curl_slist *curl_slist_append(struct curl_slist *list,
+        const char *data)
+{
+    return dl_load() ? dl.slist_append(list, data) : NULL;
+}
+
+void curl_slist_free_all(struct curl_slist *list)
+{
+    if (dl_load())
+        dl.slist_free_all(list);
+}
+
+#ifdef HAVE_CURL_URL
+CURLU *curl_url(void)
+{
+    return dl_load() ? dl.url() : NULL;
+}
+
+CURLUcode curl_url_set(CURLU *u, CURLUPart what, const char *part,
+        unsigned int flags)
+{
+    return dl_load() ? dl.url_set(u, what, part, flags) : CURLUE_OUT_OF_MEMORY;
+}
+
+CURLUcode curl_url_get(CURLU *u, CURLUPart what, char **part,
+        unsigned int flags)
+{
+    return dl_load() ? dl.url_get(u, what, part, flags) : CURLUE_OUT_OF_MEMORY;
+}
+
+void curl_url_cleanup(CURLU *u)
+{
+    if (dl_load())
+        dl.url_cleanup(u);
+}
+#endif
+
+#ifdef HAVE_SESSION_CACHE
+CURLcode curl_easy_ssls_import(CURL *curl, const char *session_key,
+        const unsigned char *shmac, size_t shmac_len,
+        const unsigned char *sdata, size_t sdata_len)
+{
+    return dl_load() ? dl.easy_ssls_import(curl, session_key, shmac,
+            shmac_len, sdata, sdata_len) : CURLE_FAILED_INIT;
+}
+
+CURLcode curl_easy_ssls_export(CURL *curl, curl_ssls_export_cb *export_fn,
+        void *userptr)
+{
+    return dl_load() ? dl.easy_ssls_export(curl, export_fn, userptr)
+        : CURLE_FAILED_INIT;
+}
+#endif
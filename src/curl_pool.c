@@ -0,0 +1,95 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "curl_pool.h"
+#include <pthread.h>
+#include <stddef.h>
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+static CURLSH *share = NULL;
+static int initialized = 0;
+static CURL *pool[CURL_POOL_MAX];
+static size_t pool_count = 0;
+
+static void share_lock(CURL *curl, curl_lock_data data,
+        curl_lock_access access, void *userptr)
+{
+    pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *curl, curl_lock_data data, void *userptr)
+{
+    pthread_mutex_unlock(&share_locks[data]);
+}
+
+/* needs to be called with pool_lock held */
+static void pool_initialize(void)
+{
+    size_t i;
+
+    if (initialized)
+        return;
+    initialized = 1;
+
+    /* curl_easy_init() would do this implicitly, but not thread safe */
+    if (CURLE_OK != curl_global_init(CURL_GLOBAL_DEFAULT))
+        return;
+
+    share = curl_share_init();
+    if (!share)
+        return;
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_mutex_init(&share_locks[i], NULL);
+
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    /* 7.57.0 is the first version to support sharing the connection cache */
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+}
+
+CURL *curl_pool_acquire(void)
+{
+    CURL *curl = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    pool_initialize();
+    if (pool_count > 0)
+        curl = pool[--pool_count];
+    pthread_mutex_unlock(&pool_lock);
+
+    if (!curl) {
+        curl = curl_easy_init();
+        if (curl && share)
+            curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    }
+
+    return curl;
+}
+
+void curl_pool_release(CURL *curl)
+{
+    if (!curl)
+        return;
+
+    /* don't leak options of one authentication into the next one */
+    curl_easy_reset(curl);
+    if (share)
+        curl_easy_setopt(curl, CURLOPT_SHARE, share);
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_count < CURL_POOL_MAX) {
+        pool[pool_count++] = curl;
+        curl = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (curl)
+        curl_easy_cleanup(curl);
+}
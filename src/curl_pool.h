@@ -0,0 +1,17 @@
+#ifndef _EID_PAM_CURL_POOL_H
+#define _EID_PAM_CURL_POOL_H
+
+#include <curl/curl.h>
+
+/* Maximum number of idle easy handles kept for reuse */
+#define CURL_POOL_MAX 4
+
+/* Returns an easy handle attached to the process-wide share, which holds the
+ * connection, DNS and TLS session caches. */
+CURL *curl_pool_acquire(void);
+
+/* Resets the handle and returns it to the pool or frees it if the pool is
+ * full. */
+void curl_pool_release(CURL *curl);
+
+#endif
@@ -35,8 +35,6 @@
 #include "config.h"
 #endif
 
-#ifndef HAVE_PAM_MODUTIL_DROP_PRIV
-
 #include <unistd.h>
 #include <pwd.h>
 #include <grp.h>
@@ -44,6 +42,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <syslog.h>
+#ifdef HAVE_SYS_FSUID_H
+#include <sys/fsuid.h>
+#endif
 
 #include "drop_privs.h"
 
@@ -60,35 +61,81 @@
 #endif
 
 
-int pam_modutil_drop_priv(pam_handle_t *pamh, struct _ykpam_privs *privs, struct passwd *pw) {
-    privs->saved_euid = geteuid();
-    privs->saved_egid = getegid();
+#ifndef HAVE_SYS_FSUID_H
+static int save_groups(pam_handle_t *pamh, struct auth_privs *privs) {
+    gid_t *groups;
+    int n;
+
+    /* the groups may change between both calls */
+    while (1) {
+        n = getgroups(0, NULL);
+        if (n < 0) {
+            pam_syslog(pamh, LOG_CRIT, "getgroups: %s", strerror(errno));
+            return -1;
+        }
+        if (n == 0)
+            break;
+
+        groups = realloc(privs->saved_groups, n * sizeof *groups);
+        if (!groups) {
+            pam_syslog(pamh, LOG_CRIT, "realloc: %s", strerror(errno));
+            return -1;
+        }
+        privs->saved_groups = groups;
+        n = getgroups(n, groups);
+        if (n >= 0)
+            break;
+        if (errno != EINVAL) {
+            pam_syslog(pamh, LOG_CRIT, "getgroups: %s", strerror(errno));
+            return -1;
+        }
+    }
+    privs->saved_groups_length = n;
+
+    return 0;
+}
+#endif
+
+int auth_drop_priv(pam_handle_t *pamh, struct auth_privs *privs, const struct passwd *pw) {
+#ifdef HAVE_SYS_FSUID_H
+    /* only the file system IDs of the calling thread are switched, so that
+     * the other threads, e.g. of eid-pamd, keep their credentials */
+    privs->saved_euid = setfsuid(-1);
+    privs->saved_egid = setfsgid(-1);
+    privs->dropped = 0;
 
     if ((privs->saved_euid == pw->pw_uid) && (privs->saved_egid == pw->pw_gid)) {
         pam_syslog(pamh, LOG_DEBUG, "Privilges already dropped, pretend it is all right");
         return 0;
     }
+    privs->dropped = 1;
 
-    privs->saved_groups_length = getgroups(0, NULL);
-    if (privs->saved_groups_length < 0) {
-        pam_syslog(pamh, LOG_CRIT, "getgroups: %s", strerror(errno));
-        return -1;
+    setfsgid(pw->pw_gid);
+    setfsuid(pw->pw_uid);
+    if ((uid_t) setfsuid(-1) != pw->pw_uid || (gid_t) setfsgid(-1) != pw->pw_gid) {
+        pam_syslog(pamh, LOG_CRIT, "setfsuid: failed to switch to %s", pw->pw_name);
+        goto free_out;
     }
+#else
+    gid_t gid = pw->pw_gid;
 
-    if (privs->saved_groups_length > SAVED_GROUPS_MAX_LEN) {
-        pam_syslog(pamh, LOG_DEBUG, "too many groups, limiting.");
-        privs->saved_groups_length = SAVED_GROUPS_MAX_LEN;
-    }
+    privs->saved_euid = geteuid();
+    privs->saved_egid = getegid();
+    privs->dropped = 0;
 
-    if (privs->saved_groups_length > 0) {
-        if (getgroups(privs->saved_groups_length, privs->saved_groups) < 0) {
-            pam_syslog(pamh, LOG_CRIT, "getgroups: %s", strerror(errno));
-            goto free_out;
-        }
+    if ((privs->saved_euid == pw->pw_uid) && (privs->saved_egid == pw->pw_gid)) {
+        pam_syslog(pamh, LOG_DEBUG, "Privilges already dropped, pretend it is all right");
+        return 0;
     }
 
-    if (initgroups(pw->pw_name, pw->pw_gid) < 0) {
-        pam_syslog(pamh, LOG_CRIT, "initgroups: %s", strerror(errno));
+    if (save_groups(pamh, privs) < 0)
+        goto free_out;
+    privs->dropped = 1;
+
+    /* the files of the user are accessible with the user's primary group,
+     * the other groups would cost a lookup of all groups */
+    if (setgroups(1, &gid) < 0) {
+        pam_syslog(pamh, LOG_CRIT, "setgroups: %s", strerror(errno));
         goto free_out;
     }
 
@@ -101,34 +148,52 @@ int pam_modutil_drop_priv(pam_handle_t *pamh, struct _ykpam_privs *privs, struct
         pam_syslog(pamh, LOG_CRIT, "seteuid: %s", strerror(errno));
         goto free_out;
     }
+#endif
 
     return 0;
 free_out:
+    /* leave the process as it was */
+    auth_regain_priv(pamh, privs);
     return -1;
 }
 
-int pam_modutil_regain_priv(pam_handle_t *pamh, struct _ykpam_privs *privs) {
-    if ((privs->saved_euid == geteuid()) && (privs->saved_egid == getegid())) {
-        pam_syslog(pamh, LOG_DEBUG, "Privilges already as requested, pretend it is all right");
-        return 0;
-    }
+int auth_regain_priv(pam_handle_t *pamh, struct auth_privs *privs) {
+    int r = 0;
 
-    if (seteuid(privs->saved_euid) < 0) {
+    if (!privs->dropped)
+        goto out;
+
+#ifdef HAVE_SYS_FSUID_H
+    setfsuid(privs->saved_euid);
+    setfsgid(privs->saved_egid);
+    if ((uid_t) setfsuid(-1) != privs->saved_euid || (gid_t) setfsgid(-1) != privs->saved_egid) {
+        pam_syslog(pamh, LOG_CRIT, "setfsuid: failed to switch back");
+        r = -1;
+    }
+#else
+    if (geteuid() != privs->saved_euid && seteuid(privs->saved_euid) < 0) {
         pam_syslog(pamh, LOG_CRIT, "seteuid: %s", strerror(errno));
-        return -1;
+        r = -1;
+        goto out;
     }
 
-    if (setegid(privs->saved_egid) < 0) {
+    if (getegid() != privs->saved_egid && setegid(privs->saved_egid) < 0) {
         pam_syslog(pamh, LOG_CRIT, "setegid: %s", strerror(errno));
-        return -1;
+        r = -1;
+        goto out;
     }
 
     if (setgroups(privs->saved_groups_length, privs->saved_groups) < 0) {
         pam_syslog(pamh, LOG_CRIT, "setgroups: %s", strerror(errno));
-        return -1;
+        r = -1;
     }
+#endif
 
-    return 0;
-}
+out:
+    free(privs->saved_groups);
+    privs->saved_groups = NULL;
+    privs->saved_groups_length = 0;
+    privs->dropped = 0;
 
-#endif // HAVE_PAM_MODUTIL_DROP_PRIV
+    return r;
+}
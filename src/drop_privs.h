@@ -34,12 +34,8 @@
 #include "config.h"
 #endif
 
-#ifdef HAVE_PAM_MODUTIL_DROP_PRIV
-#include <security/pam_modutil.h>
-#else
-
 #include <pwd.h>
-#include <stdio.h>
+#include <sys/types.h>
 
 #ifdef HAVE_SECURITY_PAM_APPL_H
 #include <security/pam_appl.h>
@@ -48,21 +44,23 @@
 #include <security/pam_modules.h>
 #endif
 
-#define SAVED_GROUPS_MAX_LEN 64 /* as pam_modutil.. */
-
-struct _ykpam_privs {
+/* Like pam_modutil_drop_priv(), but without initgroups(), which enumerates
+ * all groups of the directory through NSS. With setfsuid(), only the file
+ * system IDs of the calling thread are switched to the user and the user's
+ * primary group. Otherwise the effective IDs of the process are switched and
+ * the supplementary groups are reduced to the primary group; the saved groups
+ * are allocated and freed again by auth_regain_priv(). */
+struct auth_privs {
   uid_t saved_euid;
   gid_t saved_egid;
   gid_t *saved_groups;
   int saved_groups_length;
+  int dropped;
 };
 
-#define PAM_MODUTIL_DEF_PRIVS(n) \
-  gid_t n##_saved_groups[SAVED_GROUPS_MAX_LEN]; \
-  struct _ykpam_privs n = {-1, -1, n##_saved_groups, SAVED_GROUPS_MAX_LEN}
+#define AUTH_PRIVS_INIT {(uid_t) -1, (gid_t) -1, NULL, 0, 0}
 
-int pam_modutil_drop_priv(pam_handle_t *, struct _ykpam_privs *, struct passwd *);
-int pam_modutil_regain_priv(pam_handle_t *, struct _ykpam_privs *);
+int auth_drop_priv(pam_handle_t *, struct auth_privs *, const struct passwd *);
+int auth_regain_priv(pam_handle_t *, struct auth_privs *);
 
 #endif
-#endif
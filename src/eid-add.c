@@ -1,5 +1,8 @@
 #include "config.h"
 #include "eid.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -14,151 +17,434 @@
 #define _(string) string
 #endif
 
-#ifndef HAVE_STRNSTR
-char *strnstr(const char *haystack, const char *needle, size_t count)
-{
-    char *found = strstr(haystack, needle);
-    if (found && found - haystack <= count) {
-        /* for ease of implementation we accept an out of bounds read while
-         * searching, but we do not propagate this problem */
-        return found;
-    }
-    return NULL;
-}
-#endif
-
-struct file_status {
-	FILE *file;
+struct eid_status {
 	int ok;
+	EVP_MD_CTX *digest;
+	struct eid_match result;
+	struct eid_fields fields;
+	int printing;
+	char name[64];
+	size_t name_length;
 };
 
 static void
-eid_print(char *contents, size_t count)
+eid_print(void *ctx, enum eid_field field, const char *data, size_t length,
+        int final)
 {
-    struct {
-        const char *title;
-        const char *pre;
-        const char *post;
-    } eid[] = {
-        {_("Given Name(s):   "), "<GivenNames>","</GivenNames>"},
-        {_("Family Name(s):  "), "<FamilyNames>>", "</FamilyNames>"},
-        {_("Date Of Birth:   "), "<DateOfBirth>", "</DateOfBirth>"},
-    };
-    size_t i;
+    struct eid_status *status = (struct eid_status *)ctx;
 
-    for (i = 0; i < sizeof eid/sizeof *eid; i++) {
-        char *data = strnstr(contents, eid[i].pre, count);
-        if (data) {
-            char *end = strnstr(data, eid[i].post,
-                    count - (data - contents));
-            if (end) {
-                data += strlen(eid[i].pre);
-                printf("%s%.*s\n", eid[i].title, (int) (end - data), data);
+    /* the value may arrive in pieces */
+    if (!status->printing) {
+        switch (field) {
+            case EID_FIELD_GIVEN_NAMES:
+                fputs(_("Given Name(s):   "), stdout);
                 break;
-            }
+            case EID_FIELD_FAMILY_NAMES:
+                fputs(_("Family Name(s):  "), stdout);
+                break;
+            case EID_FIELD_DATE_OF_BIRTH:
+                fputs(_("Date Of Birth:   "), stdout);
+                break;
+            case EID_FIELD_DATE_OF_EXPIRY:
+                fputs(_("Valid Until:     "), stdout);
+                break;
+            default:
+                return;
         }
+        status->printing = 1;
+    }
+    fwrite(data, 1, length, stdout);
+    if (final) {
+        putchar('\n');
+        status->printing = 0;
     }
 }
 
 static size_t
 auth_write(void *contents, size_t size, size_t nmemb, void *userp)
 {
-    struct file_status *status = (struct file_status *)userp;
-    size_t consumed = fwrite(contents, size, nmemb, status->file);
+    struct eid_status *status = (struct eid_status *)userp;
+    size_t consumed = size*nmemb;
+
+    if (1 != EVP_DigestUpdate(status->digest, contents, consumed))
+        return 0;
 
-    if (strstr((char *) contents, action_eid_ok)) {
-        eid_print(contents, consumed);
+    if (!status->result.found
+            && eid_match_update(&status->result, contents, consumed)) {
         status->ok = 1;
     }
+    eid_fields_update(&status->fields, contents, consumed);
 
     return consumed;
 }
 
+static void
+name_collect(void *ctx, enum eid_field field, const char *data, size_t length,
+        int final)
+{
+    struct eid_status *status = (struct eid_status *)ctx;
+
+    if (length > sizeof status->name - status->name_length)
+        length = sizeof status->name - status->name_length;
+    memcpy(status->name + status->name_length, data, length);
+    status->name_length += length;
+
+    if (final) {
+        printf(_("Connected to %.*s\n"), (int) status->name_length,
+                status->name);
+        status->ok = 1;
+    }
+}
+
 static size_t
 name_print(void *contents, size_t size, size_t nmemb, void *userp)
 {
-    struct {
-        const char *pre;
-        const char *post;
-    } client[] = {
-        /* Status response of AusweisApp2 */
-        {"Name: ", "\n"},
-        /* Status response of Open eCard App */
-        {"<ns12:Name>", "</ns12:Name>"},
-    };
-    struct file_status *status = (struct file_status *)userp;
-    char *start = contents;
-    size_t consumed = size*nmemb, i;
-
-    for (i = 0; i < sizeof client/sizeof *client; i++) {
-        char *name = strnstr(start, client[i].pre, consumed);
-        if (name) {
-            char *end = strnstr(name, client[i].post,
-                    consumed - (name - start));
-            if (end) {
-                name += strlen(client[i].pre);
-                printf(_("Connected to %.*s\n"), (int) (end - name), name);
-                status->ok = 1;
-                break;
-            }
-        }
-    }
+    struct eid_status *status = (struct eid_status *)userp;
+    size_t consumed = size*nmemb;
 
+    /* the status of AusweisApp2 has a "Name: " line, the one of Open eCard
+     * App a <ns12:Name> element */
+    eid_fields_update(&status->fields, contents, consumed);
 
     return consumed;
 }
 
+static int
+auth_save(const struct passwd *pw, const struct auth_reference *reference)
+{
+    int ok = 0;
+    FILE *file = auth_fopen(pw, "wb");
+
+    if (!file) {
+        if (0 != auth_mkdir(pw))
+            return 0;
+        file = auth_fopen(pw, "wb");
+        if (!file)
+            return 0;
+    }
+
+    if (1 == auth_write_reference(file, reference))
+        ok = 1;
+
+    if (0 != fclose(file))
+        ok = 0;
+
+    return ok;
+}
+
+/* reads ~/.eid/authorized_eid, converting the legacy format */
+static int
+auth_load(const struct passwd *pw, struct auth_reference *reference)
+{
+    if (1 != auth_read_reference(pw, reference))
+        return 0;
+
+    if (1 != auth_reference_upgrade(reference)) {
+        auth_reference_free(reference);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* updates the system-wide store, if the administrator has set one up */
+static int
+store_enroll(const struct auth_reference *reference,
+        const struct client_pubkey *pubkey)
+{
+    FILE *helper;
+    size_t i;
+    int ok = 1;
+
+    if (0 != access(EID_STORE_HELPER, X_OK))
+        return 1;
+
+    fflush(stdout);
+    helper = popen(EID_STORE_HELPER " enroll", "w");
+    if (!helper)
+        return 0;
+    for (i = 0; ok && i < reference->count; i++)
+        ok = auth_write_entry(helper, reference->md[i], NULL);
+    ok = ok && 0 <= fputc('\n', helper)
+        && (!pubkey->pinned || auth_write_entry(helper, pubkey->md, NULL));
+    if (0 != pclose(helper))
+        ok = 0;
+
+    return ok;
+}
+
+static int
+auth_enroll(const struct passwd *pw)
+{
+    struct auth_reference reference;
+    struct client_pubkey pubkey;
+
+    if (1 != auth_load(pw, &reference)) {
+        puts(_("Failed to read ~/.eid/authorized_eid"));
+        return 1;
+    }
+    if (1 != client_pubkey_load(pw, &pubkey)) {
+        puts(_("Failed to read ~/.eid"));
+        return 1;
+    }
+
+    if (1 != store_enroll(&reference, &pubkey)) {
+        puts(_("Failed to update the system-wide store"));
+        return 1;
+    }
+
+    return 0;
+}
+
+static int
+auth_upgrade(const struct passwd *pw)
+{
+    struct auth_reference reference;
+
+    if (1 != auth_read_reference(pw, &reference)) {
+        puts(_("Failed to read ~/.eid/authorized_eid"));
+        return 1;
+    }
+
+    if (reference.digest) {
+        puts(_("~/.eid/authorized_eid is already up to date"));
+        return 0;
+    }
+
+    /* replaces the raw response by its digest before saving */
+    if (1 != auth_reference_upgrade(&reference)
+            || 1 != auth_save(pw, &reference)) {
+        auth_reference_free(&reference);
+        puts(_("Failed to convert ~/.eid/authorized_eid"));
+        return 1;
+    }
+
+    puts(_("Converted ~/.eid/authorized_eid"));
+    return 0;
+}
+
+static int
+auth_list(const struct passwd *pw)
+{
+    struct auth_reference reference;
+    size_t i;
+
+    if (1 != auth_load(pw, &reference)) {
+        puts(_("Failed to read ~/.eid/authorized_eid"));
+        return 1;
+    }
+
+    for (i = 0; i < reference.count; i++)
+        printf("%lu %s\n", (unsigned long) i + 1,
+                reference.label[i][0] ? reference.label[i] : _("(no label)"));
+
+    return 0;
+}
+
+static int
+auth_remove(const struct passwd *pw, const char *which)
+{
+    struct auth_reference reference;
+    struct client_pubkey pubkey;
+    char *end;
+    unsigned long n;
+    size_t i;
+
+    if (1 != auth_load(pw, &reference)) {
+        puts(_("Failed to read ~/.eid/authorized_eid"));
+        return 1;
+    }
+
+    for (i = 0; i < reference.count; i++) {
+        if (0 == strcmp(reference.label[i], which))
+            break;
+    }
+    if (i == reference.count) {
+        n = strtoul(which, &end, 10);
+        if (*which && !*end && n >= 1 && n <= reference.count)
+            i = n - 1;
+    }
+    if (i == reference.count) {
+        printf(_("No identity %s in ~/.eid/authorized_eid\n"), which);
+        return 1;
+    }
+    if (reference.count == 1) {
+        puts(_("Refusing to remove the last identity"));
+        return 1;
+    }
+
+    memmove(reference.md[i], reference.md[i + 1],
+            (reference.count - i - 1) * sizeof *reference.md);
+    memmove(reference.label[i], reference.label[i + 1],
+            (reference.count - i - 1) * sizeof *reference.label);
+    reference.count--;
+
+    if (1 != auth_save(pw, &reference)) {
+        puts(_("Failed to write ~/.eid/authorized_eid"));
+        return 1;
+    }
+    if (1 != client_pubkey_load(pw, &pubkey)
+            || 1 != store_enroll(&reference, &pubkey)) {
+        puts(_("Failed to update the system-wide store"));
+        return 1;
+    }
+
+    puts(_("Removed the identity from ~/.eid/authorized_eid"));
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     char user[32];
-    struct file_status status = {stdout, -1};
+    struct passwd *pw;
+    struct client_pubkey pubkey;
+    struct eid_status status = {-1};
+    struct auth_reference reference;
+    unsigned char md[AUTH_DIGEST_LENGTH];
+    const char *label = NULL, *name = argv[0];
+    const char *tctoken_url = eid_tctoken_url_default;
+    struct eid_origin service;
+    struct client_endpoint client = client_endpoint_default;
+    int append = 0;
     CURL *curl = NULL;
 
+    if (0 != getlogin_r(user, sizeof user))
+        return 1;
+    pw = getpwnam(user);
+    if (!pw)
+        return 1;
+
+    while (argc > 2) {
+        if (0 == strcmp(argv[1], "--tctoken-url")) {
+            /* an on-premises eService instead of autentapp.de */
+            tctoken_url = argv[2];
+        } else if (0 == strcmp(argv[1], "--client")) {
+            /* the same as client= of the module */
+            if (!client_endpoint_set(&client, argv[2])) {
+                puts(_("Invalid eID Client, expected http://... or unix:/..."));
+                return 1;
+            }
+        } else {
+            break;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (strlen(tctoken_url) >= EID_URL_MAX
+            || !eid_origin_parse(&service, tctoken_url)) {
+        puts(_("Invalid TC token URL, expected https://..."));
+        return 1;
+    }
+
+    if (argc > 1) {
+        if (argc == 2 && 0 == strcmp(argv[1], "--upgrade"))
+            return auth_upgrade(pw);
+        if (argc == 2 && 0 == strcmp(argv[1], "--enroll"))
+            return auth_enroll(pw);
+        if (argc == 2 && 0 == strcmp(argv[1], "--list"))
+            return auth_list(pw);
+        if (argc == 3 && 0 == strcmp(argv[1], "--remove"))
+            return auth_remove(pw, argv[2]);
+        if (argc <= 3 && 0 == strcmp(argv[1], "--append")) {
+            append = 1;
+            label = argc == 3 ? argv[2] : NULL;
+        } else {
+            printf(_("Usage: %s [--tctoken-url URL] [--client URL] [--append [LABEL]"
+                        "|--remove LABEL|--list|--upgrade|--enroll]\n"), name);
+            return 1;
+        }
+    }
+
+    memset(&reference, 0, sizeof reference);
+    if (append) {
+        if (label && (strlen(label) >= AUTH_LABEL_MAX || strchr(label, '\n'))) {
+            puts(_("Invalid label"));
+            return 1;
+        }
+        /* a missing file is fine, the card is the first identity then */
+        if (1 != auth_load(pw, &reference) && errno != ENOENT) {
+            puts(_("Failed to read ~/.eid/authorized_eid"));
+            return 1;
+        }
+        if (reference.count >= AUTH_REFERENCE_MAX) {
+            printf(_("~/.eid/authorized_eid is limited to %d identities\n"),
+                    AUTH_REFERENCE_MAX);
+            return 1;
+        }
+    }
+
     curl = curl_easy_init();
     if (NULL == curl)
         goto err;
 
+    eid_fields_init(&status.fields, EID_FIELD(EID_FIELD_CLIENT_NAME),
+            name_collect, &status);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, name_print);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&status);
-    if (!client_action(curl, action_status)) {
+    client_endpoint_prepare(curl, &client, action_status);
+    if (CURLE_OK != curl_easy_perform(curl)) {
         puts(_("Failed to connect to eID Client"));
         goto err;
     }
+    eid_fields_finish(&status.fields);
     if (status.ok != 1) {
         puts(_("Connected to unknown eID Client"));
     }
     status.ok = -1;
 
-    if (0 != getlogin_r(user, sizeof user))
+    status.digest = auth_digest_new();
+    if (!status.digest)
         goto err;
 
-    status.file = auth_fopen(user, "wb");
-    if (!status.file) {
-        if (0 != auth_mkdir(user))
-            goto err;
-        status.file = auth_fopen(user, "wb");
-        if (!status.file)
-            goto err;
-    }
-
+    eid_match_init(&status.result, action_eid_ok);
+    eid_fields_init(&status.fields, EID_FIELD(EID_FIELD_GIVEN_NAMES)
+            | EID_FIELD(EID_FIELD_FAMILY_NAMES)
+            | EID_FIELD(EID_FIELD_DATE_OF_BIRTH)
+            | EID_FIELD(EID_FIELD_DATE_OF_EXPIRY), eid_print, &status);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, auth_write);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&status);
-    client_pubkeypinning(curl, user);
-    client_action(curl, action_eid);
+    if (1 != client_pubkey_load(pw, &pubkey)) {
+        puts(_("Failed to read ~/.eid/authorized_pubkey"));
+        goto err;
+    }
+    client_pubkeypinning(curl, &pubkey);
+    client_eid_prepare(curl, &client, tctoken_url);
+    curl_easy_perform(curl);
+
+    if (status.ok == 1 && 1 != auth_digest_final(status.digest, md))
+        status.ok = 0;
+
+    if (status.ok == 1 && 1 == auth_reference_match(&reference, md)) {
+        puts(_("This identity is already enrolled"));
+        status.ok = 0;
+    }
+
+    /* without --append the card replaces all enrolled identities */
+    if (status.ok == 1
+            && (1 != auth_reference_add(&reference, md, label)
+                || 1 != auth_save(pw, &reference)))
+        status.ok = 0;
+
+    if (status.ok == 1 && 1 != store_enroll(&reference, &pubkey)) {
+        puts(_("Failed to update the system-wide store"));
+        status.ok = 0;
+    }
 
 err:
-    if (status.file)
-        fclose(status.file);
+    if (status.digest)
+        EVP_MD_CTX_free(status.digest);
     if (curl)
         curl_easy_cleanup(curl);
 
     if (status.ok == 1) {
         puts(_("Configured ~/.eid/authorized_eid"));
         puts(_("To enable certificate pinning, run\n"));
-        puts(  "  echo \\\n"
-                "    | openssl s_client -connect www.autentapp.de:443 2>/dev/null \\\n"
+        printf("  echo \\\n"
+                "    | openssl s_client -connect %s:%ld 2>/dev/null \\\n"
                 "    | openssl x509 -noout -pubkey \\\n"
-                "    | openssl asn1parse -noout -inform PEM -out ~/.eid/authorized_pubkey");
+                "    | openssl asn1parse -noout -inform PEM -out ~/.eid/authorized_pubkey\n\n",
+                service.host, service.port);
+        puts(_("and, if the system-wide store is used, `eid-add --enroll`"));
         return 0;
     } else {
         /* eID Client will print some error */
@@ -0,0 +1,844 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "eid.h"
+#include "store.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_FSUID_H
+#include <sys/fsuid.h>
+#endif
+
+#define JOBS_DEFAULT 32
+#define JOBS_MAX 256
+#define PUBKEY_MAX 4096
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-j jobs] [-f store] check [user ...]\n"
+            "       %s [-j jobs] export [user ...] > references\n"
+            "       %s [-j jobs] [-f store] [-a] [-p pubkey] import "
+            "[references]\n"
+            "Checks, exports and imports the references of many users at once "
+            "with up to\n`jobs` (default %d) home directories accessed in "
+            "parallel.\n`check` reports stale, malformed or insecure files in "
+            "~/.eid and entries of the\nsystem-wide store (default " STORE_PATH
+            "), which don't match.\nThe exported lines consist of the user "
+            "name and a digest with its label, legacy\nreferences are "
+            "converted. `import` replaces (or with -a extends) the\n"
+            "references, optionally installs the pinned key of the eService "
+            "and updates the\nstore, if it exists.\n",
+            name, name, name, JOBS_DEFAULT);
+}
+
+enum {
+    PROBLEM_MISSING = 1,
+    PROBLEM_PERMISSIONS = 2,
+    PROBLEM_UNREADABLE = 4,
+    PROBLEM_MALFORMED = 8,
+    PROBLEM_LEGACY = 16,
+    PROBLEM_PUBKEY = 32,
+    PROBLEM_STORE_MISSING = 64,
+    PROBLEM_STORE_OUTDATED = 128,
+    PROBLEM_WRITE = 256,
+};
+
+/* a user and what was found in (or written to) the home directory */
+struct job {
+    char *name;
+    char *dir;
+    uid_t uid;
+    gid_t gid;
+    int explicit;
+    unsigned int problems;
+    int err;
+    int enrolled;
+    struct auth_reference reference;
+    struct client_pubkey pubkey;
+};
+
+struct pool {
+    struct job *jobs;
+    size_t count;
+    size_t next;
+    void (*work)(struct pool *pool, struct job *job);
+    /* for import */
+    int append;
+    const unsigned char *pubkey;
+    size_t pubkey_length;
+};
+
+static void job_passwd(const struct job *job, struct passwd *pw)
+{
+    memset(pw, 0, sizeof *pw);
+    pw->pw_name = job->name;
+    pw->pw_dir = job->dir;
+    pw->pw_uid = job->uid;
+    pw->pw_gid = job->gid;
+}
+
+static int job_add(struct job **jobs, size_t *count, const struct passwd *pw,
+        int explicit)
+{
+    struct job *j;
+
+    if (*count % 1024 == 0) {
+        j = realloc(*jobs, (*count + 1024) * sizeof *j);
+        if (!j)
+            return 0;
+        *jobs = j;
+    }
+    j = &(*jobs)[*count];
+    memset(j, 0, sizeof *j);
+    j->name = strdup(pw->pw_name);
+    j->dir = strdup(pw->pw_dir ? pw->pw_dir : "");
+    if (!j->name || !j->dir) {
+        free(j->name);
+        free(j->dir);
+        return 0;
+    }
+    j->uid = pw->pw_uid;
+    j->gid = pw->pw_gid;
+    j->explicit = explicit;
+    (*count)++;
+
+    return 1;
+}
+
+static void jobs_free(struct job *jobs, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        free(jobs[i].name);
+        free(jobs[i].dir);
+    }
+    free(jobs);
+}
+
+/* collects the given users or all users of the passwd database */
+static int jobs_collect(int argc, char **argv, struct job **jobs,
+        size_t *count)
+{
+    struct passwd *pw;
+    int i;
+
+    *jobs = NULL;
+    *count = 0;
+
+    if (argc == 0) {
+        setpwent();
+        while ((pw = getpwent())) {
+            if (!job_add(jobs, count, pw, 0)) {
+                endpwent();
+                return 0;
+            }
+        }
+        endpwent();
+        return 1;
+    }
+
+    for (i = 0; i < argc; i++) {
+        pw = getpwnam(argv[i]);
+        if (!pw) {
+            fprintf(stderr, "Unknown user %s\n", argv[i]);
+            continue;
+        }
+        if (!job_add(jobs, count, pw, 1))
+            return 0;
+    }
+
+    return 1;
+}
+
+#ifdef HAVE_SYS_FSUID_H
+/* The file system IDs belong to the calling thread only, so the workers can
+ * act on behalf of different users at the same time. */
+static int become(uid_t uid, gid_t gid)
+{
+    setfsgid(gid);
+    setfsuid(uid);
+
+    return (uid_t) setfsuid(-1) == uid && (gid_t) setfsgid(-1) == gid;
+}
+#define BECOME_PER_THREAD 1
+#else
+static int become(uid_t uid, gid_t gid)
+{
+    if (0 != seteuid(0) || 0 != setegid(gid) || 0 != seteuid(uid))
+        return 0;
+
+    return 1;
+}
+#define BECOME_PER_THREAD 0
+#endif
+
+static void become_root(void)
+{
+    if (!become(0, 0)) {
+        perror("setfsuid");
+        exit(1);
+    }
+}
+
+/* reads the reference, with the user's privileges if root has no access to
+ * the home directory, e.g. on NFS with root squashing */
+static int job_map(struct job *job, const struct passwd *pw)
+{
+    int ok = auth_read_reference(pw, &job->reference);
+
+    if (!ok && errno == EACCES && 0 == geteuid() && become(job->uid, job->gid)) {
+        ok = auth_read_reference(pw, &job->reference);
+        job->err = errno;
+        become_root();
+        errno = job->err;
+    }
+
+    return ok;
+}
+
+static unsigned int problem_of(int err)
+{
+    switch (err) {
+        case ENOENT:
+            return PROBLEM_MISSING;
+        case EINVAL:
+        case ELOOP:
+        case ENOTDIR:
+            return PROBLEM_PERMISSIONS;
+        default:
+            return PROBLEM_UNREADABLE;
+    }
+}
+
+/* reads and validates ~/.eid, converting a legacy reference into its digest */
+static void job_read(struct pool *pool, struct job *job)
+{
+    static const char header[] = "eid-pam:";
+    struct auth_reference *reference = &job->reference;
+    struct eid_match match;
+    struct passwd pw;
+
+    job_passwd(job, &pw);
+    if (!job_map(job, &pw)) {
+        job->err = errno;
+        job->problems |= problem_of(errno);
+        return;
+    }
+    job->enrolled = 1;
+
+    if (!reference->digest) {
+        /* a broken digest line or the raw response of the eService */
+        eid_match_init(&match, action_eid_ok);
+        if (reference->length == 0
+                || (reference->length >= sizeof header - 1
+                    && 0 == memcmp(reference->data, header, sizeof header - 1))
+                || !eid_match_update(&match, reference->data,
+                    reference->length)) {
+            job->problems |= PROBLEM_MALFORMED;
+            auth_reference_free(reference);
+            memset(reference, 0, sizeof *reference);
+        } else {
+            job->problems |= PROBLEM_LEGACY;
+            if (!auth_reference_upgrade(reference)) {
+                job->problems |= PROBLEM_MALFORMED;
+                auth_reference_free(reference);
+            }
+        }
+    }
+
+    if (1 != client_pubkey_load(&pw, &job->pubkey)) {
+        job->err = errno;
+        job->problems |= PROBLEM_PUBKEY;
+    }
+}
+
+static int write_pubkey(const struct passwd *pw, const unsigned char *pubkey,
+        size_t length)
+{
+    char filename[PATH_MAX];
+    ssize_t n;
+    int fd, err;
+
+    snprintf(filename, sizeof filename, "%s/.eid/authorized_pubkey",
+            pw->pw_dir);
+    fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC, 0644);
+    if (fd < 0)
+        return 0;
+    while (length > 0) {
+        n = write(fd, pubkey, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        pubkey += n;
+        length -= n;
+    }
+    err = errno;
+    if (0 != close(fd) || length > 0) {
+        if (length > 0)
+            errno = err;
+        return 0;
+    }
+
+    return 1;
+}
+
+/* writes the reference collected from the import as the user */
+static void job_write(struct pool *pool, struct job *job)
+{
+    struct auth_reference imported = job->reference, existing;
+    struct passwd pw;
+    FILE *file;
+    size_t i;
+    int ok = 0;
+
+    job_passwd(job, &pw);
+    if (!become(job->uid, job->gid)) {
+        job->err = errno;
+        job->problems |= PROBLEM_WRITE;
+        return;
+    }
+
+    if (pool->append && 1 == auth_read_reference(&pw, &existing)) {
+        if (1 != auth_reference_upgrade(&existing)) {
+            auth_reference_free(&existing);
+            errno = EINVAL;
+            goto err;
+        }
+        for (i = 0; i < imported.count; i++) {
+            if (!auth_reference_match(&existing, imported.md[i])
+                    && !auth_reference_add(&existing, imported.md[i],
+                        imported.label[i])) {
+                errno = EFBIG;
+                goto err;
+            }
+        }
+        job->reference = existing;
+    } else if (pool->append && errno != ENOENT) {
+        goto err;
+    }
+
+    if (0 != auth_mkdir(&pw) && errno != EEXIST)
+        goto err;
+    file = auth_fopen(&pw, "wb");
+    if (!file)
+        goto err;
+    ok = auth_write_reference(file, &job->reference);
+    if (0 != fclose(file))
+        ok = 0;
+    if (ok && pool->pubkey)
+        ok = write_pubkey(&pw, pool->pubkey, pool->pubkey_length);
+    if (ok && 1 != client_pubkey_load(&pw, &job->pubkey)) {
+        errno = EINVAL;
+        ok = 0;
+    }
+
+err:
+    if (!ok) {
+        job->err = errno;
+        job->problems |= PROBLEM_WRITE;
+    } else {
+        job->enrolled = 1;
+    }
+    become_root();
+}
+
+static void *worker(void *arg)
+{
+    struct pool *pool = arg;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED))
+            < pool->count)
+        pool->work(pool, &pool->jobs[i]);
+
+    return NULL;
+}
+
+/* runs the work on all jobs with a bounded number of threads */
+static int pool_run(struct pool *pool, unsigned long jobs)
+{
+    pthread_t threads[JOBS_MAX];
+    unsigned long i, n = 0;
+
+    pool->next = 0;
+    /* without per-thread IDs, switching to a user affects all threads */
+    if (!BECOME_PER_THREAD && 0 == geteuid())
+        jobs = 1;
+    if (jobs > pool->count)
+        jobs = pool->count;
+
+    for (i = 1; i < jobs; i++) {
+        if (0 != pthread_create(&threads[n], NULL, worker, pool))
+            break;
+        n++;
+    }
+    worker(pool);
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+
+    return 1;
+}
+
+static int compare_job(const void *a, const void *b)
+{
+    return strcmp(((const struct job *) a)->name,
+            ((const struct job *) b)->name);
+}
+
+static int compare_entry(const void *a, const void *b)
+{
+    return strcmp(((const struct store_entry *) a)->user,
+            ((const struct store_entry *) b)->user);
+}
+
+static int entry_matches(const struct store_entry *entry,
+        const struct job *job)
+{
+    size_t i;
+
+    if (entry->count != job->reference.count
+            || entry->pinned != job->pubkey.pinned
+            || (entry->pinned && 0 != memcmp(entry->pubkey, job->pubkey.md,
+                    sizeof entry->pubkey)))
+        return 0;
+    for (i = 0; i < entry->count; i++) {
+        if (0 != memcmp(entry->md[i], job->reference.md[i],
+                    AUTH_DIGEST_LENGTH))
+            return 0;
+    }
+
+    return 1;
+}
+
+static void report(const struct job *job, const char *store)
+{
+    if (job->problems & PROBLEM_MISSING && job->explicit)
+        printf("%s: no ~/.eid/authorized_eid\n", job->name);
+    if (job->problems & PROBLEM_PERMISSIONS)
+        printf("%s: ~/.eid/authorized_eid is a symbolic link or writable by "
+                "others\n", job->name);
+    if (job->problems & PROBLEM_UNREADABLE)
+        printf("%s: ~/.eid/authorized_eid: %s\n", job->name,
+                strerror(job->err));
+    if (job->problems & PROBLEM_MALFORMED)
+        printf("%s: ~/.eid/authorized_eid is malformed\n", job->name);
+    if (job->problems & PROBLEM_LEGACY)
+        printf("%s: ~/.eid/authorized_eid has the legacy format, run "
+                "`eid-add --upgrade`\n", job->name);
+    if (job->problems & PROBLEM_PUBKEY)
+        printf("%s: ~/.eid/authorized_pubkey is malformed, a symbolic link "
+                "or writable by others\n", job->name);
+    if (job->problems & PROBLEM_STORE_MISSING)
+        printf("%s: not in %s\n", job->name, store);
+    if (job->problems & PROBLEM_STORE_OUTDATED)
+        printf("%s: outdated in %s\n", job->name, store);
+}
+
+static double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec)
+        + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int check(const char *path, unsigned long jobs, int argc, char **argv)
+{
+    struct pool pool = {NULL};
+    struct store_entry *entries = NULL, *entry, key;
+    struct timespec start;
+    size_t count = 0, i, enrolled = 0, problems = 0;
+    int have_store;
+    char *seen = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!jobs_collect(argc, argv, &pool.jobs, &pool.count)) {
+        perror("getpwent");
+        return 1;
+    }
+
+    have_store = store_read(path, &entries, &count);
+    if (!have_store && errno != ENOENT) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        have_store = 0;
+    }
+    qsort(entries, count, sizeof *entries, compare_entry);
+    seen = calloc(count ? count : 1, 1);
+    if (!seen)
+        goto err;
+
+    pool.work = job_read;
+    pool_run(&pool, jobs);
+
+    for (i = 0; i < pool.count; i++) {
+        struct job *job = &pool.jobs[i];
+
+        if (have_store) {
+            snprintf(key.user, sizeof key.user, "%s", job->name);
+            entry = bsearch(&key, entries, count, sizeof *entries,
+                    compare_entry);
+            if (entry && job->enrolled)
+                seen[entry - entries] = 1;
+            if (job->enrolled && job->reference.count > 0
+                    && !(job->problems & PROBLEM_PUBKEY)) {
+                if (!entry)
+                    job->problems |= PROBLEM_STORE_MISSING;
+                else if (!entry_matches(entry, job))
+                    job->problems |= PROBLEM_STORE_OUTDATED;
+            }
+        }
+
+        if (job->enrolled)
+            enrolled++;
+        if (job->problems & ~(job->explicit ? 0 : PROBLEM_MISSING)) {
+            problems++;
+            report(job, path);
+        }
+        auth_reference_free(&job->reference);
+    }
+
+    /* entries of users, who are gone or have removed their reference */
+    for (i = 0; argc == 0 && i < count; i++) {
+        if (!seen[i]) {
+            printf("%s: in %s without ~/.eid/authorized_eid\n",
+                    entries[i].user, path);
+            problems++;
+        }
+    }
+
+    fprintf(stderr, "Checked %lu users in %.3fs: %lu enrolled, %lu with "
+            "problems\n", (unsigned long) pool.count, seconds_since(&start),
+            (unsigned long) enrolled, (unsigned long) problems);
+
+err:
+    free(seen);
+    free(entries);
+    jobs_free(pool.jobs, pool.count);
+
+    return problems ? 1 : 0;
+}
+
+static int export(unsigned long jobs, int argc, char **argv)
+{
+    struct pool pool = {NULL};
+    struct job *job;
+    size_t i, k;
+    int r = 0;
+
+    if (!jobs_collect(argc, argv, &pool.jobs, &pool.count)) {
+        perror("getpwent");
+        return 1;
+    }
+
+    pool.work = job_read;
+    pool_run(&pool, jobs);
+
+    for (i = 0; i < pool.count; i++) {
+        job = &pool.jobs[i];
+        if (job->problems & ~(PROBLEM_LEGACY|PROBLEM_PUBKEY)) {
+            if (job->explicit || !(job->problems & PROBLEM_MISSING)) {
+                fprintf(stderr, "Skipping %s\n", job->name);
+                r = 1;
+            }
+            continue;
+        }
+        for (k = 0; k < job->reference.count; k++) {
+            printf("%s ", job->name);
+            auth_write_entry(stdout, job->reference.md[k],
+                    job->reference.label[k]);
+        }
+        auth_reference_free(&job->reference);
+    }
+
+    jobs_free(pool.jobs, pool.count);
+
+    return ferror(stdout) ? 1 : r;
+}
+
+struct record {
+    const char *user;
+    size_t line;
+    unsigned char md[AUTH_DIGEST_LENGTH];
+    char label[AUTH_LABEL_MAX];
+};
+
+static int compare_record(const void *a, const void *b)
+{
+    const struct record *x = a, *y = b;
+    int r = strcmp(x->user, y->user);
+
+    if (r)
+        return r;
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+/* reads "user digest [label]" lines */
+static int read_records(FILE *in, struct record **records, size_t *count,
+        char ***users, size_t *nusers)
+{
+    struct record *r;
+    char *line = NULL, *sep, **u;
+    size_t size = 0, n = 0, len;
+    ssize_t read;
+    int ok = 0;
+
+    *records = NULL;
+    *count = 0;
+    *users = NULL;
+    *nusers = 0;
+
+    while ((read = getline(&line, &size, in)) >= 0) {
+        n++;
+        len = strspn(line, " \t");
+        if (line[len] == '\n' || line[len] == '\0' || line[len] == '#')
+            continue;
+        sep = strchr(line, ' ');
+        if (!sep || sep == line) {
+            fprintf(stderr, "Line %lu: expected a user name and a digest\n",
+                    (unsigned long) n);
+            goto err;
+        }
+        *sep = '\0';
+
+        if (*count % 1024 == 0) {
+            r = realloc(*records, (*count + 1024) * sizeof *r);
+            u = realloc(*users, (*nusers + 1024) * sizeof *u);
+            if (u)
+                *users = u;
+            if (!r || !u) {
+                free(r);
+                goto err;
+            }
+            *records = r;
+        }
+        r = &(*records)[*count];
+        if (1 != auth_read_entry(sep + 1, r->md, r->label)) {
+            fprintf(stderr, "Line %lu: invalid digest\n", (unsigned long) n);
+            goto err;
+        }
+        (*users)[*nusers] = strdup(line);
+        if (!(*users)[*nusers])
+            goto err;
+        r->user = (*users)[(*nusers)++];
+        r->line = n;
+        (*count)++;
+    }
+    ok = !ferror(in);
+
+err:
+    free(line);
+
+    return ok;
+}
+
+/* replaces the entries of the imported users in the system-wide store */
+static int store_update(const char *path, const struct job *jobs, size_t count)
+{
+    struct store_entry *entries = NULL, *all, *e, key;
+    size_t n = 0, added = 0, i;
+    int lock, ok = 0;
+
+    lock = store_lock(path);
+    if (lock < 0 || !store_read(path, &entries, &n))
+        goto err;
+
+    all = realloc(entries, (n + count + 1) * sizeof *all);
+    if (!all)
+        goto err;
+    entries = all;
+    qsort(entries, n, sizeof *entries, compare_entry);
+
+    for (i = 0; i < count; i++) {
+        if (!jobs[i].enrolled || strlen(jobs[i].name) >= sizeof key.user)
+            continue;
+        snprintf(key.user, sizeof key.user, "%s", jobs[i].name);
+        e = bsearch(&key, entries, n, sizeof *entries, compare_entry);
+        if (!e)
+            e = &entries[n + added++];
+        memset(e, 0, sizeof *e);
+        strcpy(e->user, jobs[i].name);
+        e->count = jobs[i].reference.count;
+        memcpy(e->md, jobs[i].reference.md, sizeof e->md);
+        e->pinned = jobs[i].pubkey.pinned;
+        memcpy(e->pubkey, jobs[i].pubkey.md, sizeof e->pubkey);
+    }
+
+    ok = store_write(path, entries, n + added);
+
+err:
+    if (!ok)
+        perror(path);
+    store_unlock(lock);
+    free(entries);
+
+    return ok;
+}
+
+static int import(const char *path, unsigned long jobs, int append,
+        const char *pubkey_file, const char *input)
+{
+    struct pool pool = {NULL};
+    struct record *records = NULL;
+    struct passwd pw;
+    struct job *job, *known = NULL, key;
+    struct stat sb;
+    unsigned char pubkey[PUBKEY_MAX];
+    char **users = NULL;
+    size_t count = 0, nusers = 0, nknown = 0, i, failed = 0;
+    FILE *in = stdin, *file;
+    int ok = 0;
+
+    if (0 != geteuid()) {
+        fprintf(stderr, "Only root can import references\n");
+        return 1;
+    }
+
+    if (pubkey_file) {
+        file = fopen(pubkey_file, "rb");
+        if (!file) {
+            perror(pubkey_file);
+            return 1;
+        }
+        pool.pubkey_length = fread(pubkey, 1, sizeof pubkey, file);
+        fclose(file);
+        /* DER encoded SubjectPublicKeyInfo, optionally wrapped in PEM */
+        if (pool.pubkey_length == 0 || pool.pubkey_length == sizeof pubkey
+                || (pubkey[0] != 0x30
+                    && (pool.pubkey_length < 10
+                        || 0 != memcmp(pubkey, "-----BEGIN", 10)))) {
+            fprintf(stderr, "%s: not a public key\n", pubkey_file);
+            return 1;
+        }
+        pool.pubkey = pubkey;
+    }
+
+    if (input) {
+        in = fopen(input, "r");
+        if (!in) {
+            perror(input);
+            return 1;
+        }
+    }
+    if (!read_records(in, &records, &count, &users, &nusers))
+        goto err;
+    qsort(records, count, sizeof *records, compare_record);
+
+    /* a single pass over the passwd database instead of a lookup per user,
+     * which would be quadratic with files */
+    if (!jobs_collect(0, NULL, &known, &nknown)) {
+        perror("getpwent");
+        goto err;
+    }
+    qsort(known, nknown, sizeof *known, compare_job);
+
+    for (i = 0; i < count; i++) {
+        if (i == 0 || 0 != strcmp(records[i].user, records[i - 1].user)) {
+            key.name = (char *) records[i].user;
+            job = bsearch(&key, known, nknown, sizeof *known, compare_job);
+            if (!job) {
+                fprintf(stderr, "Unknown user %s\n", records[i].user);
+                goto err;
+            }
+            job_passwd(job, &pw);
+            if (!job_add(&pool.jobs, &pool.count, &pw, 1))
+                goto err;
+        }
+        job = &pool.jobs[pool.count - 1];
+        if (!auth_reference_add(&job->reference, records[i].md,
+                    records[i].label)) {
+            fprintf(stderr, "Too many references for %s\n", job->name);
+            goto err;
+        }
+    }
+
+    pool.append = append;
+    pool.work = job_write;
+    pool_run(&pool, jobs);
+
+    for (i = 0; i < pool.count; i++) {
+        if (pool.jobs[i].problems & PROBLEM_WRITE) {
+            fprintf(stderr, "%s: %s\n", pool.jobs[i].name,
+                    strerror(pool.jobs[i].err));
+            failed++;
+        }
+    }
+    printf("Imported the references of %lu users\n",
+            (unsigned long) (pool.count - failed));
+
+    ok = failed == 0;
+    if (0 == stat(path, &sb) && !store_update(path, pool.jobs, pool.count))
+        ok = 0;
+
+err:
+    if (in != stdin)
+        fclose(in);
+    for (i = 0; i < nusers; i++)
+        free(users[i]);
+    free(users);
+    free(records);
+    jobs_free(known, nknown);
+    jobs_free(pool.jobs, pool.count);
+
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = STORE_PATH, *pubkey = NULL;
+    unsigned long jobs = JOBS_DEFAULT;
+    int opt, append = 0;
+
+    umask(077);
+
+    while ((opt = getopt(argc, argv, "j:f:ap:h")) != -1) {
+        switch (opt) {
+            case 'j':
+                jobs = strtoul(optarg, NULL, 10);
+                if (jobs == 0 || jobs > JOBS_MAX) {
+                    fprintf(stderr, "jobs must be between 1 and %d\n",
+                            JOBS_MAX);
+                    return 1;
+                }
+                break;
+            case 'f':
+                path = optarg;
+                break;
+            case 'a':
+                append = 1;
+                break;
+            case 'p':
+                pubkey = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (0 == strcmp(argv[optind], "check"))
+        return check(path, jobs, argc - optind - 1, argv + optind + 1);
+    if (0 == strcmp(argv[optind], "export"))
+        return export(jobs, argc - optind - 1, argv + optind + 1);
+    if (0 == strcmp(argv[optind], "import") && optind + 2 >= argc)
+        return import(path, jobs, append, pubkey, argv[optind + 1]);
+
+    usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,210 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "auth_cache.h"
+#include "metrics.h"
+#include "reader_queue.h"
+#include <limits.h>
+#include <security/pam_appl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const struct {
+    int code;
+    const char *name;
+} result_names[] = {
+    {PAM_SUCCESS, "PAM_SUCCESS"},
+    {PAM_SERVICE_ERR, "PAM_SERVICE_ERR"},
+    {PAM_BUF_ERR, "PAM_BUF_ERR"},
+    {PAM_AUTH_ERR, "PAM_AUTH_ERR"},
+    {PAM_AUTHINFO_UNAVAIL, "PAM_AUTHINFO_UNAVAIL"},
+    {PAM_USER_UNKNOWN, "PAM_USER_UNKNOWN"},
+    {PAM_SESSION_ERR, "PAM_SESSION_ERR"},
+    {PAM_TRY_AGAIN, "PAM_TRY_AGAIN"},
+    {PAM_ABORT, "PAM_ABORT"},
+    {PAM_INCOMPLETE, "PAM_INCOMPLETE"},
+};
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-d cache_dir] [-o file.prom]\n"
+            "Writes the metrics, which the module records with the option "
+            "`metrics`, in the\ntext format of Prometheus, e.g. for the "
+            "textfile collector of node_exporter.\n", name);
+}
+
+static const char *result_name(unsigned int result, char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof result_names/sizeof *result_names; i++) {
+        if (result_names[i].code == (int) result)
+            return result_names[i].name;
+    }
+    snprintf(buf, len, "%u", result);
+
+    return buf;
+}
+
+static void print_metrics(FILE *out, const struct metrics *metrics)
+{
+    const struct metrics_histogram *h;
+    unsigned int e, i;
+    uint64_t cumulative;
+    char buf[16];
+
+    fprintf(out, "# HELP eid_pam_requests_total Finished requests by PAM "
+            "function and result.\n"
+            "# TYPE eid_pam_requests_total counter\n");
+    for (e = 0; e < METRICS_ENTRIES; e++) {
+        for (i = 0; i < METRICS_RESULTS; i++) {
+            if (metrics->results[e][i])
+                fprintf(out, "eid_pam_requests_total{function=\"%s\","
+                        "result=\"%s\"} %llu\n", metrics_entry_name(e),
+                        result_name(i, buf, sizeof buf),
+                        (unsigned long long) metrics->results[e][i]);
+        }
+    }
+
+    fprintf(out, "# HELP eid_pam_failures_total Failed requests by PAM "
+            "function and reason.\n"
+            "# TYPE eid_pam_failures_total counter\n");
+    for (e = 0; e < METRICS_ENTRIES; e++) {
+        for (i = METRICS_REASON_NONE + 1; i < METRICS_REASONS; i++) {
+            fprintf(out, "eid_pam_failures_total{function=\"%s\","
+                    "reason=\"%s\"} %llu\n", metrics_entry_name(e),
+                    metrics_reason_name(i),
+                    (unsigned long long) metrics->reasons[e][i]);
+        }
+    }
+
+    fprintf(out, "# HELP eid_pam_duration_seconds Duration of the requests "
+            "by PAM function.\n"
+            "# TYPE eid_pam_duration_seconds histogram\n");
+    for (e = 0; e < METRICS_ENTRIES; e++) {
+        h = &metrics->latency[e];
+        cumulative = 0;
+        for (i = 0; i < METRICS_BUCKETS; i++) {
+            cumulative += h->buckets[i];
+            if (metrics_bucket_bound(i))
+                fprintf(out, "eid_pam_duration_seconds_bucket{function=\"%s\","
+                        "le=\"%g\"} %llu\n", metrics_entry_name(e),
+                        metrics_bucket_bound(i) / 1e6,
+                        (unsigned long long) cumulative);
+            else
+                fprintf(out, "eid_pam_duration_seconds_bucket{function=\"%s\","
+                        "le=\"+Inf\"} %llu\n", metrics_entry_name(e),
+                        (unsigned long long) cumulative);
+        }
+        fprintf(out, "eid_pam_duration_seconds_sum{function=\"%s\"} %.6f\n"
+                "eid_pam_duration_seconds_count{function=\"%s\"} %llu\n",
+                metrics_entry_name(e), h->sum / 1e6,
+                metrics_entry_name(e), (unsigned long long) h->count);
+    }
+}
+
+static void print_cache(FILE *out, const struct auth_cache_stats *stats)
+{
+    fprintf(out, "# HELP eid_pam_cache_lookups_total Lookups in the result "
+            "cache by outcome.\n"
+            "# TYPE eid_pam_cache_lookups_total counter\n"
+            "eid_pam_cache_lookups_total{outcome=\"hit\"} %llu\n"
+            "eid_pam_cache_lookups_total{outcome=\"miss\"} %llu\n"
+            "# HELP eid_pam_cache_invalidations_total Discarded entries of "
+            "the result cache.\n"
+            "# TYPE eid_pam_cache_invalidations_total counter\n"
+            "eid_pam_cache_invalidations_total %llu\n",
+            (unsigned long long) stats->hits,
+            (unsigned long long) stats->misses,
+            (unsigned long long) stats->invalidations);
+}
+
+static void print_queue(FILE *out, const struct reader_queue_stats *stats)
+{
+    fprintf(out, "# HELP eid_pam_queue_depth Authentications waiting for "
+            "the card reader.\n"
+            "# TYPE eid_pam_queue_depth gauge\n"
+            "eid_pam_queue_depth %lu\n"
+            "# HELP eid_pam_queue_max_depth Maximum number of waiting "
+            "authentications.\n"
+            "# TYPE eid_pam_queue_max_depth gauge\n"
+            "eid_pam_queue_max_depth %lu\n"
+            "# HELP eid_pam_queue_served_total Authentications that got the "
+            "card reader.\n"
+            "# TYPE eid_pam_queue_served_total counter\n"
+            "eid_pam_queue_served_total %llu\n"
+            "# HELP eid_pam_queue_timeouts_total Authentications that gave "
+            "up waiting.\n"
+            "# TYPE eid_pam_queue_timeouts_total counter\n"
+            "eid_pam_queue_timeouts_total %llu\n"
+            "# HELP eid_pam_queue_wait_seconds_total Time spent waiting for "
+            "the card reader.\n"
+            "# TYPE eid_pam_queue_wait_seconds_total counter\n"
+            "eid_pam_queue_wait_seconds_total %.3f\n",
+            (unsigned long) stats->depth, (unsigned long) stats->max_depth,
+            (unsigned long long) stats->served,
+            (unsigned long long) stats->timeouts, stats->wait_ms / 1e3);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = AUTH_CACHE_DIR, *output = NULL;
+    char tmp[PATH_MAX];
+    struct metrics metrics;
+    struct auth_cache_stats cache;
+    struct reader_queue_stats queue;
+    FILE *out = stdout;
+    int opt, ok;
+
+    while ((opt = getopt(argc, argv, "d:o:h")) != -1) {
+        switch (opt) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (output) {
+        /* node_exporter must never see a partially written file */
+        if ((size_t) snprintf(tmp, sizeof tmp, "%s.%ld", output,
+                    (long) getpid()) >= sizeof tmp) {
+            fprintf(stderr, "Path too long: %s\n", output);
+            return 1;
+        }
+        out = fopen(tmp, "w");
+        if (!out) {
+            perror(tmp);
+            return 1;
+        }
+    }
+
+    metrics_get(dir, &metrics);
+    print_metrics(out, &metrics);
+    if (auth_cache_get_stats(dir, &cache))
+        print_cache(out, &cache);
+    if (reader_queue_get_stats(dir, &queue))
+        print_queue(out, &queue);
+
+    if (!output)
+        return ferror(out) ? 1 : 0;
+
+    ok = !ferror(out);
+    if (0 != fclose(out))
+        ok = 0;
+    if (!ok || 0 != rename(tmp, output)) {
+        perror(output);
+        unlink(tmp);
+        return 1;
+    }
+
+    return 0;
+}
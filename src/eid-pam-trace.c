@@ -0,0 +1,152 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "auth_cache.h"
+#include "trace.h"
+#include <security/pam_appl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-d cache_dir] [-n count]\n"
+            "Shows the phases of the most recent authentications, which the "
+            "module records\nwith the option `trace`.\n", name);
+}
+
+static void print_time(uint64_t us)
+{
+    time_t t = us / 1000000;
+    struct tm tm;
+    char buf[32];
+
+    localtime_r(&t, &tm);
+    strftime(buf, sizeof buf, "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%03u", buf, (unsigned int) (us % 1000000) / 1000);
+}
+
+static int compare_start(const void *a, const void *b)
+{
+    const struct trace_span *x = a, *y = b;
+
+    if (x->start != y->start)
+        return x->start < y->start ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* prints the spans of one authentication, total is NULL while it's running */
+static void print_auth(const struct trace_span *spans, size_t count,
+        uint64_t id, const struct trace_span *total)
+{
+    struct trace_span *own;
+    uint64_t origin;
+    size_t i, n = 0;
+
+    own = calloc(count, sizeof *own);
+    if (!own)
+        return;
+    for (i = 0; i < count; i++) {
+        if (spans[i].id == id && spans[i].phase != TRACE_TOTAL)
+            own[n++] = spans[i];
+    }
+    qsort(own, n, sizeof *own, compare_start);
+
+    origin = total ? total->start : (n ? own[0].start : 0);
+    print_time(origin);
+    if (total) {
+        printf("  %s  pid %ld  %s  %.3f ms\n", total->detail,
+                (long) total->pid, pam_strerror(NULL, total->result),
+                total->duration / 1000.);
+    } else {
+        printf("  pid %ld  running\n", n ? (long) own[0].pid : 0L);
+    }
+
+    for (i = 0; i < n; i++) {
+        const char *name = trace_phase_name(own[i].phase);
+        char label[32];
+
+        switch (own[i].phase) {
+            case TRACE_REQUEST:
+                snprintf(label, sizeof label, "%s %u", name, own[i].hop);
+                break;
+            case TRACE_DNS:
+            case TRACE_CONNECT:
+            case TRACE_TLS:
+            case TRACE_TRANSFER:
+                snprintf(label, sizeof label, "  %s", name);
+                break;
+            default:
+                snprintf(label, sizeof label, "%s", name);
+                break;
+        }
+        printf("  %+10.3f %-14s %10.3f ms%s%s\n",
+                own[i].start >= origin
+                ? (own[i].start - origin) / 1000.
+                : -((origin - own[i].start) / 1000.),
+                label, own[i].duration / 1000.,
+                *own[i].detail ? "  " : "", own[i].detail);
+    }
+    printf("\n");
+
+    free(own);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = AUTH_CACHE_DIR;
+    struct trace_span *spans = NULL;
+    uint64_t *ids = NULL;
+    size_t count, i, j, n = 0;
+    unsigned long max = 10;
+    int opt, r = 1;
+
+    while ((opt = getopt(argc, argv, "d:n:h")) != -1) {
+        switch (opt) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 'n':
+                max = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (!trace_snapshot(dir, &spans, &count)) {
+        fprintf(stderr, "No traces found in %s\n", dir);
+        goto err;
+    }
+
+    /* authentications in the order they were started */
+    ids = calloc(count + 1, sizeof *ids);
+    if (!ids)
+        goto err;
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < n && ids[j] != spans[i].id; j++)
+            ;
+        if (j == n)
+            ids[n++] = spans[i].id;
+    }
+
+    for (j = n > max ? n - max : 0; j < n; j++) {
+        const struct trace_span *total = NULL;
+        for (i = 0; i < count; i++) {
+            if (spans[i].id == ids[j] && spans[i].phase == TRACE_TOTAL)
+                total = &spans[i];
+        }
+        print_auth(spans, count, ids[j], total);
+    }
+    r = 0;
+
+err:
+    free(ids);
+    free(spans);
+
+    return r;
+}
@@ -0,0 +1,226 @@
+/* for SO_PEERCRED and accept4() */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "authenticate.h"
+#include "broker.h"
+#include "curl_pool.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+/* first file descriptor passed by socket activation */
+#define LISTEN_FDS_START 3
+
+static struct auth_options options;
+/* compared with the options of the module, see broker_options_add() */
+static char broker_options[BROKER_OPTIONS_MAX];
+
+static int listen_activated(void)
+{
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+
+    if (!pid || !fds || strtol(pid, NULL, 10) != (long) getpid()
+            || strtol(fds, NULL, 10) != 1)
+        return -1;
+
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    return LISTEN_FDS_START;
+}
+
+static int listen_path(const char *path)
+{
+    struct sockaddr_un addr;
+    mode_t mask;
+    int fd, r;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        goto err;
+
+    unlink(path);
+    mask = umask(077);
+    r = bind(fd, (struct sockaddr *) &addr, sizeof addr);
+    umask(mask);
+    if (0 != r || 0 != listen(fd, SOMAXCONN))
+        goto err;
+
+    return fd;
+
+err:
+    fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+/* forwards a message for the user to the PAM module */
+static void serve_info(void *ctx, const char *message)
+{
+    struct broker_response res;
+
+    memset(&res, 0, sizeof res);
+    res.version = BROKER_VERSION;
+    res.type = BROKER_INFO;
+    strncpy(res.message, message, sizeof res.message - 1);
+    broker_write(*(int *) ctx, &res, sizeof res);
+}
+
+static void *serve(void *arg)
+{
+    int fd = (int) (long) arg;
+    struct ucred cred = {0, -1, -1};
+    socklen_t len = sizeof cred;
+    struct broker_request req;
+    struct broker_response res;
+    struct auth_request request;
+    CURL *curl;
+
+    if (0 != getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)
+            || cred.uid != 0) {
+        syslog(LOG_WARNING, "Rejecting request from uid %ld",
+                (long) cred.uid);
+        goto err;
+    }
+
+    if (!broker_read(fd, &req, sizeof req))
+        goto err;
+    if (req.version != BROKER_VERSION
+            || !memchr(req.user, '\0', sizeof req.user)
+            || !memchr(req.tty, '\0', sizeof req.tty)
+            || !memchr(req.options, '\0', sizeof req.options)) {
+        syslog(LOG_WARNING, "Rejecting malformed request from pid %ld",
+                (long) cred.pid);
+        goto err;
+    }
+
+    memset(&res, 0, sizeof res);
+    res.version = BROKER_VERSION;
+
+    if (0 != strcmp(req.options, broker_options)) {
+        /* the module authenticates in-process with its own options */
+        syslog(LOG_NOTICE, "Options of pid %ld differ from ours",
+                (long) cred.pid);
+        res.type = BROKER_MISMATCH;
+        broker_write(fd, &res, sizeof res);
+        goto err;
+    }
+
+    request.user = req.user;
+    request.tty = req.tty;
+    request.sid = req.sid;
+    request.uid = req.uid;
+    request.info = serve_info;
+    request.info_ctx = &fd;
+    request.client = NULL;
+
+    res.type = BROKER_RESULT;
+
+    curl = curl_pool_acquire();
+    if (curl) {
+        auth_options_apply(&options, curl);
+        res.result = auth_authenticate(NULL, curl, &options, &request);
+        curl_pool_release(curl);
+    } else {
+        res.result = PAM_BUF_ERR;
+    }
+    broker_write(fd, &res, sizeof res);
+
+err:
+    close(fd);
+
+    return NULL;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-s socket] [option=value ...]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = BROKER_SOCKET;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int opt, lfd, fd;
+
+    while ((opt = getopt(argc, argv, "s:h")) != -1) {
+        switch (opt) {
+            case 's':
+                path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    openlog("eid-pamd", LOG_PID, LOG_AUTHPRIV);
+
+    auth_options_init(&options);
+    for (; optind < argc; optind++) {
+        if (!auth_options_set(NULL, &options, argv[optind])) {
+            fprintf(stderr, "Invalid option %s\n", argv[optind]);
+            usage(argv[0]);
+            return 1;
+        }
+        if (!broker_options_add(broker_options, argv[optind])) {
+            fprintf(stderr, "Too many options\n");
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    lfd = listen_activated();
+    if (lfd < 0)
+        lfd = listen_path(path);
+    if (lfd < 0)
+        return 1;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (1) {
+        fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            syslog(LOG_ERR, "accept() failed: %s", strerror(errno));
+            break;
+        }
+        if (0 != pthread_create(&thread, &attr, serve, (void *) (long) fd)) {
+            syslog(LOG_ERR, "pthread_create() failed");
+            close(fd);
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+    auth_options_free(&options);
+    close(lfd);
+
+    return 1;
+}
@@ -0,0 +1,331 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "eid.h"
+#include "store.h"
+#include <errno.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-f store] compile [user ...]\n"
+            "       %s [-f store] remove user ...\n"
+            "       %s [-f store] list\n"
+            "       %s enroll < digests\n"
+            "Manages the system-wide store of the references (default "
+            STORE_PATH ").\n"
+            "`compile` reads ~/.eid of the given (or all) users into the "
+            "store.\n`enroll` is called by eid-add for the invoking user.\n",
+            name, name, name, name);
+}
+
+/* reads ~/.eid of pw, returns 0 if the user has no (valid) reference */
+static int load_entry(const struct passwd *pw, struct store_entry *entry)
+{
+    struct auth_reference reference;
+    struct client_pubkey pubkey;
+    int ok;
+
+    if (strlen(pw->pw_name) >= sizeof entry->user)
+        return 0;
+
+    ok = auth_read_reference(pw, &reference);
+    if (!ok && errno == EACCES && 0 == geteuid()) {
+        /* root may not have access to the home directory, e.g. on NFS with
+         * root squashing */
+        if (0 == setegid(pw->pw_gid) && 0 == seteuid(pw->pw_uid))
+            ok = auth_read_reference(pw, &reference);
+        if (0 != seteuid(0) || 0 != setegid(0)) {
+            perror("seteuid");
+            exit(1);
+        }
+    }
+    if (!ok) {
+        if (errno != ENOENT)
+            fprintf(stderr, "Skipping %s: %s\n", pw->pw_name, strerror(errno));
+        return 0;
+    }
+
+    memset(entry, 0, sizeof *entry);
+    strcpy(entry->user, pw->pw_name);
+    ok = auth_reference_upgrade(&reference);
+    entry->count = reference.count;
+    memcpy(entry->md, reference.md, sizeof entry->md);
+    auth_reference_free(&reference);
+    if (!ok || entry->count == 0) {
+        fprintf(stderr, "Skipping %s: invalid reference\n", pw->pw_name);
+        return 0;
+    }
+
+    if (1 != client_pubkey_load(pw, &pubkey)) {
+        fprintf(stderr, "Skipping %s: invalid ~/.eid/authorized_pubkey\n",
+                pw->pw_name);
+        return 0;
+    }
+    entry->pinned = pubkey.pinned;
+    memcpy(entry->pubkey, pubkey.md, sizeof entry->pubkey);
+
+    return 1;
+}
+
+/* replaces or appends the entry of its user, or removes it */
+static int update(struct store_entry **entries, size_t *count,
+        const struct store_entry *entry, int remove)
+{
+    struct store_entry *e;
+    size_t i;
+
+    for (i = 0; i < *count; i++) {
+        if (0 == strcmp((*entries)[i].user, entry->user))
+            break;
+    }
+
+    if (remove) {
+        if (i == *count)
+            return 0;
+        memmove(&(*entries)[i], &(*entries)[i + 1],
+                (*count - i - 1) * sizeof **entries);
+        (*count)--;
+        return 1;
+    }
+
+    if (i == *count) {
+        e = realloc(*entries, (*count + 1) * sizeof *e);
+        if (!e)
+            return 0;
+        *entries = e;
+        (*count)++;
+    }
+    (*entries)[i] = *entry;
+
+    return 1;
+}
+
+static int compile(const char *path, int argc, char **argv)
+{
+    struct store_entry *entries = NULL, entry;
+    struct passwd *pw;
+    char dir[PATH_MAX], *slash;
+    size_t count = 0;
+    int lock, i, found, ok = 0;
+
+    snprintf(dir, sizeof dir, "%s", path);
+    slash = strrchr(dir, '/');
+    if (slash && slash != dir) {
+        *slash = '\0';
+        if (0 != mkdir(dir, 0700) && errno != EEXIST) {
+            perror(dir);
+            return 1;
+        }
+    }
+
+    lock = store_lock(path);
+    if (lock < 0) {
+        perror(path);
+        return 1;
+    }
+
+    if (argc == 0) {
+        /* rebuild the store from scratch */
+        setpwent();
+        while ((pw = getpwent())) {
+            if (load_entry(pw, &entry) && !update(&entries, &count, &entry, 0))
+                goto err;
+        }
+        endpwent();
+    } else {
+        if (!store_read(path, &entries, &count) && errno != ENOENT) {
+            perror(path);
+            goto err;
+        }
+        for (i = 0; i < argc; i++) {
+            pw = getpwnam(argv[i]);
+            if (!pw) {
+                fprintf(stderr, "Unknown user %s\n", argv[i]);
+                continue;
+            }
+            memset(&entry, 0, sizeof entry);
+            strncpy(entry.user, pw->pw_name, sizeof entry.user - 1);
+            found = load_entry(pw, &entry);
+            /* drop the user if ~/.eid is gone */
+            update(&entries, &count, &entry, !found);
+        }
+    }
+
+    if (!store_write(path, entries, count)) {
+        perror(path);
+        goto err;
+    }
+    printf("Compiled %lu references into %s\n", (unsigned long) count, path);
+    ok = 1;
+
+err:
+    store_unlock(lock);
+    free(entries);
+
+    return ok ? 0 : 1;
+}
+
+static int remove_users(const char *path, int argc, char **argv)
+{
+    struct store_entry *entries = NULL, entry;
+    size_t count = 0;
+    int lock, i, ok = 0;
+
+    lock = store_lock(path);
+    if (lock < 0 || !store_read(path, &entries, &count)) {
+        perror(path);
+        goto err;
+    }
+
+    memset(&entry, 0, sizeof entry);
+    for (i = 0; i < argc; i++) {
+        strncpy(entry.user, argv[i], sizeof entry.user - 1);
+        if (!update(&entries, &count, &entry, 1))
+            fprintf(stderr, "%s is not in the store\n", argv[i]);
+    }
+
+    if (!store_write(path, entries, count)) {
+        perror(path);
+        goto err;
+    }
+    ok = 1;
+
+err:
+    store_unlock(lock);
+    free(entries);
+
+    return ok ? 0 : 1;
+}
+
+static int list(const char *path)
+{
+    struct store_entry *entries;
+    size_t count, i;
+
+    if (!store_read(path, &entries, &count)) {
+        perror(path);
+        return 1;
+    }
+
+    for (i = 0; i < count; i++)
+        printf("%s%s\n", entries[i].user, entries[i].pinned ? " (pinned)" : "");
+    free(entries);
+
+    return 0;
+}
+
+/* Called by eid-add (with the set-user-ID bit) to update the entry of the
+ * invoking user with the digests read from stdin, terminated by an empty line
+ * and optionally followed by the hash of the pinned key */
+static int enroll(void)
+{
+    struct store_entry *entries = NULL, entry;
+    struct passwd *pw;
+    struct stat sb;
+    unsigned char line[128];
+    size_t count = 0;
+    int lock = -1, ok = 0;
+
+    if (0 != stat(STORE_PATH, &sb)) {
+        /* the store is optional */
+        return 0;
+    }
+
+    pw = getpwuid(getuid());
+    if (!pw || strlen(pw->pw_name) >= sizeof entry.user) {
+        fprintf(stderr, "Unknown user\n");
+        return 1;
+    }
+
+    memset(&entry, 0, sizeof entry);
+    strcpy(entry.user, pw->pw_name);
+    while (fgets((char *) line, sizeof line, stdin)
+            && 0 != strcmp((char *) line, "\n")) {
+        if (entry.count >= AUTH_REFERENCE_MAX
+                || 1 != auth_read_digest(line, strlen((char *) line),
+                    entry.md[entry.count])) {
+            fprintf(stderr, "Invalid reference\n");
+            return 1;
+        }
+        entry.count++;
+    }
+    if (entry.count == 0) {
+        fprintf(stderr, "Invalid reference\n");
+        return 1;
+    }
+    if (fgets((char *) line, sizeof line, stdin)) {
+        if (1 != auth_read_digest(line, strlen((char *) line), entry.pubkey)) {
+            fprintf(stderr, "Invalid key\n");
+            return 1;
+        }
+        entry.pinned = 1;
+    }
+
+    lock = store_lock(STORE_PATH);
+    if (lock < 0 || !store_read(STORE_PATH, &entries, &count)
+            || !update(&entries, &count, &entry, 0)
+            || !store_write(STORE_PATH, entries, count)) {
+        perror(STORE_PATH);
+        goto err;
+    }
+    printf("Enrolled %s in %s\n", entry.user, STORE_PATH);
+    ok = 1;
+
+err:
+    store_unlock(lock);
+    free(entries);
+
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = STORE_PATH;
+    int opt;
+
+    umask(077);
+
+    /* with the set-user-ID bit, the caller may only enroll itself */
+    if (getuid() != geteuid()) {
+        if (argc != 2 || 0 != strcmp(argv[1], "enroll")) {
+            usage(argv[0]);
+            return 1;
+        }
+        return enroll();
+    }
+
+    while ((opt = getopt(argc, argv, "f:h")) != -1) {
+        switch (opt) {
+            case 'f':
+                path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (0 == strcmp(argv[optind], "compile"))
+        return compile(path, argc - optind - 1, argv + optind + 1);
+    if (0 == strcmp(argv[optind], "remove") && optind + 1 < argc)
+        return remove_users(path, argc - optind - 1, argv + optind + 1);
+    if (0 == strcmp(argv[optind], "list"))
+        return list(path);
+    if (0 == strcmp(argv[optind], "enroll") && optind + 1 == argc)
+        return enroll();
+
+    usage(argv[0]);
+    return 1;
+}
@@ -1,13 +1,28 @@
+#include "eid.h"
+#include <ctype.h>
 #include <curl/curl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <openssl/crypto.h>
 #include <pwd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
-static int auth_dirname(const char *login, char filename[PATH_MAX])
+const char action_status[] = "Status";
+const char action_settings[] = "ShowUI=Settings";
+const char action_pinmanagement[] = "ShowUI=PINManagement";
+const char eid_tctoken_url_default[] = "https://www.autentapp.de/AusweisAuskunft/WebServiceRequesterServlet?mode=xml";
+static const char auth_digest_header[] = "eid-pam:sha256:";
+const char action_eid_ok[] = "<ns3:ResultMajor>http://www.bsi.bund.de/ecard/api/1.1/resultmajor#ok</ns3:ResultMajor>";
+
+static int auth_dirname(const struct passwd *pw, char filename[PATH_MAX])
 {
-    struct passwd *pw = getpwnam(login);
     if (!pw || !pw->pw_dir)
         return 0;
 
@@ -17,9 +32,9 @@ static int auth_dirname(const char *login, char filename[PATH_MAX])
     return 1;
 }
 
-static int auth_filename(const char *login, char filename[PATH_MAX])
+static int auth_filename(const struct passwd *pw, char filename[PATH_MAX])
 {
-    if (1 != auth_dirname(login, filename))
+    if (1 != auth_dirname(pw, filename))
         return 0;
 
     strcat(filename, "/authorized_eid");
@@ -27,60 +42,964 @@ static int auth_filename(const char *login, char filename[PATH_MAX])
     return 1;
 }
 
-int auth_mkdir(const char *login)
+int auth_mkdir(const struct passwd *pw)
 {
     char dirname[PATH_MAX];
 
-    if (1 != auth_dirname(login, dirname))
+    if (1 != auth_dirname(pw, dirname))
         return -1;
 
     return mkdir(dirname, 0700);
 }
 
-FILE *auth_fopen(const char *login, const char *mode)
+FILE *auth_fopen(const struct passwd *pw, const char *mode)
 {
     char filename[PATH_MAX];
+    int fd;
 
-    if (1 != auth_filename(login, filename))
+    if (1 != auth_filename(pw, filename))
         return NULL;
 
-    return fopen(filename, mode);
+    if (mode[0] != 'w')
+        return fopen(filename, mode);
+
+    /* don't depend on the umask, the reference is nobody else's business */
+    fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+    if (fd < 0)
+        return NULL;
+
+    return fdopen(fd, mode);
 }
 
-static int pubkey_filename(const char *login, char filename[PATH_MAX])
+/* Only the user (or root) may be able to modify the file. Group write access
+ * is tolerated for the user's private group. */
+static int auth_trusted(const struct passwd *pw, const struct stat *sb)
 {
-    if (1 != auth_dirname(login, filename))
+    if (sb->st_uid != pw->pw_uid && sb->st_uid != 0)
+        return 0;
+    if (sb->st_mode & S_IWOTH)
         return 0;
+    if ((sb->st_mode & S_IWGRP) && sb->st_gid != pw->pw_gid)
+        return 0;
+    return 1;
+}
+
+/* Opens ~/.eid/name without following symbolic links and without relying on
+ * the process' effective user ID, which makes it usable from concurrent
+ * threads with root privileges */
+static int auth_openat(const struct passwd *pw, const char *name)
+{
+    struct stat sb;
+    int home = -1, dir = -1, fd = -1, err;
+
+    if (!pw || !pw->pw_dir)
+        return -1;
 
-    strcat(filename, "/authorized_pubkey");
+    home = open(pw->pw_dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (home < 0)
+        goto err;
+
+    dir = openat(home, ".eid", O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if (dir < 0)
+        goto err;
+    if (0 != fstat(dir, &sb))
+        goto err;
+    if (!auth_trusted(pw, &sb)) {
+        errno = EINVAL;
+        goto err;
+    }
+
+    fd = openat(dir, name, O_RDONLY|O_NOFOLLOW|O_NONBLOCK|O_CLOEXEC);
+    if (fd < 0)
+        goto err;
+    if (0 != fstat(fd, &sb))
+        goto err;
+    if (!S_ISREG(sb.st_mode) || !auth_trusted(pw, &sb)) {
+        errno = EINVAL;
+        goto err;
+    }
+
+    close(dir);
+    close(home);
+
+    return fd;
+
+err:
+    err = errno;
+    if (fd >= 0)
+        close(fd);
+    if (dir >= 0)
+        close(dir);
+    if (home >= 0)
+        close(home);
+    errno = err;
+
+    return -1;
+}
+
+static int hex_decode(const unsigned char *hex, size_t hex_len,
+        unsigned char *out, size_t out_len)
+{
+    size_t i;
+    unsigned int v;
+    char byte[3] = {0, 0, 0};
+
+    if (hex_len != 2*out_len)
+        return 0;
+
+    for (i = 0; i < out_len; i++) {
+        byte[0] = hex[2*i];
+        byte[1] = hex[2*i + 1];
+        if (!isxdigit((unsigned char) byte[0])
+                || !isxdigit((unsigned char) byte[1])
+                || 1 != sscanf(byte, "%02x", &v))
+            return 0;
+        out[i] = v;
+    }
 
     return 1;
 }
 
-void client_pubkeypinning(CURL *curl, const char *login)
+/* parses "eid-pam:sha256:<hex>[ label]" without the line break */
+static int auth_parse_line(const unsigned char *line, size_t len,
+        unsigned char md[AUTH_DIGEST_LENGTH], char label[AUTH_LABEL_MAX])
+{
+    size_t header_len = strlen(auth_digest_header);
+    size_t hex_len = 2*AUTH_DIGEST_LENGTH;
+
+    if (len < header_len + hex_len
+            || 0 != memcmp(line, auth_digest_header, header_len)
+            || 1 != hex_decode(line + header_len, hex_len,
+                md, AUTH_DIGEST_LENGTH))
+        return 0;
+    line += header_len + hex_len;
+    len -= header_len + hex_len;
+
+    if (label)
+        label[0] = '\0';
+    if (len == 0)
+        return 1;
+    if (line[0] != ' ' || len - 1 >= AUTH_LABEL_MAX)
+        return 0;
+    if (label) {
+        memcpy(label, line + 1, len - 1);
+        label[len - 1] = '\0';
+    }
+
+    return 1;
+}
+
+int auth_read_digest(const unsigned char *data, size_t len,
+        unsigned char md[AUTH_DIGEST_LENGTH])
+{
+    if (len > 0 && data[len - 1] == '\n')
+        len--;
+
+    return auth_parse_line(data, len, md, NULL);
+}
+
+/* checks whether the loaded reference is in the digest format and parses it */
+static int auth_parse_digests(struct auth_reference *reference)
+{
+    const unsigned char *line = reference->data, *end, *nl;
+    size_t n = 0;
+
+    if (!line)
+        return 0;
+
+    for (end = line + reference->length; line < end; line = nl + 1) {
+        nl = memchr(line, '\n', end - line);
+        if (!nl)
+            nl = end;
+        if (nl == line)
+            continue;
+        if (n >= AUTH_REFERENCE_MAX
+                || 1 != auth_parse_line(line, nl - line, reference->md[n],
+                    reference->label[n]))
+            return 0;
+        n++;
+    }
+    reference->count = n;
+
+    return n > 0;
+}
+
+int auth_read_reference(const struct passwd *pw,
+        struct auth_reference *reference)
 {
-    char filename[PATH_MAX];
     struct stat sb;
+    unsigned char *data = NULL;
+    size_t length = 0;
+    ssize_t n;
+    int fd, r = 0, err;
+
+    memset(reference, 0, sizeof *reference);
+
+    fd = auth_openat(pw, "authorized_eid");
+    if (fd < 0)
+        return 0;
+
+    if (0 != fstat(fd, &sb))
+        goto err;
+
+    /* the file belongs to the user, who may change or truncate it at any
+     * time; a private copy can't be pulled away (a mapping would fault) */
+    if (sb.st_size > AUTH_REFERENCE_SIZE_MAX) {
+        errno = EFBIG;
+        goto err;
+    }
+    if (sb.st_size > 0) {
+        data = malloc(sb.st_size);
+        if (!data)
+            goto err;
+        while (length < (size_t) sb.st_size) {
+            n = read(fd, data + length, sb.st_size - length);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                goto err;
+            if (n == 0)
+                break;
+            length += n;
+        }
+        reference->data = data;
+        reference->length = length;
+        data = NULL;
+    }
+
+    if (1 == auth_parse_digests(reference)) {
+        /* the digests are all we need, release the copy right away */
+        auth_reference_free(reference);
+        reference->digest = 1;
+    } else {
+        reference->count = 0;
+    }
+
+    r = 1;
+
+err:
+    err = errno;
+    free(data);
+    close(fd);
+    errno = err;
+
+    return r;
+}
+
+void auth_reference_free(struct auth_reference *reference)
+{
+    free((void *) reference->data);
+    reference->data = NULL;
+    reference->length = 0;
+}
 
-    if (1 == pubkey_filename(login, filename)
-            && 0 == stat(filename, &sb)
-            && S_ISREG(sb.st_mode)) {
-        curl_easy_setopt(curl, CURLOPT_PINNEDPUBLICKEY, filename);
+int auth_write_entry(FILE *file, const unsigned char md[AUTH_DIGEST_LENGTH],
+        const char *label)
+{
+    size_t i;
+
+    if (0 > fputs(auth_digest_header, file))
+        return 0;
+    for (i = 0; i < AUTH_DIGEST_LENGTH; i++) {
+        if (0 > fprintf(file, "%02x", md[i]))
+            return 0;
+    }
+    if (label && label[0] && 0 > fprintf(file, " %s", label))
+        return 0;
+    if (0 > fputc('\n', file))
+        return 0;
+
+    return 1;
+}
+
+int auth_write_reference(FILE *file, const struct auth_reference *reference)
+{
+    size_t i;
+
+    for (i = 0; i < reference->count; i++) {
+        if (1 != auth_write_entry(file, reference->md[i], reference->label[i]))
+            return 0;
     }
+
+    return 1;
 }
 
-int client_action(CURL *curl, const char *action)
+int auth_read_entry(const char *line, unsigned char md[AUTH_DIGEST_LENGTH],
+        char label[AUTH_LABEL_MAX])
 {
+    size_t len = strlen(line);
+
+    if (len > 0 && line[len - 1] == '\n')
+        len--;
+
+    return auth_parse_line((const unsigned char *) line, len, md, label);
+}
+
+int auth_reference_upgrade(struct auth_reference *reference)
+{
+    EVP_MD_CTX *ctx;
+    int ok;
+
+    if (reference->digest)
+        return 1;
+
+    ctx = auth_digest_new();
+    ok = ctx
+        && 1 == EVP_DigestUpdate(ctx, reference->data, reference->length)
+        && 1 == auth_digest_final(ctx, reference->md[0]);
+    EVP_MD_CTX_free(ctx);
+    if (!ok)
+        return 0;
+
+    auth_reference_free(reference);
+    reference->digest = 1;
+    reference->count = 1;
+    reference->label[0][0] = '\0';
+
+    return 1;
+}
+
+int auth_reference_add(struct auth_reference *reference,
+        const unsigned char md[AUTH_DIGEST_LENGTH], const char *label)
+{
+    if (reference->count >= AUTH_REFERENCE_MAX
+            || (label && (strlen(label) >= AUTH_LABEL_MAX
+                    || strchr(label, '\n'))))
+        return 0;
+
+    memcpy(reference->md[reference->count], md, AUTH_DIGEST_LENGTH);
+    snprintf(reference->label[reference->count], AUTH_LABEL_MAX, "%s",
+            label ? label : "");
+    reference->count++;
+    reference->digest = 1;
+
+    return 1;
+}
+
+int auth_fingerprint(const struct auth_reference *reference,
+        unsigned char md[AUTH_DIGEST_LENGTH])
+{
+    EVP_MD_CTX *ctx;
+    size_t i;
+    int ok;
+
+    if (reference->digest && reference->count == 1) {
+        memcpy(md, reference->md[0], AUTH_DIGEST_LENGTH);
+        return 1;
+    }
+
+    /* the legacy format yields the same digest as its converted version */
+    ctx = auth_digest_new();
+    ok = ctx != NULL;
+    if (ok && !reference->digest)
+        ok = 1 == EVP_DigestUpdate(ctx, reference->data, reference->length);
+    for (i = 0; ok && reference->digest && i < reference->count; i++)
+        ok = 1 == EVP_DigestUpdate(ctx, reference->md[i], AUTH_DIGEST_LENGTH);
+    ok = ok && 1 == auth_digest_final(ctx, md);
+    EVP_MD_CTX_free(ctx);
+
+    return ok;
+}
+
+int auth_reference_match(const struct auth_reference *reference,
+        const unsigned char md[AUTH_DIGEST_LENGTH])
+{
+    size_t i;
+    int match = 0;
+
+    /* compare against all of them to not reveal which one matched */
+    for (i = 0; i < reference->count; i++)
+        match |= 0 == CRYPTO_memcmp(md, reference->md[i], AUTH_DIGEST_LENGTH);
+
+    return match;
+}
+
+EVP_MD_CTX *auth_digest_new(void)
+{
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+    if (ctx && 1 != EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+        EVP_MD_CTX_free(ctx);
+        ctx = NULL;
+    }
+
+    return ctx;
+}
+
+int auth_digest_final(EVP_MD_CTX *ctx, unsigned char md[AUTH_DIGEST_LENGTH])
+{
+    unsigned int len = 0;
+
+    if (1 != EVP_DigestFinal_ex(ctx, md, &len)
+            || len != AUTH_DIGEST_LENGTH)
+        return 0;
+
+    return 1;
+}
+
+/* decodes the base64 payload of a PEM encoded public key in place */
+static int pem_decode(unsigned char *buf, size_t *len)
+{
+    static const char begin[] = "-----BEGIN PUBLIC KEY-----";
+    static const char end[] = "-----END PUBLIC KEY-----";
+    unsigned char *b64, *e;
+    EVP_ENCODE_CTX *ctx;
+    int n, m, ok = 0;
+
+    if (*len < sizeof begin - 1
+            || 0 != memcmp(buf, begin, sizeof begin - 1))
+        return 0;
+    b64 = buf + sizeof begin - 1;
+
+    for (e = b64; e + sizeof end - 1 <= buf + *len; e++) {
+        if (0 == memcmp(e, end, sizeof end - 1))
+            break;
+    }
+    if (e + sizeof end - 1 > buf + *len)
+        return 0;
+
+    ctx = EVP_ENCODE_CTX_new();
+    if (!ctx)
+        return 0;
+    EVP_DecodeInit(ctx);
+    if (0 <= EVP_DecodeUpdate(ctx, buf, &n, b64, e - b64)
+            && 1 == EVP_DecodeFinal(ctx, buf + n, &m)) {
+        *len = n + m;
+        ok = 1;
+    }
+    EVP_ENCODE_CTX_free(ctx);
+
+    return ok;
+}
+
+int client_pubkey_load(const struct passwd *pw, struct client_pubkey *pubkey)
+{
+    unsigned char buf[4096];
+    unsigned char md[AUTH_DIGEST_LENGTH];
+    EVP_MD_CTX *ctx = NULL;
+    ssize_t n;
+    size_t len;
+    int fd, ok = 0;
+
+    memset(pubkey, 0, sizeof *pubkey);
+
+    fd = auth_openat(pw, "authorized_pubkey");
+    if (fd < 0) {
+        /* no pinning configured */
+        return errno == ENOENT ? 1 : 0;
+    }
+
+    n = read(fd, buf, sizeof buf);
+    close(fd);
+    if (n <= 0)
+        goto err;
+    len = n;
+
+    /* like libcurl, we expect the DER encoded SubjectPublicKeyInfo, which
+     * may be wrapped in PEM */
+    if (buf[0] != 0x30 && 1 != pem_decode(buf, &len))
+        goto err;
+
+    ctx = auth_digest_new();
+    if (!ctx
+            || 1 != EVP_DigestUpdate(ctx, buf, len)
+            || 1 != auth_digest_final(ctx, md))
+        goto err;
+
+    client_pubkey_set(pubkey, md);
+    ok = 1;
+
+err:
+    EVP_MD_CTX_free(ctx);
+
+    return ok;
+}
+
+void client_pubkey_set(struct client_pubkey *pubkey,
+        const unsigned char md[AUTH_DIGEST_LENGTH])
+{
+    /* libcurl accepts the base64 encoded SHA-256 hash of the public key */
+    memcpy(pubkey->pin, "sha256//", 8);
+    EVP_EncodeBlock((unsigned char *) pubkey->pin + 8, md, AUTH_DIGEST_LENGTH);
+    memcpy(pubkey->md, md, AUTH_DIGEST_LENGTH);
+    pubkey->pinned = 1;
+}
+
+int client_pubkey_parse(struct client_pubkey *pubkey, const char *pin)
+{
+    unsigned char md[AUTH_DIGEST_LENGTH + 3];
+
+    memset(pubkey, 0, sizeof *pubkey);
+
+    /* 32 bytes are encoded with 43 characters and one of padding */
+    if (0 != strncmp(pin, "sha256//", 8) || strlen(pin + 8) != 44
+            || pin[8 + 43] != '='
+            || AUTH_DIGEST_LENGTH + 1 != EVP_DecodeBlock(md,
+                (const unsigned char *) pin + 8, 44))
+        return 0;
+
+    client_pubkey_set(pubkey, md);
+
+    return 1;
+}
+
+void client_pubkeypinning(CURL *curl, const struct client_pubkey *pubkey)
+{
+    /* the handle may have been pinned to a different key before */
+    curl_easy_setopt(curl, CURLOPT_PINNEDPUBLICKEY,
+            pubkey->pinned ? pubkey->pin : NULL);
+}
+
+static int eid_origin_fill(struct eid_origin *origin, const char *scheme,
+        const char *host, size_t host_length, long port)
+{
+    size_t i;
+
+    if (0 != strcasecmp(scheme, "https") || host_length == 0
+            || host_length >= sizeof origin->host || port <= 0 || port > 65535)
+        return 0;
+
+    /* host names are compared case-insensitively */
+    for (i = 0; i < host_length; i++)
+        origin->host[i] = tolower((unsigned char) host[i]);
+    origin->host[host_length] = '\0';
+    origin->port = port;
+    if (port == 443)
+        snprintf(origin->name, sizeof origin->name, "https://%s",
+                origin->host);
+    else
+        snprintf(origin->name, sizeof origin->name, "https://%s:%ld",
+                origin->host, port);
+
+    return 1;
+}
+
+int eid_origin_parse(struct eid_origin *origin, const char *url)
+{
+#ifdef HAVE_CURL_URL
+    CURLU *u = curl_url();
+    char *scheme = NULL, *host = NULL, *port = NULL;
     int ok = 0;
-    char url[256];
 
-    snprintf(url, (sizeof url) - 1,
-            "http://127.0.0.1:24727/eID-Client?%s",
-            action);
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    if (CURLE_OK == curl_easy_perform(curl)) {
+    memset(origin, 0, sizeof *origin);
+
+    if (u && CURLUE_OK == curl_url_set(u, CURLUPART_URL, url, 0)
+            && CURLUE_OK == curl_url_get(u, CURLUPART_SCHEME, &scheme, 0)
+            && CURLUE_OK == curl_url_get(u, CURLUPART_HOST, &host, 0)
+            && CURLUE_OK == curl_url_get(u, CURLUPART_PORT, &port,
+                CURLU_DEFAULT_PORT))
+        ok = eid_origin_fill(origin, scheme, host, strlen(host),
+                strtol(port, NULL, 10));
+
+    curl_free(scheme);
+    curl_free(host);
+    curl_free(port);
+    curl_url_cleanup(u);
+
+    return ok;
+#else
+    const char *authority, *end, *host, *colon;
+    long port = 443;
+
+    memset(origin, 0, sizeof *origin);
+
+    if (0 != strncasecmp(url, "https://", 8))
+        return 0;
+    authority = url + 8;
+    end = authority + strcspn(authority, "/?#");
+    /* skip the user info */
+    for (host = end; host > authority && host[-1] != '@'; host--)
+        ;
+    colon = host[0] == '['
+        ? memchr(host, ']', end - host)
+        : memchr(host, ':', end - host);
+    if (host[0] == '[') {
+        if (!colon)
+            return 0;
+        colon++;
+        if (colon != end && *colon != ':')
+            return 0;
+    }
+    if (colon && colon < end) {
+        char *e;
+        port = strtol(colon + 1, &e, 10);
+        if (e != end)
+            return 0;
+    } else {
+        colon = end;
+    }
+
+    return eid_origin_fill(origin, "https", host, colon - host, port);
+#endif
+}
+
+int eid_origin_set(struct eid_origin *origin, const char *arg)
+{
+    char url[EID_URL_MAX];
+    const char *comma = strchr(arg, ',');
+    size_t length = comma ? (size_t) (comma - arg) : strlen(arg);
+
+    if (length >= sizeof url)
+        return 0;
+    memcpy(url, arg, length);
+    url[length] = '\0';
+
+    if (!eid_origin_parse(origin, url))
+        return 0;
+
+    return !comma || client_pubkey_parse(&origin->pubkey, comma + 1);
+}
+
+const struct eid_origin *eid_origin_match(const struct eid_origin *origins,
+        size_t count, const char *url)
+{
+    struct eid_origin origin;
+    size_t i;
+
+    if (!eid_origin_parse(&origin, url))
+        return NULL;
+
+    for (i = 0; i < count; i++) {
+        if (origins[i].port == origin.port
+                && 0 == strcmp(origins[i].host, origin.host))
+            return &origins[i];
+    }
+
+    return NULL;
+}
+
+const struct client_endpoint client_endpoint_default = {
+    "http://127.0.0.1:24727", NULL
+};
+
+int client_endpoint_set(struct client_endpoint *endpoint, const char *arg)
+{
+    if (0 == strncmp(arg, "unix:/", 6)) {
+#ifdef HAVE_UNIX_SOCKET
+        /* the host name is only used in the Host header */
+        endpoint->url = "http://localhost";
+        endpoint->socket = arg + 5;
         return 1;
+#else
+        return 0;
+#endif
+    }
+
+    if (0 != strncmp(arg, "http://", 7) || !arg[7]
+            || strlen(arg) > 128)
+        return 0;
+    endpoint->url = arg;
+    endpoint->socket = NULL;
+
+    return 1;
+}
+
+void client_endpoint_prepare(CURL *curl,
+        const struct client_endpoint *endpoint, const char *action)
+{
+    char url[1024];
+    size_t length = strlen(endpoint->url);
+
+    if (length > 0 && endpoint->url[length - 1] == '/')
+        length--;
+    snprintf(url, sizeof url, "%.*s/eID-Client?%s", (int) length,
+            endpoint->url, action);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+#ifdef HAVE_UNIX_SOCKET
+    /* the handle may have been used with a different endpoint */
+    curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, endpoint->socket);
+#endif
+}
+
+void client_eid_prepare(CURL *curl, const struct client_endpoint *endpoint,
+        const char *tctoken_url)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char action[sizeof "tcTokenURL=" + 3*EID_URL_MAX];
+    size_t i, n = strlen("tcTokenURL=");
+
+    memcpy(action, "tcTokenURL=", n);
+    /* the URL is a parameter of the query, so it has to be escaped; longer
+     * URLs are rejected by auth_options_set() */
+    for (i = 0; tctoken_url[i] && i < EID_URL_MAX; i++) {
+        unsigned char c = tctoken_url[i];
+        if ((c < 0x80 && isalnum(c)) || c == '-' || c == '.' || c == '_' || c == '~') {
+            action[n++] = c;
+        } else {
+            action[n++] = '%';
+            action[n++] = hex[c >> 4];
+            action[n++] = hex[c & 0xf];
+        }
+    }
+    action[n] = '\0';
+
+    client_endpoint_prepare(curl, endpoint, action);
+}
+
+int eid_match_init(struct eid_match *match, const char *needle)
+{
+    size_t i, k = 0;
+
+    memset(match, 0, sizeof *match);
+    match->needle = needle;
+    match->length = strlen(needle);
+    if (match->length == 0 || match->length > EID_MATCH_MAX) {
+        match->length = 0;
+        return 0;
+    }
+
+    /* fallback[i] is the length of the longest proper prefix of
+     * needle[0..i] which is also a suffix of it */
+    for (i = 1; i < match->length; i++) {
+        while (k > 0 && needle[i] != needle[k])
+            k = match->fallback[k - 1];
+        if (needle[i] == needle[k])
+            k++;
+        match->fallback[i] = k;
+    }
+
+    return 1;
+}
+
+int eid_match_update(struct eid_match *match, const void *data, size_t count)
+{
+    const char *p = data;
+    size_t i, k = match->matched;
+
+    if (match->length == 0)
+        return 0;
+
+    for (i = 0; i < count && !match->found; i++) {
+        while (k > 0 && p[i] != match->needle[k])
+            k = match->fallback[k - 1];
+        if (p[i] == match->needle[k])
+            k++;
+        if (k == match->length)
+            match->found = 1;
+    }
+    match->matched = k;
+
+    return match->found;
+}
+
+#define FIELD_NAME(name) name, sizeof name - 1
+
+static const struct {
+    /* local name of the XML element */
+    const char *tag;
+    size_t tag_length;
+    /* key of a "Key: value" line */
+    const char *key;
+    size_t key_length;
+} eid_field_names[EID_FIELDS] = {
+    {FIELD_NAME("GivenNames"), NULL, 0},
+    {FIELD_NAME("FamilyNames"), NULL, 0},
+    {FIELD_NAME("DateOfBirth"), NULL, 0},
+    {FIELD_NAME("DateOfExpiry"), NULL, 0},
+    {FIELD_NAME("RestrictedID"), NULL, 0},
+    /* Open eCard App and AusweisApp2 */
+    {FIELD_NAME("Name"), FIELD_NAME("Name")},
+};
+
+enum {
+    FIELDS_LINE,
+    FIELDS_TEXT,
+    FIELDS_KEY,
+    FIELDS_SEPARATOR,
+    FIELDS_TAG,
+    FIELDS_ATTRIBUTES,
+    FIELDS_SKIP_TAG,
+    FIELDS_VALUE,
+    FIELDS_LINE_VALUE,
+};
+
+static int fields_keys_wanted(const struct eid_fields *fields)
+{
+    size_t i;
+
+    for (i = 0; i < EID_FIELDS; i++) {
+        if ((fields->wanted & ~fields->seen & EID_FIELD(i))
+                && eid_field_names[i].key)
+            return 1;
     }
 
     return 0;
 }
+
+void eid_fields_init(struct eid_fields *fields, unsigned int wanted,
+        eid_field_cb cb, void *ctx)
+{
+    memset(fields, 0, sizeof *fields);
+    fields->wanted = wanted & (EID_FIELD(EID_FIELDS) - 1);
+    fields->cb = cb;
+    fields->ctx = ctx;
+    fields->state = FIELDS_LINE;
+    fields->field = EID_FIELDS;
+    fields->keys = fields_keys_wanted(fields);
+}
+
+/* looks up the collected name as XML element or as key */
+static enum eid_field fields_lookup(const struct eid_fields *fields, int key)
+{
+    const char *name;
+    size_t i, length;
+
+    for (i = 0; i < EID_FIELDS; i++) {
+        if (!(fields->wanted & ~fields->seen & EID_FIELD(i)))
+            continue;
+        name = key ? eid_field_names[i].key : eid_field_names[i].tag;
+        length = key ? eid_field_names[i].key_length
+            : eid_field_names[i].tag_length;
+        if (length == fields->length
+                && 0 == memcmp(name, fields->name, length))
+            return i;
+    }
+
+    return EID_FIELDS;
+}
+
+static int fields_name_char(char c)
+{
+    return c != '>' && c != ' ' && c != '\t' && c != '\r' && c != '\n'
+        && c != ':' && c != '/' && c != '?' && c != '!';
+}
+
+static void fields_value(struct eid_fields *fields, const char *data,
+        size_t length, int final)
+{
+    if (length > 0 || final)
+        fields->cb(fields->ctx, fields->field, data, length, final);
+    if (final) {
+        fields->seen |= EID_FIELD(fields->field);
+        fields->field = EID_FIELDS;
+        fields->state = FIELDS_TEXT;
+        fields->keys = fields_keys_wanted(fields);
+    }
+}
+
+void eid_fields_update(struct eid_fields *fields, const void *data,
+        size_t count)
+{
+    const char *p = data, *end = p + count, *value;
+    char c;
+
+    while (p < end && fields->wanted & ~fields->seen) {
+        if (fields->state == FIELDS_VALUE) {
+            /* the value is passed on as it is, without copying */
+            value = p;
+            p = memchr(p, '<', end - p);
+            if (!p) {
+                fields_value(fields, value, end - value, 0);
+                return;
+            }
+            fields_value(fields, value, p - value, 1);
+            continue;
+        }
+        if (fields->state == FIELDS_LINE_VALUE) {
+            value = p;
+            while (p < end && *p != '\n' && *p != '\r')
+                p++;
+            fields_value(fields, value, p - value, p < end);
+            continue;
+        }
+        if (fields->state == FIELDS_SKIP_TAG
+                || (fields->state == FIELDS_TEXT && !fields->keys)) {
+            /* skip to the next markup */
+            p = memchr(p, fields->state == FIELDS_TEXT ? '<' : '>', end - p);
+            if (!p)
+                return;
+        }
+        if (fields->state == FIELDS_TAG && fields->length > 0) {
+            /* collect the rest of the name */
+            while (p < end && fields->length < sizeof fields->name
+                    && fields_name_char(*p))
+                fields->name[fields->length++] = *p++;
+            if (p == end)
+                return;
+        }
+
+        c = *p++;
+        switch (fields->state) {
+            case FIELDS_LINE:
+                if (c == '<') {
+                    fields->state = FIELDS_TAG;
+                    fields->length = 0;
+                } else if (c != '\n' && fields->keys) {
+                    fields->state = FIELDS_KEY;
+                    fields->name[0] = c;
+                    fields->length = 1;
+                } else if (c != '\n') {
+                    fields->state = FIELDS_TEXT;
+                }
+                break;
+            case FIELDS_TEXT:
+                if (c == '<') {
+                    fields->state = FIELDS_TAG;
+                    fields->length = 0;
+                } else if (c == '\n') {
+                    fields->state = FIELDS_LINE;
+                }
+                break;
+            case FIELDS_KEY:
+                if (c == ':') {
+                    fields->field = fields_lookup(fields, 1);
+                    fields->state = fields->field < EID_FIELDS
+                        ? FIELDS_SEPARATOR : FIELDS_TEXT;
+                } else if (c == '<') {
+                    fields->state = FIELDS_TAG;
+                    fields->length = 0;
+                } else if (c == '\n') {
+                    fields->state = FIELDS_LINE;
+                } else if (fields->length < sizeof fields->name) {
+                    fields->name[fields->length++] = c;
+                } else {
+                    fields->state = FIELDS_TEXT;
+                }
+                break;
+            case FIELDS_SEPARATOR:
+                fields->state = FIELDS_LINE_VALUE;
+                if (c != ' ')
+                    p--;
+                break;
+            case FIELDS_TAG:
+                if (c == '>') {
+                    fields->field = fields_lookup(fields, 0);
+                    fields->state = fields->field < EID_FIELDS
+                        ? FIELDS_VALUE : FIELDS_TEXT;
+                } else if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+                    fields->field = fields_lookup(fields, 0);
+                    fields->state = FIELDS_ATTRIBUTES;
+                    /* whether the element is empty, i.e. ends with "/>" */
+                    fields->length = 0;
+                } else if (c == ':') {
+                    /* ignore the namespace prefix */
+                    fields->length = 0;
+                } else if (c == '/' || c == '?' || c == '!'
+                        || fields->length >= sizeof fields->name) {
+                    fields->state = FIELDS_SKIP_TAG;
+                } else {
+                    fields->name[fields->length++] = c;
+                }
+                break;
+            case FIELDS_ATTRIBUTES:
+                if (c == '>') {
+                    fields->state = fields->field < EID_FIELDS
+                        && !fields->length ? FIELDS_VALUE : FIELDS_TEXT;
+                } else {
+                    fields->length = c == '/';
+                }
+                break;
+            case FIELDS_SKIP_TAG:
+                if (c == '>')
+                    fields->state = FIELDS_TEXT;
+                break;
+        }
+    }
+}
+
+void eid_fields_finish(struct eid_fields *fields)
+{
+    if (fields->state == FIELDS_VALUE || fields->state == FIELDS_LINE_VALUE)
+        fields_value(fields, "", 0, 1);
+    fields->state = FIELDS_LINE;
+}
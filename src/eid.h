@@ -1,14 +1,202 @@
+#ifndef _EID_PAM_EID_H
+#define _EID_PAM_EID_H
+
 #include <curl/curl.h>
+#include <openssl/evp.h>
+#include <pwd.h>
 #include <stdio.h>
 
-FILE *auth_fopen(const char *login, const char *mode);
-int auth_mkdir(const char *login);
+FILE *auth_fopen(const struct passwd *pw, const char *mode);
+int auth_mkdir(const struct passwd *pw);
+
+#define AUTH_DIGEST_LENGTH 32
+
+#define AUTH_REFERENCE_MAX 16
+#define AUTH_LABEL_MAX 64
+/* upper bound of a legacy reference, which is kept in memory */
+#define AUTH_REFERENCE_SIZE_MAX (1024*1024)
+
+/* The reference is either the raw response of the eService (legacy format)
+ * or up to AUTH_REFERENCE_MAX lines with the SHA-256 digest of a response,
+ * each optionally followed by a label. Multiple lines enroll e.g. a
+ * replacement card or several persons sharing an account. */
+struct auth_reference {
+    const unsigned char *data;
+    size_t length;
+    int digest;
+    size_t count;
+    unsigned char md[AUTH_REFERENCE_MAX][AUTH_DIGEST_LENGTH];
+    char label[AUTH_REFERENCE_MAX][AUTH_LABEL_MAX];
+};
+
+/* Loads the reference of the user into a private buffer */
+int auth_read_reference(const struct passwd *pw,
+        struct auth_reference *reference);
+void auth_reference_free(struct auth_reference *reference);
+/* Writes a single line of the reference, label may be NULL */
+int auth_write_entry(FILE *file, const unsigned char md[AUTH_DIGEST_LENGTH],
+        const char *label);
+/* Parses a line written by auth_write_entry() */
+int auth_read_entry(const char *line, unsigned char md[AUTH_DIGEST_LENGTH],
+        char label[AUTH_LABEL_MAX]);
+/* Writes all digests of the reference with their labels */
+int auth_write_reference(FILE *file, const struct auth_reference *reference);
+/* Parses a line written by auth_write_entry() without a label */
+int auth_read_digest(const unsigned char *data, size_t len,
+        unsigned char md[AUTH_DIGEST_LENGTH]);
+/* Converts a legacy reference into its digest */
+int auth_reference_upgrade(struct auth_reference *reference);
+/* Adds a digest, returns 0 if the reference is full */
+int auth_reference_add(struct auth_reference *reference,
+        const unsigned char md[AUTH_DIGEST_LENGTH], const char *label);
+/* Identifies the set of enrolled responses */
+int auth_fingerprint(const struct auth_reference *reference,
+        unsigned char md[AUTH_DIGEST_LENGTH]);
+/* Returns 1 if md is one of the enrolled digests */
+int auth_reference_match(const struct auth_reference *reference,
+        const unsigned char md[AUTH_DIGEST_LENGTH]);
+
+EVP_MD_CTX *auth_digest_new(void);
+int auth_digest_final(EVP_MD_CTX *ctx, unsigned char md[AUTH_DIGEST_LENGTH]);
+
+extern const char action_status[];
+extern const char action_settings[];
+extern const char action_pinmanagement[];
+extern const char action_eid_ok[];
+
+/* libcurl 7.40.0 is the first version to support UNIX domain sockets */
+#if LIBCURL_VERSION_NUM >= 0x072800
+#define HAVE_UNIX_SOCKET 1
+#endif
+
+/* Where the eID client listens: the base URL, e.g. http://127.0.0.1:24727,
+ * and optionally a UNIX domain socket to connect to instead of the host */
+struct client_endpoint {
+    const char *url;
+    const char *socket;
+};
+
+/* http://127.0.0.1:24727, the default of AusweisApp2 and Open eCard App */
+extern const struct client_endpoint client_endpoint_default;
+
+/* Parses "http://host:port" or "unix:/path/to/socket". arg must stay valid
+ * as long as the endpoint is used. Returns 0 if it is invalid or UNIX domain
+ * sockets aren't supported by libcurl. */
+int client_endpoint_set(struct client_endpoint *endpoint, const char *arg);
+
+/* Only sets the URL of the action, e.g. for a multi handle */
+void client_endpoint_prepare(CURL *curl,
+        const struct client_endpoint *endpoint, const char *action);
+/* Starts the authentication with the TC token of the given eService */
+void client_eid_prepare(CURL *curl, const struct client_endpoint *endpoint,
+        const char *tctoken_url);
+
+/* "sha256//" followed by the base64 encoded SHA-256 hash */
+#define CLIENT_PIN_LENGTH (8 + 44 + 1)
+
+struct client_pubkey {
+    int pinned;
+    char pin[CLIENT_PIN_LENGTH];
+    unsigned char md[AUTH_DIGEST_LENGTH];
+};
+
+int client_pubkey_load(const struct passwd *pw, struct client_pubkey *pubkey);
+/* Pins the key with the given SHA-256 hash of its SubjectPublicKeyInfo */
+void client_pubkey_set(struct client_pubkey *pubkey,
+        const unsigned char md[AUTH_DIGEST_LENGTH]);
+/* Parses a pin in the format of libcurl, "sha256//" and the base64 encoded
+ * hash */
+int client_pubkey_parse(struct client_pubkey *pubkey, const char *pin);
+/* Pins the key if one is set, otherwise accepts any key */
+void client_pubkeypinning(CURL *curl, const struct client_pubkey *pubkey);
+
+/* AusweisAuskunft of autentapp.de, the eService used by default */
+extern const char eid_tctoken_url_default[];
+
+/* libcurl 7.62.0 is the first version with the URL API */
+#if LIBCURL_VERSION_NUM >= 0x073e00
+#define HAVE_CURL_URL 1
+#endif
+
+#define EID_URL_MAX 256
+
+/* Scheme, host and port of an eService, whose responses are trusted if they
+ * come from exactly this origin, optionally with a pinned key */
+struct eid_origin {
+    /* "https://host" with ":port" unless it is 443 */
+    char name[EID_URL_MAX + 16];
+    char host[EID_URL_MAX];
+    long port;
+    struct client_pubkey pubkey;
+};
+
+/* Parses the origin of an https URL. Returns 0 for other URLs. */
+int eid_origin_parse(struct eid_origin *origin, const char *url);
+/* Parses an https URL optionally followed by "," and a pin, see
+ * client_pubkey_parse() */
+int eid_origin_set(struct eid_origin *origin, const char *arg);
+/* Returns the origin of url if it is one of the given origins, NULL if it
+ * isn't or url can't be parsed */
+const struct eid_origin *eid_origin_match(const struct eid_origin *origins,
+        size_t count, const char *url);
+
+#define EID_MATCH_MAX 128
+
+/* Incremental substring search (Knuth-Morris-Pratt), which finds a needle
+ * even if it is split across multiple chunks of a stream */
+struct eid_match {
+    const char *needle;
+    size_t length;
+    size_t matched;
+    int found;
+    unsigned char fallback[EID_MATCH_MAX];
+};
+
+int eid_match_init(struct eid_match *match, const char *needle);
+int eid_match_update(struct eid_match *match, const void *data, size_t count);
+
+enum eid_field {
+    EID_FIELD_GIVEN_NAMES,
+    EID_FIELD_FAMILY_NAMES,
+    EID_FIELD_DATE_OF_BIRTH,
+    EID_FIELD_DATE_OF_EXPIRY,
+    EID_FIELD_RESTRICTED_ID,
+    /* name of the eID client in its status response */
+    EID_FIELD_CLIENT_NAME,
+    EID_FIELDS
+};
+
+#define EID_FIELD(field) (1u << (field))
+#define EID_FIELD_NAME_MAX 32
+
+/* Receives the value of a field in pieces, which point into the chunks passed
+ * to eid_fields_update(). The last piece has final set. */
+typedef void (*eid_field_cb)(void *ctx, enum eid_field field,
+        const char *data, size_t length, int final);
+
+/* Single pass tokenizer, which extracts the wanted fields from the XML
+ * response of the eService ("<ns:Tag>value</ns:Tag>") or from the plain text
+ * status of the eID client ("Key: value") while the response is streamed.
+ * Only the first occurrence of each field is reported. */
+struct eid_fields {
+    unsigned int wanted;
+    unsigned int seen;
+    eid_field_cb cb;
+    void *ctx;
+    /* whether a "Key: value" line may still be of interest */
+    int keys;
+    int state;
+    enum eid_field field;
+    size_t length;
+    char name[EID_FIELD_NAME_MAX];
+};
 
-const char action_status[] = "Status";
-const char action_settings[] = "ShowUI=Settings";
-const char action_pinmanagement[] = "ShowUI=PINManagement";
-const char action_eid[] = "tcTokenURL=https://www.autentapp.de/AusweisAuskunft/WebServiceRequesterServlet?mode=xml";
-const char action_eid_ok[] = "<ns3:ResultMajor>http://www.bsi.bund.de/ecard/api/1.1/resultmajor#ok</ns3:ResultMajor>";
+void eid_fields_init(struct eid_fields *fields, unsigned int wanted,
+        eid_field_cb cb, void *ctx);
+void eid_fields_update(struct eid_fields *fields, const void *data,
+        size_t count);
+/* Ends a value at the end of the stream, e.g. a status without a final line
+ * break */
+void eid_fields_finish(struct eid_fields *fields);
 
-int client_action(CURL *curl, const char *action);
-void client_pubkeypinning(CURL *curl, const char *login);
+#endif
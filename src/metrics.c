@@ -0,0 +1,197 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "metrics.h"
+#include "auth_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const unsigned char metrics_magic[8] = "EIDMETR1";
+
+struct metrics_file {
+    unsigned char magic[8];
+    struct metrics metrics;
+};
+
+static const char *const entry_names[METRICS_ENTRIES] = {
+    "authenticate",
+    "chauthtok",
+};
+
+static const char *const reason_names[METRICS_REASONS] = {
+    "none",
+    "unknown_user",
+    "reference",
+    "mismatch",
+    "timeout",
+    "queue",
+    "client",
+    "service",
+    "no_result",
+    "other",
+};
+
+const char *metrics_entry_name(unsigned int entry)
+{
+    return entry < METRICS_ENTRIES ? entry_names[entry] : "unknown";
+}
+
+const char *metrics_reason_name(unsigned int reason)
+{
+    return reason < METRICS_REASONS ? reason_names[reason] : "unknown";
+}
+
+uint64_t metrics_bucket_bound(unsigned int bucket)
+{
+    return bucket + 1 < METRICS_BUCKETS ? (uint64_t) 1000 << bucket : 0;
+}
+
+static int open_metrics(const char *dir, int create)
+{
+    int dirfd, fd;
+
+    dirfd = auth_cache_open_dir(dir, create);
+    if (dirfd < 0)
+        return -1;
+
+    fd = openat(dirfd, "metrics",
+            (create ? O_RDWR|O_CREAT : O_RDONLY)|O_NOFOLLOW|O_CLOEXEC, 0644);
+    if (fd >= 0 && !auth_cache_trusted_fd(fd, S_IFREG)) {
+        close(fd);
+        fd = -1;
+    }
+    close(dirfd);
+
+    return fd;
+}
+
+/* overwrites the file with zeros in place; other processes may have mapped
+ * it and get SIGBUS if it shrinks under them */
+static int clear_metrics(int fd, size_t size)
+{
+    static const unsigned char zeros[4096];
+    size_t offset, n;
+
+    for (offset = 0; offset < size; offset += n) {
+        n = size - offset < sizeof zeros ? size - offset : sizeof zeros;
+        if (pwrite(fd, zeros, n, offset) != (ssize_t) n)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* (re)initializes the file if it has a different format */
+static int init_metrics(int fd)
+{
+    struct stat sb;
+    unsigned char magic[sizeof metrics_magic];
+    int ok = 0;
+
+    if (0 == fstat(fd, &sb)
+            && (size_t) sb.st_size == sizeof(struct metrics_file)
+            && pread(fd, magic, sizeof magic, 0) == sizeof magic
+            && 0 == memcmp(magic, metrics_magic, sizeof magic))
+        return 1;
+
+    while (0 != flock(fd, LOCK_EX)) {
+        if (errno != EINTR)
+            return 0;
+    }
+    /* check again, someone else may have been faster */
+    if (0 != fstat(fd, &sb)) {
+        ok = 0;
+    } else if ((size_t) sb.st_size == sizeof(struct metrics_file)
+            && pread(fd, magic, sizeof magic, 0) == sizeof magic
+            && 0 == memcmp(magic, metrics_magic, sizeof magic)) {
+        ok = 1;
+    } else if (((size_t) sb.st_size == sizeof(struct metrics_file)
+                ? clear_metrics(fd, sizeof(struct metrics_file))
+                : 0 == ftruncate(fd, 0)
+                    && 0 == ftruncate(fd, sizeof(struct metrics_file)))
+            && pwrite(fd, metrics_magic, sizeof metrics_magic, 0)
+                == sizeof metrics_magic) {
+        ok = 1;
+    }
+    flock(fd, LOCK_UN);
+
+    return ok;
+}
+
+static unsigned int bucket(uint64_t duration)
+{
+    unsigned int i;
+
+    for (i = 0; i + 1 < METRICS_BUCKETS; i++) {
+        if (duration <= metrics_bucket_bound(i))
+            break;
+    }
+
+    return i;
+}
+
+void metrics_record(const char *dir, enum metrics_entry entry, int result,
+        enum metrics_reason reason, uint64_t duration)
+{
+    struct metrics_file *file;
+    struct metrics_histogram *latency;
+    int fd;
+
+    if (entry >= METRICS_ENTRIES)
+        return;
+    if (result < 0 || result >= METRICS_RESULTS)
+        result = METRICS_RESULTS - 1;
+    if (reason >= METRICS_REASONS)
+        reason = METRICS_REASON_OTHER;
+
+    fd = open_metrics(dir, 1);
+    if (fd < 0)
+        return;
+    if (!init_metrics(fd)) {
+        close(fd);
+        return;
+    }
+    file = mmap(NULL, sizeof *file, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == file)
+        return;
+
+    latency = &file->metrics.latency[entry];
+    __atomic_add_fetch(&file->metrics.results[entry][result], 1,
+            __ATOMIC_RELAXED);
+    __atomic_add_fetch(&file->metrics.reasons[entry][reason], 1,
+            __ATOMIC_RELAXED);
+    __atomic_add_fetch(&latency->buckets[bucket(duration)], 1,
+            __ATOMIC_RELAXED);
+    __atomic_add_fetch(&latency->sum, duration, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&latency->count, 1, __ATOMIC_RELAXED);
+
+    munmap(file, sizeof *file);
+}
+
+int metrics_get(const char *dir, struct metrics *metrics)
+{
+    struct metrics_file file;
+    int fd, ok = 0;
+
+    memset(metrics, 0, sizeof *metrics);
+
+    fd = open_metrics(dir, 0);
+    if (fd < 0)
+        return 0;
+
+    if (pread(fd, &file, sizeof file, 0) == sizeof file
+            && 0 == memcmp(file.magic, metrics_magic, sizeof file.magic)) {
+        *metrics = file.metrics;
+        ok = 1;
+    }
+    close(fd);
+
+    return ok;
+}
@@ -0,0 +1,62 @@
+#ifndef _EID_PAM_METRICS_H
+#define _EID_PAM_METRICS_H
+
+#include <stdint.h>
+
+/* Counters and latency histograms of all authentications, kept in a file
+ * below the runtime directory which all processes map and update with
+ * atomic operations. eid-pam-metrics exports them for Prometheus. */
+
+enum metrics_entry {
+    METRICS_AUTHENTICATE,
+    METRICS_CHAUTHTOK,
+    METRICS_ENTRIES,
+};
+
+enum metrics_reason {
+    METRICS_REASON_NONE,
+    METRICS_REASON_USER,
+    METRICS_REASON_REFERENCE,
+    METRICS_REASON_MISMATCH,
+    METRICS_REASON_TIMEOUT,
+    METRICS_REASON_QUEUE,
+    METRICS_REASON_CLIENT,
+    METRICS_REASON_SERVICE,
+    METRICS_REASON_NO_RESULT,
+    METRICS_REASON_OTHER,
+    METRICS_REASONS,
+};
+
+/* PAM status codes, larger ones are counted as the last one */
+#define METRICS_RESULTS 32
+/* upper bounds of 1 ms, 2 ms, ..., 32.768 s and +Inf */
+#define METRICS_BUCKETS 17
+
+struct metrics_histogram {
+    uint64_t buckets[METRICS_BUCKETS];
+    /* in microseconds */
+    uint64_t sum;
+    uint64_t count;
+};
+
+struct metrics {
+    uint64_t results[METRICS_ENTRIES][METRICS_RESULTS];
+    uint64_t reasons[METRICS_ENTRIES][METRICS_REASONS];
+    struct metrics_histogram latency[METRICS_ENTRIES];
+};
+
+/* Counts an authentication (or PIN management) that took duration
+ * microseconds. Errors are ignored. */
+void metrics_record(const char *dir, enum metrics_entry entry, int result,
+        enum metrics_reason reason, uint64_t duration);
+
+/* Returns 0 if nothing has been recorded in dir */
+int metrics_get(const char *dir, struct metrics *metrics);
+
+const char *metrics_entry_name(unsigned int entry);
+const char *metrics_reason_name(unsigned int reason);
+
+/* upper bound of the bucket in microseconds, 0 for +Inf */
+uint64_t metrics_bucket_bound(unsigned int bucket);
+
+#endif
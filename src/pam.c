@@ -7,11 +7,18 @@
 #endif
 
 #include "eid.h"
-#include "drop_privs.h"
+#include "authenticate.h"
+#include "broker.h"
+#include "client_health.h"
+#include "curl_pool.h"
+#include "metrics.h"
+#include <pwd.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <syslog.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 /* We have to make this definitions before we include the pam header files! */
 #define PAM_SM_AUTH
@@ -32,16 +39,34 @@
 #endif
 
 struct module_data {
+	/* only acquired if we need to talk to the eID client ourselves */
 	CURL *curl;
+	struct auth_options options;
+	const char *broker;
+	/* must match the options of the broker, see broker_options_add() */
+	char broker_options[BROKER_OPTIONS_MAX];
+	/* return PAM_INCOMPLETE instead of waiting */
+	int nonblocking;
+	/* pending authentication, either in-process or with the broker */
+	struct auth_flow *flow;
+	int broker_fd;
+	struct auth_deadline deadline;
+	/* eID client that answered before, e.g. in PAM_PRELIM_CHECK */
+	const struct client_endpoint *client;
 };
 
 void module_data_cleanup(pam_handle_t *pamh, void *data, int error_status)
 {
 	struct module_data *module_data = data;
 	if (module_data) {
+		auth_flow_free(module_data->flow);
+		if (module_data->broker_fd >= 0) {
+			close(module_data->broker_fd);
+		}
 		if (module_data->curl) {
-			curl_easy_cleanup(module_data->curl);
+			curl_pool_release(module_data->curl);
 		}
+		auth_options_free(&module_data->options);
 		free(module_data);
 	}
 }
@@ -50,7 +75,7 @@ static int module_initialize(pam_handle_t * pamh,
 		int flags, int argc, const char **argv,
 		struct module_data **module_data)
 {
-	int r;
+	int r, i, too_long = 0;
 	struct module_data *data = calloc(1, sizeof *data);
 	if (NULL == data) {
 		pam_syslog(pamh, LOG_CRIT, "calloc() failed: %s",
@@ -59,9 +84,24 @@ static int module_initialize(pam_handle_t * pamh,
 		goto err;
 	}
 
-	data->curl = curl_easy_init();
-	if (NULL == data->curl) {
-		goto err;
+	auth_options_init(&data->options);
+	data->broker = BROKER_SOCKET;
+	data->broker_fd = -1;
+	for (i = 0; i < argc; i++) {
+		if (0 == strncmp(argv[i], "broker=", 7)) {
+			data->broker = argv[i] + 7;
+		} else if (0 == strcmp(argv[i], "nonblocking")) {
+			data->nonblocking = 1;
+		} else if (!auth_options_set(pamh, &data->options, argv[i])) {
+			pam_syslog(pamh, LOG_ERR, "invalid option %s", argv[i]);
+		} else if (!broker_options_add(data->broker_options, argv[i])) {
+			too_long = 1;
+		}
+	}
+	if (too_long) {
+		pam_syslog(pamh, LOG_WARNING,
+				"Too many options for the broker, authenticating in-process");
+		data->broker = NULL;
 	}
 
 	r = pam_set_data(pamh, PACKAGE, data, module_data_cleanup);
@@ -80,7 +120,7 @@ err:
 
 static int module_refresh(pam_handle_t *pamh,
 		int flags, int argc, const char **argv,
-		const char **user, CURL **curl)
+		const char **user, struct module_data **data)
 {
 	int r;
 	struct module_data *module_data;
@@ -101,143 +141,165 @@ static int module_refresh(pam_handle_t *pamh,
 		goto err;
 	}
 
-	*curl = module_data->curl;
+	*data = module_data;
 
 err:
 	return r;
 }
 
-struct file_status {
-	FILE *file;
-	int ok;
+static CURL *module_curl(struct module_data *module_data)
+{
+	if (!module_data->curl) {
+		module_data->curl = curl_pool_acquire();
+		if (module_data->curl) {
+			auth_options_apply(&module_data->options, module_data->curl);
+		}
+	}
+
+	return module_data->curl;
+}
+
+struct module_status {
+	pam_handle_t *pamh;
+	struct eid_fields fields;
+	char name[64];
+	size_t length;
 };
 
-static size_t
-auth_compare(void *contents, size_t size, size_t nmemb, void *userp)
+static void module_client_name(void *ctx, enum eid_field field,
+		const char *data, size_t length, int final)
 {
-	size_t consumed = 0;
-	struct file_status *status = (struct file_status *)userp;
+	struct module_status *status = ctx;
 
-	if (status->ok == 0) {
-		/* we already know that the received data doesn't match */
-		consumed = size*nmemb;
-		goto err;
+	if (length > sizeof status->name - status->length) {
+		length = sizeof status->name - status->length;
 	}
+	memcpy(status->name + status->length, data, length);
+	status->length += length;
 
-	char *buf = calloc(nmemb, size);
-	if (!buf)
-		goto err;
+	if (final) {
+		pam_syslog(status->pamh, LOG_DEBUG, "Connected to %.*s",
+				(int) status->length, status->name);
+	}
+}
+
+/* consumes the eID client's response instead of writing it to stdout */
+static size_t
+module_status_write(void *contents, size_t size, size_t nmemb, void *userp)
+{
+	struct module_status *status = (struct module_status *)userp;
 
-	consumed = fread(buf, size, nmemb, status->file);
+	eid_fields_update(&status->fields, contents, size*nmemb);
 
-	if (0 != memcmp(buf, contents, consumed)) {
-		/* the received data doesn't match */
-		status->ok = 0;
-		goto err;
-	}
+	return size*nmemb;
+}
 
-	if (strstr(buf, action_eid_ok)) {
-		status->ok = 1;
+/* shows a message to the user */
+static void module_info(void *ctx, const char *message)
+{
+	pam_handle_t *pamh = ctx;
+	const struct pam_conv *conv = NULL;
+	struct pam_message msg = {PAM_TEXT_INFO, message};
+	const struct pam_message *msgp = &msg;
+	struct pam_response *resp = NULL;
+
+	if (PAM_SUCCESS != pam_get_item(pamh, PAM_CONV, (const void **)&conv)
+			|| NULL == conv || NULL == conv->conv) {
+		return;
 	}
 
-err:
-	free(buf);
-
-	return consumed;
+	if (PAM_SUCCESS == conv->conv(1, &msgp, &resp, conv->appdata_ptr)
+			&& resp) {
+		free(resp->resp);
+		free(resp);
+	}
 }
 
 PAM_EXTERN int pam_sm_authenticate(pam_handle_t * pamh, int flags, int argc,
 		const char **argv)
 {
-	int r;
+	int r, received;
 	CURL *curl;
-	struct file_status status = {NULL, -1};
-	const char *user;
-	struct passwd *passwd = NULL;
-	PAM_MODUTIL_DEF_PRIVS(privs);
-	long disable = 0;
+	struct module_data *module_data;
+	struct auth_request request;
+	const void *tty = NULL;
 
 	r = module_refresh(pamh, flags, argc, argv,
-			&user, &curl);
+			&request.user, &module_data);
 	if (PAM_SUCCESS != r) {
 		goto err;
 	}
 
-	passwd = getpwnam(user);
-	if (!passwd) {
-		pam_syslog(pamh, LOG_CRIT, "getpwnam() failed: %s",
-				strerror(errno));
-		r = PAM_SERVICE_ERR;
-		goto err;
+	if (PAM_SUCCESS != pam_get_item(pamh, PAM_TTY, &tty)) {
+		tty = NULL;
 	}
-
-	if (pam_modutil_drop_priv(pamh, &privs, passwd)) {
-		r = PAM_SERVICE_ERR;
-		goto err;
+	request.tty = tty;
+	request.sid = getsid(0);
+	/* e.g. the user calling sudo */
+	request.uid = getuid();
+	request.info = module_info;
+	request.info_ctx = pamh;
+	request.client = module_data->client;
+
+	if (module_data->broker_fd >= 0 || module_data->flow) {
+		/* the application calls us again after PAM_INCOMPLETE */
+		goto resume;
 	}
 
-	status.file = auth_fopen(user, "rb");
-	if (!status.file) {
-		r = PAM_SERVICE_ERR;
-		pam_modutil_regain_priv(pamh, &privs);
-		goto err;
+	auth_deadline_start(&module_data->deadline, &module_data->options);
+	/* give the broker some slack for its own deadline */
+	module_data->deadline.end.tv_sec += BROKER_TIMEOUT_SLACK;
+	module_data->broker_fd = broker_connect(pamh, module_data->broker,
+			module_data->broker_options, &request,
+			module_data->options.timeout);
+	if (module_data->broker_fd >= 0) {
+		goto resume;
 	}
 
-	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, &disable);
-	if (1 == client_action(curl, action_eid)) {
-		char *url = NULL;
-		long code;
-		while (CURLE_OK == curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code)
-				&& 300 <= code && code < 400
-				&& CURLE_OK == curl_easy_getinfo(curl, CURLINFO_REDIRECT_URL, &url)
-				&& url) {
-			/* follow redirects manually to make sure that we get authenticated
-			 * data exclusively from https://www.autentapp.de, which we use as
-			 * trusted source for comparison against the reference data */
-			if (strstr(url, "https://www.autentapp.de")) {
-				curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, auth_compare);
-				curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&status);
-				client_pubkeypinning(curl, user);
-			}
-			curl_easy_setopt(curl, CURLOPT_URL, url);
-			if (CURLE_OK != curl_easy_perform(curl)) {
-				break;
-			}
-			curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, NULL);
-			curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
-		}
+in_process:
+	module_data->flow = auth_flow_new(pamh, &module_data->options,
+			&request, &r);
+	if (!module_data->flow) {
+		goto err;
 	}
 
-	switch(status.ok) {
-		case 1:
-			if (feof(status.file)) {
-				/* we received the correct data *and* all of our reference data
-				 * has been consumed */
-				r = PAM_SUCCESS;
-				break;
+resume:
+	if (module_data->broker_fd >= 0) {
+		received = broker_receive(pamh, module_data->broker_fd, &request,
+				!module_data->nonblocking, &r);
+		if (received) {
+			module_data->broker_fd = -1;
+			if (received < 0) {
+				/* the broker runs with other options than ours */
+				goto in_process;
 			}
-			/* fall through */
-		case 0:
-			r = PAM_AUTH_ERR;
-			break;
-		default:
+		} else if (auth_deadline_remaining(&module_data->deadline) > 0) {
+			r = PAM_INCOMPLETE;
+		} else {
+			pam_syslog(pamh, LOG_ERR, "Timeout while waiting for the broker");
+			close(module_data->broker_fd);
+			module_data->broker_fd = -1;
 			r = PAM_AUTHINFO_UNAVAIL;
-			break;
-	}
-
-	if (pam_modutil_regain_priv(pamh, &privs)) {
-		r = PAM_SESSION_ERR;
+		}
 		goto err;
 	}
 
-err:
-	if (passwd) {
-		free(passwd);
+	curl = module_curl(module_data);
+	if (!curl) {
+		r = PAM_BUF_ERR;
+	} else {
+		r = auth_flow_run(pamh, module_data->flow, curl,
+				!module_data->nonblocking);
 	}
-	if (status.file) {
-		fclose(status.file);
+	if (PAM_INCOMPLETE != r) {
+		if (auth_flow_client(module_data->flow)) {
+			module_data->client = auth_flow_client(module_data->flow);
+		}
+		auth_flow_free(module_data->flow);
+		module_data->flow = NULL;
 	}
 
+err:
 	return r;
 }
 
@@ -277,9 +339,19 @@ PAM_EXTERN int pam_sm_chauthtok(pam_handle_t * pamh, int flags, int argc,
 	const char *user;
 	const char *action;
 	CURL *curl;
+	struct module_data *module_data;
+	struct auth_request request = {NULL};
+	struct reader_queue queue = {-1};
+	struct auth_deadline deadline;
+	struct module_status status = {pamh};
+	struct client_health health;
+	struct timespec start, end;
+	enum metrics_reason reason = METRICS_REASON_OTHER;
+	CURLcode e = CURLE_OK;
+	int ok, cached;
 
 	r = module_refresh(pamh, flags, argc, argv,
-			&user, &curl);
+			&user, &module_data);
 	if (PAM_SUCCESS != r) {
 		goto err;
 	}
@@ -294,18 +366,107 @@ PAM_EXTERN int pam_sm_chauthtok(pam_handle_t * pamh, int flags, int argc,
 		action = action_status;
 	}
 
-	if (1 != client_action(curl, action)) {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	cached = module_data->options.client_ttl > 0
+		&& 1 == client_health_check(module_data->options.cache_dir,
+				module_data->options.client_ttl, &health);
+	if (cached && !health.reachable) {
+		pam_syslog(pamh, LOG_ERR, "eID client was not reachable recently");
 		r = PAM_AUTHINFO_UNAVAIL;
-		goto err;
+		reason = METRICS_REASON_CLIENT;
+		goto count;
+	}
+	if (cached && action == action_status) {
+		/* the client answered a Status request a moment ago, e.g. in the
+		 * PAM_PRELIM_CHECK of another chauthtok */
+		pam_syslog(pamh, LOG_DEBUG, "Connected to %s",
+				*health.name ? health.name : "unknown eID client");
+		ok = 1;
+		goto checked;
+	}
+
+	curl = module_curl(module_data);
+	if (!curl) {
+		r = PAM_BUF_ERR;
+		goto count;
+	}
+
+	auth_deadline_start(&deadline, &module_data->options);
+	if (!module_data->client) {
+		module_data->client = auth_client_select(pamh,
+				&module_data->options, &deadline);
+		if (!module_data->client) {
+			r = PAM_AUTHINFO_UNAVAIL;
+			reason = METRICS_REASON_CLIENT;
+			goto count;
+		}
+	}
+	if (action == action_pinmanagement) {
+		/* the PIN change needs the card reader */
+		request.user = user;
+		request.uid = getuid();
+		request.info = module_info;
+		request.info_ctx = pamh;
+		r = auth_queue_enter(pamh, &module_data->options, &request,
+				&deadline, &queue);
+		if (PAM_SUCCESS != r) {
+			reason = METRICS_REASON_QUEUE;
+			goto count;
+		}
+	}
+
+	eid_fields_init(&status.fields, action == action_status
+			? EID_FIELD(EID_FIELD_CLIENT_NAME) : 0,
+			module_client_name, &status);
+	ok = auth_deadline_budget(pamh, &deadline, curl, 1, 1);
+	if (ok) {
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, module_status_write);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&status);
+		client_endpoint_prepare(curl, module_data->client, action);
+		e = curl_easy_perform(curl);
+		ok = CURLE_OK == e;
+		eid_fields_finish(&status.fields);
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, NULL);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+		reason = METRICS_REASON_CLIENT;
+	} else {
+		reason = METRICS_REASON_TIMEOUT;
+	}
+	reader_queue_leave(&queue);
+	if (module_data->options.client_ttl > 0
+			&& ((ok && action == action_status)
+				|| CURLE_COULDNT_CONNECT == e)) {
+		memset(&health, 0, sizeof health);
+		health.reachable = ok;
+		if (status.length < sizeof health.name) {
+			memcpy(health.name, status.name, status.length);
+		}
+		client_health_store(pamh, module_data->options.cache_dir, &health);
+	}
+
+checked:
+	if (1 != ok) {
+		r = PAM_AUTHINFO_UNAVAIL;
+		goto count;
 	}
 
 	if (flags & PAM_PRELIM_CHECK) {
 		r = PAM_TRY_AGAIN;
-		goto err;
+		goto count;
 	}
 
 	r = PAM_SUCCESS;
 
+count:
+	if (module_data->options.metrics) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		metrics_record(module_data->options.cache_dir, METRICS_CHAUTHTOK, r,
+				PAM_SUCCESS == r || PAM_TRY_AGAIN == r
+				? METRICS_REASON_NONE : reason,
+				(end.tv_sec - start.tv_sec) * 1000000
+				+ (end.tv_nsec - start.tv_nsec) / 1000);
+	}
+
 err:
 	return r;
 }
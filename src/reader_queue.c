@@ -0,0 +1,381 @@
+/* for F_OFD_SETLK */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "reader_queue.h"
+#include "auth_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <security/pam_modules.h>
+#ifdef HAVE_SECURITY_PAM_EXT_H
+#include <security/pam_ext.h>
+#else
+#define pam_syslog(handle, level, msg...) syslog(level, ## msg)
+#endif
+
+/* interval for checking our position in milliseconds */
+#define READER_QUEUE_POLL 20
+
+static const unsigned char reader_queue_magic[8] = "EIDQUEU2";
+
+struct reader_queue_waiter {
+    uint64_t ticket;
+    int32_t pid;
+    /* real user ID of the requesting process */
+    uint32_t uid;
+    /* byte behind the state which the waiter keeps locked */
+    uint32_t slot;
+    uint32_t reserved;
+};
+
+/* only accessed with the file locked */
+struct reader_queue_state {
+    unsigned char magic[8];
+    uint64_t next_ticket;
+    struct reader_queue_stats stats;
+    struct reader_queue_waiter waiters[READER_QUEUE_MAX];
+};
+
+static int open_state(const char *dir, int create)
+{
+    int dirfd, fd;
+
+    dirfd = auth_cache_open_dir(dir, create);
+    if (dirfd < 0)
+        return -1;
+
+    fd = openat(dirfd, "queue", O_RDWR|(create ? O_CREAT : 0)|O_NOFOLLOW|O_CLOEXEC,
+            0644);
+    if (fd >= 0 && !auth_cache_trusted_fd(fd, S_IFREG)) {
+        close(fd);
+        fd = -1;
+    }
+    close(dirfd);
+
+    return fd;
+}
+
+static int lock_state(int fd, struct reader_queue_state *state)
+{
+    while (0 != flock(fd, LOCK_EX)) {
+        if (errno != EINTR)
+            return 0;
+    }
+
+    if (pread(fd, state, sizeof *state, 0) != sizeof *state
+            || 0 != memcmp(state->magic, reader_queue_magic,
+                sizeof state->magic)) {
+        memset(state, 0, sizeof *state);
+        memcpy(state->magic, reader_queue_magic, sizeof state->magic);
+    }
+
+    return 1;
+}
+
+static void unlock_state(int fd, const struct reader_queue_state *state)
+{
+    if (pwrite(fd, state, sizeof *state, 0) != sizeof *state) {
+        /* the next one reinitializes the queue */
+    }
+    flock(fd, LOCK_UN);
+}
+
+static void remove_waiter(struct reader_queue_state *state, uint32_t i)
+{
+    memmove(&state->waiters[i], &state->waiters[i + 1],
+            (state->stats.depth - i - 1) * sizeof *state->waiters);
+    state->stats.depth--;
+}
+
+#ifdef F_OFD_SETLK
+/* Each waiter locks a byte behind the state through its own open file
+ * description. The kernel releases the lock when the waiter leaves or goes
+ * away, which also tells apart the threads of eid-pamd. */
+static int lock_slot(int fd, uint32_t slot, int cmd, struct flock *fl)
+{
+    memset(fl, 0, sizeof *fl);
+    fl->l_type = F_WRLCK;
+    fl->l_whence = SEEK_SET;
+    fl->l_start = sizeof(struct reader_queue_state) + slot;
+    fl->l_len = 1;
+
+    return 0 == fcntl(fd, cmd, fl);
+}
+
+static int take_slot(int fd, uint32_t slot)
+{
+    struct flock fl;
+
+    return lock_slot(fd, slot, F_OFD_SETLK, &fl);
+}
+
+static int alive(int fd, const struct reader_queue_waiter *waiter)
+{
+    struct flock fl;
+
+    /* keep the waiter if in doubt */
+    return !lock_slot(fd, waiter->slot, F_OFD_GETLK, &fl)
+        || fl.l_type != F_UNLCK;
+}
+#else
+static int take_slot(int fd, uint32_t slot)
+{
+    return 1;
+}
+
+static int alive(int fd, const struct reader_queue_waiter *waiter)
+{
+    return 0 == kill(waiter->pid, 0) || errno != ESRCH;
+}
+#endif
+
+/* removes the waiters which are gone, except for our own, whose lock doesn't
+ * conflict with itself */
+static void purge(int fd, struct reader_queue_state *state, uint64_t ticket)
+{
+    uint32_t i = 0;
+
+    if (state->stats.depth > READER_QUEUE_MAX)
+        state->stats.depth = READER_QUEUE_MAX;
+
+    while (i < state->stats.depth) {
+        if (state->waiters[i].ticket != ticket
+                && !alive(fd, &state->waiters[i]))
+            remove_waiter(state, i);
+        else
+            i++;
+    }
+}
+
+/* returns the first free slot which we could lock, -1 if there is none */
+static int64_t claim_slot(int fd, const struct reader_queue_state *state)
+{
+    uint32_t slot, i;
+
+    for (slot = 0; slot < READER_QUEUE_MAX; slot++) {
+        for (i = 0; i < state->stats.depth; i++) {
+            if (state->waiters[i].slot == slot)
+                break;
+        }
+        /* a waiter of a reset queue may still hold the lock */
+        if (i == state->stats.depth && take_slot(fd, slot))
+            return slot;
+    }
+
+    return -1;
+}
+
+static int find(const struct reader_queue_state *state, uint64_t ticket)
+{
+    uint32_t i;
+
+    for (i = 0; i < state->stats.depth; i++) {
+        if (state->waiters[i].ticket == ticket)
+            return i;
+    }
+
+    return -1;
+}
+
+static long ms_since(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1000
+        + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+int reader_queue_join(pam_handle_t *pamh, const char *dir, long max_wait,
+        uid_t uid, struct reader_queue *queue)
+{
+    struct reader_queue_state state;
+    struct reader_queue_waiter *waiter;
+    int64_t slot = -1;
+    uint32_t i, waiting = 0;
+
+    queue->fd = -1;
+    queue->max_wait = max_wait;
+    queue->position = 0;
+    clock_gettime(CLOCK_MONOTONIC, &queue->start);
+    if (max_wait <= 0)
+        return PAM_SUCCESS;
+
+    queue->fd = open_state(dir, 1);
+    if (queue->fd < 0)
+        return PAM_SUCCESS;
+
+    if (!lock_state(queue->fd, &state))
+        goto err;
+    purge(queue->fd, &state, 0);
+    for (i = 0; i < state.stats.depth; i++) {
+        if (state.waiters[i].uid == (uint32_t) uid)
+            waiting++;
+    }
+    if (waiting >= READER_QUEUE_PER_UID) {
+        flock(queue->fd, LOCK_UN);
+        pam_syslog(pamh, LOG_ERR, "Too many authentications of uid %ld are "
+                "waiting for the card reader", (long) uid);
+        goto full;
+    }
+    if (state.stats.depth < READER_QUEUE_MAX)
+        slot = claim_slot(queue->fd, &state);
+    if (slot < 0) {
+        flock(queue->fd, LOCK_UN);
+        pam_syslog(pamh, LOG_ERR, "Too many authentications are waiting "
+                "for the card reader");
+        goto full;
+    }
+    queue->ticket = ++state.next_ticket;
+    waiter = &state.waiters[state.stats.depth++];
+    waiter->ticket = queue->ticket;
+    waiter->pid = getpid();
+    waiter->uid = uid;
+    waiter->slot = slot;
+    waiter->reserved = 0;
+    if (state.stats.max_depth < state.stats.depth)
+        state.stats.max_depth = state.stats.depth;
+    unlock_state(queue->fd, &state);
+
+    return PAM_SUCCESS;
+
+full:
+    close(queue->fd);
+    queue->fd = -1;
+
+    return PAM_AUTHINFO_UNAVAIL;
+
+err:
+    /* don't block the card reader because of a problem with the queue */
+    close(queue->fd);
+    queue->fd = -1;
+
+    return PAM_SUCCESS;
+}
+
+int reader_queue_poll(pam_handle_t *pamh, struct reader_queue *queue,
+        reader_queue_notify notify, void *ctx)
+{
+    struct reader_queue_state state;
+    long waited;
+    int i;
+
+    if (queue->fd < 0)
+        return PAM_SUCCESS;
+
+    if (!lock_state(queue->fd, &state)) {
+        /* don't block the card reader because of a problem with the queue */
+        close(queue->fd);
+        queue->fd = -1;
+        return PAM_SUCCESS;
+    }
+    purge(queue->fd, &state, queue->ticket);
+    waited = ms_since(&queue->start);
+
+    i = find(&state, queue->ticket);
+    if (i <= 0) {
+        /* it's our turn (or the queue has been reset) */
+        state.stats.served++;
+        state.stats.wait_ms += waited;
+        unlock_state(queue->fd, &state);
+        if (queue->position) {
+            pam_syslog(pamh, LOG_INFO, "Waited %ld ms for the card reader",
+                    waited);
+        }
+        return PAM_SUCCESS;
+    }
+
+    if (waited >= queue->max_wait * 1000) {
+        remove_waiter(&state, i);
+        state.stats.timeouts++;
+        unlock_state(queue->fd, &state);
+        pam_syslog(pamh, LOG_ERR, "Timeout after waiting %ld s for "
+                "the card reader at position %d", queue->max_wait, i);
+        close(queue->fd);
+        queue->fd = -1;
+        return PAM_AUTHINFO_UNAVAIL;
+    }
+    unlock_state(queue->fd, &state);
+
+    if (queue->position != (unsigned int) i) {
+        queue->position = i;
+        if (notify)
+            notify(ctx, queue->position);
+    }
+
+    return PAM_INCOMPLETE;
+}
+
+int reader_queue_enter(pam_handle_t *pamh, const char *dir, long max_wait,
+        uid_t uid, reader_queue_notify notify, void *ctx,
+        struct reader_queue *queue)
+{
+    struct timespec delay = {0, READER_QUEUE_POLL * 1000000};
+    int r;
+
+    r = reader_queue_join(pamh, dir, max_wait, uid, queue);
+    while (PAM_SUCCESS == r) {
+        r = reader_queue_poll(pamh, queue, notify, ctx);
+        if (PAM_INCOMPLETE != r)
+            break;
+        nanosleep(&delay, NULL);
+        r = PAM_SUCCESS;
+    }
+
+    return r;
+}
+
+void reader_queue_leave(struct reader_queue *queue)
+{
+    struct reader_queue_state state;
+    int i;
+
+    if (queue->fd < 0)
+        return;
+
+    if (lock_state(queue->fd, &state)) {
+        i = find(&state, queue->ticket);
+        if (i >= 0)
+            remove_waiter(&state, i);
+        unlock_state(queue->fd, &state);
+    }
+    close(queue->fd);
+    queue->fd = -1;
+}
+
+int reader_queue_get_stats(const char *dir, struct reader_queue_stats *stats)
+{
+    struct reader_queue_state state;
+    int fd, ok = 0;
+
+    memset(stats, 0, sizeof *stats);
+
+    fd = open_state(dir, 0);
+    if (fd < 0)
+        return 0;
+
+    if (0 == flock(fd, LOCK_SH)) {
+        if (pread(fd, &state, sizeof state, 0) == sizeof state
+                && 0 == memcmp(state.magic, reader_queue_magic,
+                    sizeof state.magic)) {
+            *stats = state.stats;
+            ok = 1;
+        }
+        flock(fd, LOCK_UN);
+    }
+    close(fd);
+
+    return ok;
+}
@@ -0,0 +1,65 @@
+#ifndef _EID_PAM_READER_QUEUE_H
+#define _EID_PAM_READER_QUEUE_H
+
+#include <security/pam_appl.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* FIFO queue in front of the eID client, so that simultaneous
+ * authentications of different users take turns with the card reader
+ * instead of failing. The queue lives in a file below the runtime directory,
+ * which is shared by all processes using the module and by eid-pamd. Waiters
+ * of crashed processes are removed automatically. A single user may only
+ * occupy some of the places. */
+
+#define READER_QUEUE_MAX 64
+/* waiters per real user ID of the requesting processes */
+#define READER_QUEUE_PER_UID 8
+/* default for the maximum time to wait in seconds */
+#define READER_QUEUE_WAIT 120
+
+struct reader_queue_stats {
+    uint32_t depth;
+    uint32_t max_depth;
+    uint64_t served;
+    uint64_t timeouts;
+    /* sum of the wait times in milliseconds */
+    uint64_t wait_ms;
+};
+
+struct reader_queue {
+    int fd;
+    uint64_t ticket;
+    long max_wait;
+    struct timespec start;
+    unsigned int position;
+};
+
+/* Called whenever the position of the waiter changes */
+typedef void (*reader_queue_notify)(void *ctx, unsigned int position);
+
+/* Waits at most max_wait seconds until it's our turn. Returns PAM_SUCCESS if
+ * the caller may use the card reader and then has to call
+ * reader_queue_leave(). If the queue can't be used, PAM_SUCCESS is returned
+ * as well. uid is the real user ID of the requesting process. */
+int reader_queue_enter(pam_handle_t *pamh, const char *dir, long max_wait,
+        uid_t uid, reader_queue_notify notify, void *ctx,
+        struct reader_queue *queue);
+
+/* Non-blocking variant of reader_queue_enter(): Enqueues the caller.
+ * Returns PAM_SUCCESS or PAM_AUTHINFO_UNAVAIL if the queue or the places of
+ * uid are full. */
+int reader_queue_join(pam_handle_t *pamh, const char *dir, long max_wait,
+        uid_t uid, struct reader_queue *queue);
+
+/* Returns PAM_SUCCESS if it's our turn, PAM_INCOMPLETE while waiting or
+ * PAM_AUTHINFO_UNAVAIL if we waited too long. */
+int reader_queue_poll(pam_handle_t *pamh, struct reader_queue *queue,
+        reader_queue_notify notify, void *ctx);
+
+void reader_queue_leave(struct reader_queue *queue);
+
+int reader_queue_get_stats(const char *dir, struct reader_queue_stats *stats);
+
+#endif
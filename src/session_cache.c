@@ -0,0 +1,401 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "session_cache.h"
+#include "auth_cache.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_SECURITY_PAM_EXT_H
+#include <security/pam_ext.h>
+#else
+#define pam_syslog(handle, level, msg...) syslog(level, ## msg)
+#endif
+
+/* File format (all integers in network byte order):
+ *
+ *     magic          "EIDSESS1"
+ *     key            SHA-256(origin || 0x00 || pin)
+ *     count          uint32
+ *     count times:   valid_until uint64,
+ *                    session_key length uint32 + data,
+ *                    shmac length uint32 + data,
+ *                    sdata length uint32 + data
+ *     checksum       SHA-256 over everything above
+ */
+static const unsigned char session_cache_magic[8] = "EIDSESS1";
+#define SESSION_CACHE_HEADER_LENGTH \
+    (sizeof session_cache_magic + SESSION_CACHE_KEY_LENGTH + 4)
+#define SESSION_CACHE_CHECKSUM_LENGTH 32
+
+static int sha256(const unsigned char *a, size_t a_len,
+        const unsigned char *b, size_t b_len,
+        const unsigned char *c, size_t c_len,
+        unsigned char md[32])
+{
+    int ok = 0;
+    unsigned int len = 0;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+    if (ctx
+            && 1 == EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)
+            && 1 == EVP_DigestUpdate(ctx, a, a_len)
+            && 1 == EVP_DigestUpdate(ctx, b, b_len)
+            && 1 == EVP_DigestUpdate(ctx, c, c_len)
+            && 1 == EVP_DigestFinal_ex(ctx, md, &len)
+            && len == 32)
+        ok = 1;
+
+    EVP_MD_CTX_free(ctx);
+
+    return ok;
+}
+
+static int read_file(int dirfd, const char *name,
+        struct session_cache_file *file)
+{
+    struct stat sb;
+    unsigned char md[SESSION_CACHE_CHECKSUM_LENGTH];
+    unsigned char *data = NULL;
+    size_t length;
+    ssize_t n;
+    int fd, ok = 0;
+
+    fd = openat(dirfd, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    if (!auth_cache_trusted_fd(fd, S_IFREG) || 0 != fstat(fd, &sb)
+            || sb.st_size < (off_t) (SESSION_CACHE_HEADER_LENGTH
+                + SESSION_CACHE_CHECKSUM_LENGTH)
+            || sb.st_size > SESSION_CACHE_MAX_FILE_SIZE)
+        goto err;
+
+    length = sb.st_size;
+    data = malloc(length);
+    if (!data)
+        goto err;
+
+    n = read(fd, data, length);
+    if (n < 0 || (size_t) n != length)
+        goto err;
+
+    length -= SESSION_CACHE_CHECKSUM_LENGTH;
+    if (0 != memcmp(data, session_cache_magic, sizeof session_cache_magic)
+            || 1 != sha256(data, length, NULL, 0, NULL, 0, md)
+            || 0 != CRYPTO_memcmp(md, data + length, sizeof md))
+        goto err;
+
+    memcpy(file->key, data + sizeof session_cache_magic, sizeof file->key);
+    file->data = data;
+    file->length = length;
+    data = NULL;
+    ok = 1;
+
+err:
+    free(data);
+    close(fd);
+
+    return ok;
+}
+
+void session_cache_load(pam_handle_t *pamh, struct session_cache *cache,
+        const char *dir)
+{
+    DIR *d;
+    struct dirent *entry;
+    int fd;
+
+    memset(cache, 0, sizeof *cache);
+    cache->dirfd = -1;
+
+    if (!dir)
+        return;
+
+#ifndef HAVE_SESSION_CACHE
+    pam_syslog(pamh, LOG_DEBUG,
+            "session_cache requires libcurl 8.12.0 or later, ignoring");
+    return;
+#endif
+
+    /* all later accesses are relative to the verified directory */
+    cache->dirfd = auth_cache_open_dir(dir, 1);
+    if (cache->dirfd < 0) {
+        pam_syslog(pamh, LOG_WARNING,
+                "%s must be a directory owned by root, ignoring", dir);
+        return;
+    }
+    cache->dir = dir;
+
+    fd = dup(cache->dirfd);
+    d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!d) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    while (cache->count < SESSION_CACHE_MAX_FILES
+            && NULL != (entry = readdir(d))) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (1 == read_file(cache->dirfd, entry->d_name,
+                    &cache->files[cache->count]))
+            cache->count++;
+    }
+
+    closedir(d);
+}
+
+static const unsigned char *parse_u32(const unsigned char *p,
+        const unsigned char *end, uint32_t *v)
+{
+    if (!p || end - p < 4)
+        return NULL;
+    *v = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+        | ((uint32_t) p[2] << 8) | p[3];
+    return p + 4;
+}
+
+static const unsigned char *parse_blob(const unsigned char *p,
+        const unsigned char *end, const unsigned char **blob, size_t *len)
+{
+    uint32_t v;
+
+    p = parse_u32(p, end, &v);
+    if (!p || (size_t) (end - p) < v)
+        return NULL;
+    *blob = p;
+    *len = v;
+    return p + v;
+}
+
+void session_cache_import(struct session_cache *cache, CURL *curl,
+        const struct eid_origin *origin, const unsigned char *pin,
+        size_t pin_len)
+{
+    const char *host = origin->host;
+    size_t i, host_len = strlen(host);
+
+    if (!cache->dir || cache->key_valid)
+        return;
+
+    /* libcurl names IPv6 peers without brackets */
+    if (host_len >= 2 && host[0] == '[' && host[host_len - 1] == ']') {
+        host++;
+        host_len -= 2;
+    }
+    if ((size_t) snprintf(cache->peer, sizeof cache->peer, "%.*s:%ld",
+                (int) host_len, host, origin->port) >= sizeof cache->peer
+            || 1 != sha256((const unsigned char *) origin->name,
+                strlen(origin->name) + 1, pin, pin_len, NULL, 0, cache->key))
+        return;
+    cache->key_valid = 1;
+
+    for (i = 0; i < cache->count; i++) {
+        const unsigned char *p, *end, *key, *shmac, *sdata;
+        size_t key_len, shmac_len, sdata_len;
+        uint32_t count, hi, lo;
+        char session_key[256];
+
+        if (0 != CRYPTO_memcmp(cache->files[i].key, cache->key,
+                    sizeof cache->key))
+            continue;
+
+        p = cache->files[i].data + SESSION_CACHE_HEADER_LENGTH - 4;
+        end = cache->files[i].data + cache->files[i].length;
+        p = parse_u32(p, end, &count);
+        while (p && count-- > 0) {
+            p = parse_u32(p, end, &hi);
+            p = parse_u32(p, end, &lo);
+            p = parse_blob(p, end, &key, &key_len);
+            p = parse_blob(p, end, &shmac, &shmac_len);
+            p = parse_blob(p, end, &sdata, &sdata_len);
+            if (!p || key_len >= sizeof session_key)
+                break;
+            if ((((uint64_t) hi << 32) | lo) < (uint64_t) time(NULL))
+                /* expired */
+                continue;
+            memcpy(session_key, key, key_len);
+            session_key[key_len] = '\0';
+#ifdef HAVE_SESSION_CACHE
+            curl_easy_ssls_import(curl, key_len ? session_key : NULL,
+                    shmac, shmac_len, sdata, sdata_len);
+#endif
+        }
+        break;
+    }
+}
+
+struct session_buffer {
+    /* only sessions whose key starts with "host:port" */
+    const char *peer;
+    unsigned char *data;
+    size_t length;
+    size_t capacity;
+    uint32_t count;
+    int failed;
+};
+
+static void buffer_append(struct session_buffer *buf,
+        const void *data, size_t len)
+{
+    if (buf->failed)
+        return;
+
+    if (buf->length + len > SESSION_CACHE_MAX_FILE_SIZE) {
+        buf->failed = 1;
+        return;
+    }
+
+    if (buf->length + len > buf->capacity) {
+        size_t capacity = buf->capacity ? 2*buf->capacity : 4096;
+        unsigned char *p;
+        while (capacity < buf->length + len)
+            capacity *= 2;
+        p = realloc(buf->data, capacity);
+        if (!p) {
+            buf->failed = 1;
+            return;
+        }
+        buf->data = p;
+        buf->capacity = capacity;
+    }
+
+    memcpy(buf->data + buf->length, data, len);
+    buf->length += len;
+}
+
+static void buffer_append_u32(struct session_buffer *buf, uint32_t v)
+{
+    unsigned char p[4] = {v >> 24, v >> 16, v >> 8, v};
+    buffer_append(buf, p, sizeof p);
+}
+
+#ifdef HAVE_SESSION_CACHE
+static void buffer_append_blob(struct session_buffer *buf,
+        const void *data, size_t len)
+{
+    buffer_append_u32(buf, len);
+    buffer_append(buf, data, len);
+}
+
+static CURLcode export_session(CURL *curl, void *userptr,
+        const char *session_key,
+        const unsigned char *shmac, size_t shmac_len,
+        const unsigned char *sdata, size_t sdata_len,
+        curl_off_t valid_until, int ietf_tls_id,
+        const char *alpn, size_t earlydata_max)
+{
+    struct session_buffer *buf = userptr;
+    uint64_t until = valid_until > 0 ? (uint64_t) valid_until : 0;
+    size_t len = strlen(buf->peer);
+
+    /* the share holds the sessions of all hosts; without a key the origin
+     * of a session is unknown */
+    if (!session_key || 0 != strncmp(session_key, buf->peer, len)
+            || (session_key[len] != ':' && session_key[len] != '\0'))
+        return CURLE_OK;
+
+    buffer_append_u32(buf, until >> 32);
+    buffer_append_u32(buf, until & 0xffffffff);
+    buffer_append_blob(buf, session_key, session_key ? strlen(session_key) : 0);
+    buffer_append_blob(buf, shmac, shmac_len);
+    buffer_append_blob(buf, sdata, sdata_len);
+    buf->count++;
+
+    return CURLE_OK;
+}
+#endif
+
+void session_cache_store(pam_handle_t *pamh, struct session_cache *cache,
+        CURL *curl)
+{
+    struct session_buffer buf = {cache->peer, NULL, 0, 0, 0, 0};
+    unsigned char md[SESSION_CACHE_CHECKSUM_LENGTH];
+    unsigned char nonce[8];
+    char name[2*SESSION_CACHE_KEY_LENGTH + 1];
+    char tmp[2*SESSION_CACHE_KEY_LENGTH + 32];
+    size_t i;
+    int fd = -1, r;
+
+    if (!cache->dir || !cache->key_valid)
+        return;
+
+    buffer_append(&buf, session_cache_magic, sizeof session_cache_magic);
+    buffer_append(&buf, cache->key, sizeof cache->key);
+    buffer_append_u32(&buf, 0);
+#ifdef HAVE_SESSION_CACHE
+    if (CURLE_OK != curl_easy_ssls_export(curl, export_session, &buf))
+        buf.failed = 1;
+#endif
+    if (buf.failed || buf.count == 0)
+        goto err;
+
+    /* patch in the number of sessions */
+    buf.data[SESSION_CACHE_HEADER_LENGTH - 4] = buf.count >> 24;
+    buf.data[SESSION_CACHE_HEADER_LENGTH - 3] = buf.count >> 16;
+    buf.data[SESSION_CACHE_HEADER_LENGTH - 2] = buf.count >> 8;
+    buf.data[SESSION_CACHE_HEADER_LENGTH - 1] = buf.count;
+
+    if (1 != sha256(buf.data, buf.length, NULL, 0, NULL, 0, md))
+        goto err;
+    buffer_append(&buf, md, sizeof md);
+    if (buf.failed)
+        goto err;
+
+    for (i = 0; i < SESSION_CACHE_KEY_LENGTH; i++)
+        sprintf(name + 2*i, "%02x", cache->key[i]);
+    if (1 != RAND_bytes(nonce, sizeof nonce))
+        goto err;
+    snprintf(tmp, sizeof tmp, ".%s.%02x%02x%02x%02x%02x%02x%02x%02x", name,
+            nonce[0], nonce[1], nonce[2], nonce[3],
+            nonce[4], nonce[5], nonce[6], nonce[7]);
+
+    fd = openat(cache->dirfd, tmp,
+            O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+    if (fd < 0)
+        goto err;
+
+    if ((ssize_t) buf.length != write(fd, buf.data, buf.length)) {
+        unlinkat(cache->dirfd, tmp, 0);
+        goto err;
+    }
+
+    r = close(fd);
+    fd = -1;
+    if (0 != r || 0 != renameat(cache->dirfd, tmp, cache->dirfd, name)) {
+        unlinkat(cache->dirfd, tmp, 0);
+        goto err;
+    }
+
+err:
+    if (fd >= 0)
+        close(fd);
+    free(buf.data);
+}
+
+void session_cache_free(struct session_cache *cache)
+{
+    size_t i;
+
+    for (i = 0; i < cache->count; i++)
+        free(cache->files[i].data);
+    if (cache->dir)
+        close(cache->dirfd);
+    memset(cache, 0, sizeof *cache);
+}
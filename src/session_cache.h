@@ -0,0 +1,61 @@
+#ifndef _EID_PAM_SESSION_CACHE_H
+#define _EID_PAM_SESSION_CACHE_H
+
+#include "eid.h"
+#include <curl/curl.h>
+#include <security/pam_appl.h>
+
+/* Persistent cache of TLS sessions, which lets short-lived processes such as
+ * sudo resume the TLS session to the eService instead of doing a full
+ * handshake. Each file holds the sessions exported from libcurl for one
+ * trusted origin and pinned public key, only the sessions with its host and
+ * port are written. The cache directory and its files must be owned by root;
+ * anything suspicious is silently ignored. */
+
+/* libcurl 8.12.0 is the first version to support importing/exporting TLS
+ * sessions */
+#if LIBCURL_VERSION_NUM >= 0x080c00
+#define HAVE_SESSION_CACHE 1
+#endif
+
+#define SESSION_CACHE_KEY_LENGTH 32
+#define SESSION_CACHE_MAX_FILES 16
+#define SESSION_CACHE_MAX_FILE_SIZE (64*1024)
+
+struct session_cache_file {
+    unsigned char key[SESSION_CACHE_KEY_LENGTH];
+    unsigned char *data;
+    size_t length;
+};
+
+struct session_cache {
+    /* NULL if the cache isn't used, dirfd is valid otherwise */
+    const char *dir;
+    int dirfd;
+    struct session_cache_file files[SESSION_CACHE_MAX_FILES];
+    size_t count;
+    unsigned char key[SESSION_CACHE_KEY_LENGTH];
+    int key_valid;
+    /* "host:port", which starts the session keys of libcurl */
+    char peer[EID_URL_MAX + 16];
+};
+
+/* Opens (and creates) dir and reads all valid cache files from it. Needs to
+ * be called with root privileges. */
+void session_cache_load(pam_handle_t *pamh, struct session_cache *cache,
+        const char *dir);
+
+/* Imports the cached sessions for origin and the (optional) pinned key into
+ * curl. */
+void session_cache_import(struct session_cache *cache, CURL *curl,
+        const struct eid_origin *origin, const unsigned char *pin,
+        size_t pin_len);
+
+/* Exports the sessions with the origin from curl into the file selected by
+ * session_cache_import(). Needs to be called with root privileges. */
+void session_cache_store(pam_handle_t *pamh, struct session_cache *cache,
+        CURL *curl);
+
+void session_cache_free(struct session_cache *cache);
+
+#endif
@@ -0,0 +1,167 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "single_flight.h"
+#include "auth_cache.h"
+#include "authenticate.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <security/pam_modules.h>
+#ifdef HAVE_SECURITY_PAM_EXT_H
+#include <security/pam_ext.h>
+#else
+#define pam_syslog(handle, level, msg...) syslog(level, ## msg)
+#endif
+
+/* stored at the beginning of the lock file, only accessed with the lock held
+ * or before trying to take it */
+struct single_flight_result {
+    uint64_t generation;
+    int32_t result;
+};
+
+static uint64_t read_result(int fd, int *result)
+{
+    struct single_flight_result r;
+
+    if (pread(fd, &r, sizeof r, 0) != sizeof r)
+        return 0;
+    if (result)
+        *result = r.result;
+
+    return r.generation;
+}
+
+static int open_lock(const char *dir, const struct auth_request *request)
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0, i;
+    char name[2*EVP_MAX_MD_SIZE + sizeof ".lock"];
+    char uid[32];
+    int dirfd, fd = -1;
+    EVP_MD_CTX *ctx;
+
+    /* the target user and the real user asking for it, so that the prompts
+     * of polkit and sudo of the same person share one authentication, but
+     * `su` of someone else never takes over its result */
+    snprintf(uid, sizeof uid, "%ld", (long) request->uid);
+    ctx = EVP_MD_CTX_new();
+    if (!ctx
+            || 1 != EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)
+            || 1 != EVP_DigestUpdate(ctx, request->user,
+                strlen(request->user) + 1)
+            || 1 != EVP_DigestUpdate(ctx, uid, strlen(uid) + 1)
+            || 1 != EVP_DigestFinal_ex(ctx, md, &len)) {
+        EVP_MD_CTX_free(ctx);
+        return -1;
+    }
+    EVP_MD_CTX_free(ctx);
+    for (i = 0; i < len; i++)
+        sprintf(name + 2*i, "%02x", md[i]);
+    strcpy(name + 2*len, ".lock");
+
+    dirfd = auth_cache_open_dir(dir, 1);
+    if (dirfd < 0)
+        return -1;
+
+    fd = openat(dirfd, name, O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0600);
+    if (fd >= 0 && !auth_cache_trusted_fd(fd, S_IFREG)) {
+        close(fd);
+        fd = -1;
+    }
+    close(dirfd);
+
+    return fd;
+}
+
+int single_flight_begin(pam_handle_t *pamh, const char *dir,
+        const struct auth_request *request, struct single_flight *flight,
+        int blocking, int *result)
+{
+    flight->fd = open_lock(dir, request);
+    flight->generation = 0;
+    if (flight->fd < 0) {
+        /* authenticate without coordination */
+        return SINGLE_FLIGHT_LEAD;
+    }
+
+    flight->generation = read_result(flight->fd, NULL);
+
+    if (0 == flock(flight->fd, LOCK_EX|LOCK_NB))
+        return SINGLE_FLIGHT_LEAD;
+
+    if (errno != EWOULDBLOCK) {
+        single_flight_abort(flight);
+        return SINGLE_FLIGHT_LEAD;
+    }
+
+    pam_syslog(pamh, LOG_INFO,
+            "Waiting for the concurrent authentication of %s",
+            request->user);
+
+    return single_flight_continue(flight, blocking, result);
+}
+
+int single_flight_continue(struct single_flight *flight, int blocking,
+        int *result)
+{
+    uint64_t generation;
+
+    if (flight->fd < 0)
+        return SINGLE_FLIGHT_LEAD;
+
+    while (0 != flock(flight->fd, blocking ? LOCK_EX : LOCK_EX|LOCK_NB)) {
+        if (!blocking && errno == EWOULDBLOCK)
+            return SINGLE_FLIGHT_WAIT;
+        if (errno != EINTR) {
+            single_flight_abort(flight);
+            return SINGLE_FLIGHT_LEAD;
+        }
+    }
+
+    generation = read_result(flight->fd, result);
+    if (generation != flight->generation) {
+        /* someone else has finished in the meantime */
+        single_flight_abort(flight);
+        return SINGLE_FLIGHT_DONE;
+    }
+
+    /* the other caller died without a result, so it's our turn */
+    return SINGLE_FLIGHT_LEAD;
+}
+
+void single_flight_finish(struct single_flight *flight, int result)
+{
+    struct single_flight_result r;
+
+    if (flight->fd < 0)
+        return;
+
+    memset(&r, 0, sizeof r);
+    r.generation = flight->generation + 1;
+    r.result = result;
+    if (pwrite(flight->fd, &r, sizeof r, 0) != sizeof r) {
+        /* waiting callers will authenticate themselves */
+    }
+
+    single_flight_abort(flight);
+}
+
+void single_flight_abort(struct single_flight *flight)
+{
+    if (flight->fd < 0)
+        return;
+
+    /* releases the lock */
+    close(flight->fd);
+    flight->fd = -1;
+}
@@ -0,0 +1,45 @@
+#ifndef _EID_PAM_SINGLE_FLIGHT_H
+#define _EID_PAM_SINGLE_FLIGHT_H
+
+#include <security/pam_appl.h>
+#include <stdint.h>
+
+/* Coalesces concurrent authentications of the same user, which would
+ * otherwise race for the card reader. The first caller takes a lock file
+ * below the runtime directory and talks to the eID client; everyone arriving
+ * in the meantime waits for the lock and takes over the published result.
+ * The lock is keyed by the target user and the real uid of the caller, so
+ * that e.g. `su` run by another user never takes over the result of the
+ * user's own authentication. */
+
+struct auth_request;
+
+struct single_flight {
+    int fd;
+    uint64_t generation;
+};
+
+#define SINGLE_FLIGHT_LEAD 0
+#define SINGLE_FLIGHT_DONE 1
+#define SINGLE_FLIGHT_WAIT 2
+
+/* Returns SINGLE_FLIGHT_LEAD if the caller has to authenticate and then call
+ * single_flight_finish(). Returns SINGLE_FLIGHT_DONE if a concurrent
+ * authentication of the same user has finished and its PAM status code is
+ * stored in result. Without blocking, SINGLE_FLIGHT_WAIT is returned while
+ * the concurrent authentication is still running; call
+ * single_flight_continue() later on. */
+int single_flight_begin(pam_handle_t *pamh, const char *dir,
+        const struct auth_request *request, struct single_flight *flight,
+        int blocking, int *result);
+
+int single_flight_continue(struct single_flight *flight, int blocking,
+        int *result);
+
+/* Publishes result to the waiting callers */
+void single_flight_finish(struct single_flight *flight, int result);
+
+/* Gives up without publishing a result */
+void single_flight_abort(struct single_flight *flight);
+
+#endif
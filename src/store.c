@@ -0,0 +1,372 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "store.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const unsigned char store_magic[8] = "EIDSTOR2";
+
+/* All integers in host byte order. The header is followed by the slots and
+ * the records. A slot with offset 0 is empty. */
+struct store_header {
+    unsigned char magic[8];
+    uint32_t slots;
+    uint32_t count;
+};
+
+struct store_slot {
+    uint32_t hash;
+    uint32_t offset;
+};
+
+/* record: pubkey, flags, length of the user name, number of digests, user
+ * name, digests */
+#define STORE_RECORD_PUBKEY 0
+#define STORE_RECORD_FLAGS (STORE_RECORD_PUBKEY + AUTH_DIGEST_LENGTH)
+#define STORE_RECORD_LENGTH (STORE_RECORD_FLAGS + 1)
+#define STORE_RECORD_COUNT (STORE_RECORD_LENGTH + 1)
+#define STORE_RECORD_USER (STORE_RECORD_COUNT + 1)
+#define STORE_RECORD_SIZE(record) (STORE_RECORD_USER \
+        + (size_t) (record)[STORE_RECORD_LENGTH] \
+        + (size_t) (record)[STORE_RECORD_COUNT]*AUTH_DIGEST_LENGTH)
+#define STORE_RECORD_MD(record) \
+    ((record) + STORE_RECORD_USER + (record)[STORE_RECORD_LENGTH])
+
+#define STORE_FLAG_PINNED 1
+
+struct store_map {
+    const unsigned char *data;
+    size_t length;
+    struct store_header header;
+    const unsigned char *slots;
+};
+
+/* FNV-1a */
+static uint32_t store_hash(const char *user, size_t len)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) user[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static int store_map(const char *path, struct store_map *map)
+{
+    struct stat sb;
+    void *data;
+    int fd, err;
+
+    memset(map, 0, sizeof *map);
+
+    fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    /* only root may be able to change the references */
+    if (0 != fstat(fd, &sb) || !S_ISREG(sb.st_mode) || sb.st_uid != 0
+            || (sb.st_mode & (S_IWGRP|S_IWOTH))
+            || (size_t) sb.st_size < sizeof map->header) {
+        errno = EINVAL;
+        goto err;
+    }
+
+    data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == data)
+        goto err;
+    close(fd);
+
+    map->data = data;
+    map->length = sb.st_size;
+    memcpy(&map->header, map->data, sizeof map->header);
+    map->slots = map->data + sizeof map->header;
+
+    if (0 != memcmp(map->header.magic, store_magic, sizeof store_magic)
+            || map->header.slots == 0
+            || (map->header.slots & (map->header.slots - 1))
+            || map->header.slots > (map->length - sizeof map->header)
+                / sizeof(struct store_slot)) {
+        munmap((void *) map->data, map->length);
+        map->data = NULL;
+        errno = EINVAL;
+        return 0;
+    }
+
+    return 1;
+
+err:
+    err = errno;
+    close(fd);
+    errno = err;
+
+    return 0;
+}
+
+static void store_unmap(struct store_map *map)
+{
+    if (map->data)
+        munmap((void *) map->data, map->length);
+    map->data = NULL;
+}
+
+/* returns the record in slot i, NULL if empty or invalid */
+static const unsigned char *store_record(const struct store_map *map,
+        uint32_t i, struct store_slot *slot)
+{
+    const unsigned char *record;
+
+    memcpy(slot, map->slots + i*sizeof *slot, sizeof *slot);
+    if (slot->offset == 0 || slot->offset > map->length
+            || map->length - slot->offset < STORE_RECORD_USER)
+        return NULL;
+
+    record = map->data + slot->offset;
+    if (map->length - slot->offset < STORE_RECORD_SIZE(record)
+            || record[STORE_RECORD_COUNT] == 0
+            || record[STORE_RECORD_COUNT] > AUTH_REFERENCE_MAX)
+        return NULL;
+
+    return record;
+}
+
+int store_find(const char *path, const char *user,
+        struct auth_reference *reference, struct client_pubkey *pubkey)
+{
+    struct store_map map;
+    struct store_slot slot;
+    const unsigned char *record;
+    size_t len = strlen(user);
+    uint32_t hash = store_hash(user, len), i, n;
+    int r = 0;
+
+    if (!store_map(path, &map))
+        return -1;
+
+    for (i = hash & (map.header.slots - 1), n = 0; n < map.header.slots;
+            i = (i + 1) & (map.header.slots - 1), n++) {
+        memcpy(&slot, map.slots + i*sizeof slot, sizeof slot);
+        if (slot.offset == 0)
+            break;
+        if (slot.hash != hash)
+            continue;
+        record = store_record(&map, i, &slot);
+        if (!record) {
+            r = -1;
+            break;
+        }
+        if (record[STORE_RECORD_LENGTH] != len
+                || 0 != memcmp(record + STORE_RECORD_USER, user, len))
+            continue;
+
+        memset(reference, 0, sizeof *reference);
+        reference->digest = 1;
+        reference->count = record[STORE_RECORD_COUNT];
+        memcpy(reference->md, STORE_RECORD_MD(record),
+                reference->count*AUTH_DIGEST_LENGTH);
+        memset(pubkey, 0, sizeof *pubkey);
+        if (record[STORE_RECORD_FLAGS] & STORE_FLAG_PINNED)
+            client_pubkey_set(pubkey, record + STORE_RECORD_PUBKEY);
+        r = 1;
+        break;
+    }
+
+    store_unmap(&map);
+
+    return r;
+}
+
+int store_read(const char *path, struct store_entry **entries, size_t *count)
+{
+    struct store_map map;
+    struct store_slot slot;
+    struct store_entry *e;
+    const unsigned char *record;
+    uint32_t i;
+    size_t n = 0;
+
+    *entries = NULL;
+    *count = 0;
+
+    if (!store_map(path, &map))
+        return 0;
+
+    e = calloc(map.header.count ? map.header.count : 1, sizeof *e);
+    if (!e) {
+        store_unmap(&map);
+        return 0;
+    }
+
+    for (i = 0; i < map.header.slots && n < map.header.count; i++) {
+        record = store_record(&map, i, &slot);
+        if (!record)
+            continue;
+        memcpy(e[n].user, record + STORE_RECORD_USER,
+                record[STORE_RECORD_LENGTH]);
+        e[n].user[record[STORE_RECORD_LENGTH]] = '\0';
+        e[n].count = record[STORE_RECORD_COUNT];
+        memcpy(e[n].md, STORE_RECORD_MD(record),
+                e[n].count*AUTH_DIGEST_LENGTH);
+        memcpy(e[n].pubkey, record + STORE_RECORD_PUBKEY, sizeof e[n].pubkey);
+        e[n].pinned = record[STORE_RECORD_FLAGS] & STORE_FLAG_PINNED;
+        n++;
+    }
+
+    store_unmap(&map);
+    *entries = e;
+    *count = n;
+
+    return 1;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 1;
+}
+
+int store_write(const char *path, const struct store_entry *entries,
+        size_t count)
+{
+    struct store_header header;
+    struct store_slot *slots = NULL;
+    unsigned char *records = NULL, *record;
+    char tmp[PATH_MAX];
+    size_t i, len, size = 0, offset;
+    uint32_t n = 8, j;
+    int fd = -1, ok = 0, err;
+
+    while (n < 2*count && n < UINT32_MAX/2)
+        n *= 2;
+
+    slots = calloc(n, sizeof *slots);
+    records = malloc(count*(STORE_RECORD_USER + STORE_USER_MAX
+                + sizeof entries->md) + 1);
+    if (!slots || !records)
+        goto err;
+
+    offset = sizeof header + n*sizeof *slots;
+    for (i = 0; i < count; i++) {
+        len = strlen(entries[i].user);
+        if (len == 0 || len >= STORE_USER_MAX || entries[i].count == 0
+                || entries[i].count > AUTH_REFERENCE_MAX) {
+            errno = EINVAL;
+            goto err;
+        }
+        if (offset + size > UINT32_MAX - STORE_RECORD_USER - len
+                - sizeof entries->md) {
+            errno = EFBIG;
+            goto err;
+        }
+
+        record = records + size;
+        memcpy(record + STORE_RECORD_PUBKEY, entries[i].pubkey,
+                AUTH_DIGEST_LENGTH);
+        record[STORE_RECORD_FLAGS] = entries[i].pinned ? STORE_FLAG_PINNED : 0;
+        record[STORE_RECORD_LENGTH] = len;
+        record[STORE_RECORD_COUNT] = entries[i].count;
+        memcpy(record + STORE_RECORD_USER, entries[i].user, len);
+        memcpy(STORE_RECORD_MD(record), entries[i].md,
+                entries[i].count*AUTH_DIGEST_LENGTH);
+
+        /* linear probing */
+        j = store_hash(entries[i].user, len) & (n - 1);
+        while (slots[j].offset)
+            j = (j + 1) & (n - 1);
+        slots[j].hash = store_hash(entries[i].user, len);
+        slots[j].offset = offset + size;
+
+        size += STORE_RECORD_SIZE(record);
+    }
+
+    memcpy(header.magic, store_magic, sizeof header.magic);
+    header.slots = n;
+    header.count = count;
+
+    if ((size_t) snprintf(tmp, sizeof tmp, "%s.XXXXXX", path) >= sizeof tmp) {
+        errno = ENAMETOOLONG;
+        goto err;
+    }
+    fd = mkstemp(tmp);
+    if (fd < 0)
+        goto err;
+
+    ok = 0 == fchmod(fd, 0600)
+        && write_all(fd, &header, sizeof header)
+        && write_all(fd, slots, n*sizeof *slots)
+        && write_all(fd, records, size)
+        && 0 == fsync(fd);
+    if (0 != close(fd))
+        ok = 0;
+    if (!ok || 0 != rename(tmp, path)) {
+        err = errno;
+        unlink(tmp);
+        errno = err;
+        ok = 0;
+    }
+
+err:
+    err = errno;
+    free(slots);
+    free(records);
+    errno = err;
+
+    return ok;
+}
+
+int store_lock(const char *path)
+{
+    char name[PATH_MAX];
+    int fd;
+
+    if ((size_t) snprintf(name, sizeof name, "%s.lock", path) >= sizeof name) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    fd = open(name, O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+
+    while (0 != flock(fd, LOCK_EX)) {
+        if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+void store_unlock(int lock)
+{
+    if (lock >= 0)
+        close(lock);
+}
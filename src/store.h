@@ -0,0 +1,39 @@
+#ifndef _EID_PAM_STORE_H
+#define _EID_PAM_STORE_H
+
+#include "eid.h"
+#include <stddef.h>
+
+/* System-wide store of the references, which avoids accessing the home
+ * directories during the authentication. It is a constant hash table keyed
+ * by the user name, which is mapped and looked up with a single probe in
+ * most cases. The store is rewritten as a whole with eid-store. */
+
+#define STORE_PATH "/var/lib/eid-pam/references"
+#define STORE_USER_MAX 256
+
+struct store_entry {
+    char user[STORE_USER_MAX];
+    size_t count;
+    unsigned char md[AUTH_REFERENCE_MAX][AUTH_DIGEST_LENGTH];
+    int pinned;
+    unsigned char pubkey[AUTH_DIGEST_LENGTH];
+};
+
+/* Looks up the reference and the pinned key of user. Returns 1 if found, 0
+ * if not and -1 if the store is missing, not owned by root or corrupt. */
+int store_find(const char *path, const char *user,
+        struct auth_reference *reference, struct client_pubkey *pubkey);
+
+/* Reads all entries. Returns 0 and sets errno on failure. */
+int store_read(const char *path, struct store_entry **entries, size_t *count);
+
+/* Atomically replaces the store */
+int store_write(const char *path, const struct store_entry *entries,
+        size_t count);
+
+/* Serializes writers of the store, returns the lock or -1 */
+int store_lock(const char *path);
+void store_unlock(int lock);
+
+#endif
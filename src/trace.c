@@ -0,0 +1,264 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "trace.h"
+#include "auth_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static const unsigned char trace_magic[8] = "EIDTRAC1";
+
+struct trace_ring {
+    unsigned char magic[8];
+    uint64_t next_seq;
+    uint64_t next_id;
+    uint64_t reserved;
+    struct trace_span spans[TRACE_SPANS];
+};
+
+static const char *const phase_names[TRACE_LAST] = {
+    "total",
+    "getpwnam",
+    "reference",
+    "drop_privs",
+    "cache",
+    "flight",
+    "queue",
+    "request",
+    "dns",
+    "connect",
+    "tls",
+    "transfer",
+    "prewarm",
+    "select",
+};
+
+const char *trace_phase_name(unsigned int phase)
+{
+    return phase < TRACE_LAST ? phase_names[phase] : "unknown";
+}
+
+static int open_ring(const char *dir, int create)
+{
+    int dirfd, fd;
+
+    dirfd = auth_cache_open_dir(dir, create);
+    if (dirfd < 0)
+        return -1;
+
+    fd = openat(dirfd, "trace",
+            (create ? O_RDWR|O_CREAT : O_RDONLY)|O_NOFOLLOW|O_CLOEXEC, 0600);
+    if (fd >= 0 && !auth_cache_trusted_fd(fd, S_IFREG)) {
+        close(fd);
+        fd = -1;
+    }
+    close(dirfd);
+
+    return fd;
+}
+
+/* overwrites the file with zeros in place; other processes may have mapped
+ * it and get SIGBUS if it shrinks under them */
+static int clear_ring(int fd, size_t size)
+{
+    static const unsigned char zeros[4096];
+    size_t offset, n;
+
+    for (offset = 0; offset < size; offset += n) {
+        n = size - offset < sizeof zeros ? size - offset : sizeof zeros;
+        if (pwrite(fd, zeros, n, offset) != (ssize_t) n)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* (re)initializes the ring if it has a different format */
+static int init_ring(int fd)
+{
+    struct stat sb;
+    unsigned char magic[sizeof trace_magic];
+    int ok = 0;
+
+    while (0 != flock(fd, LOCK_EX)) {
+        if (errno != EINTR)
+            return 0;
+    }
+
+    if (0 != fstat(fd, &sb)) {
+        ok = 0;
+    } else if ((size_t) sb.st_size == sizeof(struct trace_ring)
+            && pread(fd, magic, sizeof magic, 0) == sizeof magic
+            && 0 == memcmp(magic, trace_magic, sizeof magic)) {
+        ok = 1;
+    } else if (((size_t) sb.st_size == sizeof(struct trace_ring)
+                ? clear_ring(fd, sizeof(struct trace_ring))
+                : 0 == ftruncate(fd, 0)
+                    && 0 == ftruncate(fd, sizeof(struct trace_ring)))
+            && pwrite(fd, trace_magic, sizeof trace_magic, 0)
+                == sizeof trace_magic) {
+        ok = 1;
+    }
+
+    flock(fd, LOCK_UN);
+
+    return ok;
+}
+
+void trace_open(struct trace *trace, const char *dir)
+{
+    struct trace_ring *ring;
+    int fd;
+
+    trace->ring = NULL;
+    trace->id = 0;
+
+    fd = open_ring(dir, 1);
+    if (fd < 0)
+        return;
+
+    if (init_ring(fd)) {
+        ring = mmap(NULL, sizeof *ring, PROT_READ|PROT_WRITE, MAP_SHARED,
+                fd, 0);
+        if (MAP_FAILED != ring) {
+            trace->ring = ring;
+            trace->id = __atomic_add_fetch(&ring->next_id, 1,
+                    __ATOMIC_RELAXED);
+        }
+    }
+    close(fd);
+}
+
+void trace_close(struct trace *trace)
+{
+    if (trace->ring) {
+        munmap(trace->ring, sizeof *trace->ring);
+        trace->ring = NULL;
+    }
+}
+
+static uint64_t now_us(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void trace_mark(const struct trace *trace, struct trace_mark *mark)
+{
+    if (!trace->ring)
+        return;
+
+    mark->wall = now_us(CLOCK_REALTIME);
+    mark->mono = now_us(CLOCK_MONOTONIC);
+}
+
+void trace_span(const struct trace *trace, const struct trace_mark *mark,
+        enum trace_phase phase, unsigned int hop, int result,
+        const char *detail)
+{
+    if (!trace->ring)
+        return;
+
+    trace_record(trace, mark->wall, now_us(CLOCK_MONOTONIC) - mark->mono,
+            phase, hop, result, detail);
+}
+
+void trace_record(const struct trace *trace, uint64_t start,
+        uint64_t duration, enum trace_phase phase, unsigned int hop,
+        int result, const char *detail)
+{
+    struct trace_span *span;
+    uint64_t seq;
+
+    if (!trace->ring)
+        return;
+
+    seq = __atomic_add_fetch(&trace->ring->next_seq, 1, __ATOMIC_RELAXED);
+    span = &trace->ring->spans[seq % TRACE_SPANS];
+
+    __atomic_store_n(&span->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    span->id = trace->id;
+    span->start = start;
+    span->duration = duration > UINT32_MAX ? UINT32_MAX : duration;
+    span->phase = phase;
+    span->hop = hop;
+    span->result = result;
+    span->pid = getpid();
+    memset(span->detail, 0, sizeof span->detail);
+    if (detail)
+        strncpy(span->detail, detail, sizeof span->detail - 1);
+
+    __atomic_store_n(&span->seq, seq, __ATOMIC_RELEASE);
+}
+
+static int compare_seq(const void *a, const void *b)
+{
+    const struct trace_span *x = a, *y = b;
+
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+int trace_snapshot(const char *dir, struct trace_span **spans, size_t *count)
+{
+    struct trace_ring *ring;
+    struct trace_span *copy;
+    uint64_t seq;
+    size_t i, n = 0;
+    struct stat sb;
+    int fd;
+
+    *spans = NULL;
+    *count = 0;
+
+    fd = open_ring(dir, 0);
+    if (fd < 0)
+        return 0;
+    if (0 != fstat(fd, &sb) || (size_t) sb.st_size != sizeof *ring) {
+        close(fd);
+        return 0;
+    }
+    ring = mmap(NULL, sizeof *ring, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == ring)
+        return 0;
+
+    copy = calloc(TRACE_SPANS, sizeof *copy);
+    if (!copy || 0 != memcmp(ring->magic, trace_magic, sizeof trace_magic)) {
+        free(copy);
+        munmap(ring, sizeof *ring);
+        return 0;
+    }
+
+    for (i = 0; i < TRACE_SPANS; i++) {
+        seq = __atomic_load_n(&ring->spans[i].seq, __ATOMIC_ACQUIRE);
+        if (!seq)
+            continue;
+        memcpy(&copy[n], &ring->spans[i], sizeof copy[n]);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (seq != __atomic_load_n(&ring->spans[i].seq, __ATOMIC_RELAXED))
+            continue;
+        copy[n].seq = seq;
+        copy[n].detail[sizeof copy[n].detail - 1] = '\0';
+        n++;
+    }
+    munmap(ring, sizeof *ring);
+
+    qsort(copy, n, sizeof *copy, compare_seq);
+    *spans = copy;
+    *count = n;
+
+    return 1;
+}
@@ -0,0 +1,90 @@
+#ifndef _EID_PAM_TRACE_H
+#define _EID_PAM_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Timing of the phases of each authentication. The spans are written to a
+ * ring buffer in a file below the runtime directory, which all processes
+ * map. Writers don't take locks; a reader detects spans that are being
+ * overwritten by their sequence number. */
+
+enum trace_phase {
+    TRACE_TOTAL,
+    TRACE_GETPWNAM,
+    TRACE_REFERENCE,
+    TRACE_DROP_PRIVS,
+    TRACE_CACHE,
+    TRACE_FLIGHT,
+    TRACE_QUEUE,
+    /* request to the eID client (hop 0) or the eService */
+    TRACE_REQUEST,
+    TRACE_DNS,
+    TRACE_CONNECT,
+    TRACE_TLS,
+    TRACE_TRANSFER,
+    /* speculative connection to the eService */
+    TRACE_PREWARM,
+    /* Status requests racing for the fastest eID client */
+    TRACE_SELECT,
+    TRACE_LAST,
+};
+
+/* number of spans in the ring */
+#define TRACE_SPANS 4096
+#define TRACE_DETAIL_MAX 48
+
+struct trace_span {
+    /* 0 while being written */
+    uint64_t seq;
+    /* identifies the authentication */
+    uint64_t id;
+    /* wall clock and duration in microseconds */
+    uint64_t start;
+    uint32_t duration;
+    uint16_t phase;
+    uint16_t hop;
+    int32_t result;
+    int32_t pid;
+    char detail[TRACE_DETAIL_MAX];
+};
+
+struct trace_ring;
+
+struct trace {
+    /* NULL if tracing is disabled */
+    struct trace_ring *ring;
+    uint64_t id;
+};
+
+/* point in time, in microseconds */
+struct trace_mark {
+    uint64_t wall;
+    uint64_t mono;
+};
+
+/* Maps the ring in dir and starts a new authentication. On failure, tracing
+ * is silently disabled. */
+void trace_open(struct trace *trace, const char *dir);
+
+void trace_close(struct trace *trace);
+
+/* Does nothing if tracing is disabled */
+void trace_mark(const struct trace *trace, struct trace_mark *mark);
+
+/* Records the span from mark until now */
+void trace_span(const struct trace *trace, const struct trace_mark *mark,
+        enum trace_phase phase, unsigned int hop, int result,
+        const char *detail);
+
+void trace_record(const struct trace *trace, uint64_t start,
+        uint64_t duration, enum trace_phase phase, unsigned int hop,
+        int result, const char *detail);
+
+const char *trace_phase_name(unsigned int phase);
+
+/* Copies the consistent spans of the ring in dir in the order they were
+ * written. Returns 0 if there is no ring. */
+int trace_snapshot(const char *dir, struct trace_span **spans, size_t *count);
+
+#endif